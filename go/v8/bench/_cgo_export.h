@@ -0,0 +1,32 @@
+// Public Domain (-) 2018-present, The Espian Source Authors.
+// See the Espian Source UNLICENSE file for details.
+
+// Declarations of the Go callbacks which binding.cc calls into, so that it can
+// be linked against the stub implementations in bench.cc instead of cgo's
+// generated exports.
+
+#include <stddef.h>
+#include <stdint.h>
+
+module_source* getModuleSources(int32_t id,
+                                char** urls,
+                                char** errs,
+                                int n);
+char** resolveModuleURLs(int32_t id,
+                         char** specifiers,
+                         char** referrers,
+                         char** errs,
+                         int n);
+void asyncResultCb(int64_t token,
+                   int status,
+                   char* result,
+                   size_t length);
+void recvCb(int32_t id, char* msg, size_t length);
+void recvAsyncCb(int32_t id, int64_t promise_id, char* msg, size_t length);
+void recvBytesCb(int32_t id, void* data, size_t length);
+void recvValueCb(int32_t id, void* data, size_t length);
+char* recvSyncCb(int32_t id,
+                 char* msg,
+                 size_t length,
+                 size_t* response_length);
+int readSourceCb(int64_t token, char* buf, size_t size);
@@ -0,0 +1,317 @@
+// Public Domain (-) 2018-present, The Espian Source Authors.
+// See the Espian Source UNLICENSE file for details.
+
+// A standalone benchmark harness for the binding's hot paths, which calls
+// binding.h directly so that the cost of cgo is excluded. The Go callbacks
+// are replaced by the minimal stubs below.
+//
+// Usage: bench [max_threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "binding.h"
+
+extern "C" {
+#include "_cgo_export.h"
+}
+
+namespace {
+
+// The payload sizes used by the messaging benchmarks, in bytes.
+const size_t kPayloadSizes[] = {16, 1024, 64 * 1024};
+
+const char kRecvScript[] =
+    "$recv(function(msg) {});\n"
+    "$recvSync(function(msg) { return msg; });\n";
+
+std::atomic<int64_t> received(0);
+std::unordered_map<std::string, std::string> module_sources;
+
+typedef std::chrono::steady_clock Clock;
+
+int64_t Since(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                              start)
+      .count();
+}
+
+// Histogram records latencies in power-of-two buckets of nanoseconds.
+class Histogram {
+ public:
+  Histogram() : buckets_(64, 0), count_(0), max_(0) {}
+
+  void Record(int64_t ns) {
+    int bucket = 0;
+    while (bucket < 63 && (int64_t(1) << (bucket + 1)) <= ns) {
+      bucket++;
+    }
+    buckets_[bucket]++;
+    count_++;
+    max_ = std::max(max_, ns);
+  }
+
+  // Percentile returns the upper bound of the bucket containing the given
+  // percentile.
+  int64_t Percentile(double p) const {
+    int64_t target = int64_t(p * count_);
+    int64_t seen = 0;
+    for (int bucket = 0; bucket < 64; bucket++) {
+      seen += buckets_[bucket];
+      if (seen > target) {
+        return int64_t(1) << (bucket + 1);
+      }
+    }
+    return max_;
+  }
+
+  void Print(const char* name, int64_t elapsed_ns) const {
+    printf("%-28s %10.0f msgs/s  p50 <%8lldns  p99 <%8lldns  max %8lldns\n",
+           name, count_ * 1e9 / elapsed_ns, (long long)Percentile(0.50),
+           (long long)Percentile(0.99), (long long)max_);
+  }
+
+ private:
+  std::vector<int64_t> buckets_;
+  int64_t count_;
+  int64_t max_;
+};
+
+void Check(worker* w, int r) {
+  if (r != 0) {
+    fprintf(stderr, "bench: %s\n", worker_last_exception(w));
+    exit(1);
+  }
+}
+
+worker* NewWorker(int id) {
+  worker* w = worker_init(id, 0, NULL, 0);
+  Check(w, worker_load_script(w, (char*)"bench.js", (char*)kRecvScript));
+  return w;
+}
+
+// SendSync calls worker_send_sync with a reusable response buffer, like Go
+// does.
+void SendSync(worker* w, const std::string& msg) {
+  static thread_local std::vector<char> buf(4096);
+  size_t n = worker_send_sync(w, msg.data(), msg.size(), buf.data(),
+                              buf.size());
+  if (n > buf.size()) {
+    std::vector<char> large(n);
+    worker_read_result(w, large.data());
+  }
+}
+
+void BenchInit(int iterations) {
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < iterations; i++) {
+    worker_dispose(worker_init(i, 0, NULL, 0));
+  }
+  printf("%-28s %10.0f us/op\n", "worker_init",
+         Since(start) / 1e3 / iterations);
+}
+
+void BenchLoadScript(int iterations) {
+  std::string source;
+  for (int i = 0; i < 100; i++) {
+    source += "function f() { return [1, 2, 3].map(x => x * 2); }\n";
+  }
+  worker* w = worker_init(0, 0, NULL, 0);
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < iterations; i++) {
+    std::string name = "bench" + std::to_string(i) + ".js";
+    Check(w, worker_load_script(w, (char*)name.c_str(),
+                                (char*)source.c_str()));
+  }
+  printf("%-28s %10.0f us/op\n", "worker_load_script",
+         Since(start) / 1e3 / iterations);
+  worker_dispose(w);
+}
+
+// BuildModuleGraph populates module_sources with a graph in which each module
+// imports four others, down to the given depth.
+void BuildModuleGraph(const std::string& name, int level, int depth) {
+  std::string source;
+  if (level < depth) {
+    for (int i = 0; i < 4; i++) {
+      std::string child = name + "_" + std::to_string(i);
+      source += "import './" + child + ".js';\n";
+      BuildModuleGraph(child, level + 1, depth);
+    }
+  }
+  source += "export const value = 1;\n";
+  module_sources[name + ".js"] = source;
+}
+
+void BenchLoadModule(int iterations) {
+  module_sources.clear();
+  BuildModuleGraph("root", 0, 3);
+  int64_t total = 0;
+  for (int i = 0; i < iterations; i++) {
+    worker* w = worker_init(0, 0, NULL, 0);
+    Clock::time_point start = Clock::now();
+    Check(w, worker_load_module(w, (char*)"root.js", 0));
+    total += Since(start);
+    worker_dispose(w);
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "worker_load_module (%zu)",
+           module_sources.size());
+  printf("%-28s %10.0f us/op\n", name, total / 1e3 / iterations);
+}
+
+void BenchSend(bool sync, size_t size, int iterations) {
+  worker* w = NewWorker(0);
+  std::string msg(size, 'x');
+  Histogram h;
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < iterations; i++) {
+    Clock::time_point t = Clock::now();
+    if (sync) {
+      SendSync(w, msg);
+    } else {
+      Check(w, worker_send(w, msg.data(), msg.size()));
+    }
+    h.Record(Since(t));
+  }
+  int64_t elapsed = Since(start);
+  char name[64];
+  snprintf(name, sizeof(name), "%s %zuB",
+           sync ? "worker_send_sync" : "worker_send", size);
+  h.Print(name, elapsed);
+  worker_dispose(w);
+}
+
+// BenchJSSend measures the $send callback path from JavaScript into the
+// embedder.
+void BenchJSSend(size_t size, int iterations) {
+  worker* w = worker_init(0, 0, NULL, 0);
+  std::string source = "var msg = 'x'.repeat(" + std::to_string(size) +
+                       ");\n"
+                       "$recv(function(n) {\n"
+                       "  for (var i = 0; i < +n; i++) $send(msg);\n"
+                       "});\n";
+  Check(w, worker_load_script(w, (char*)"bench.js", (char*)source.c_str()));
+  received = 0;
+  Clock::time_point start = Clock::now();
+  std::string n = std::to_string(iterations);
+  Check(w, worker_send(w, n.data(), n.size()));
+  int64_t elapsed = Since(start);
+  std::string name = "$send " + std::to_string(size) + "B";
+  printf("%-28s %10.0f msgs/s\n", name.c_str(), received * 1e9 / elapsed);
+  worker_dispose(w);
+}
+
+// BenchScaling measures the aggregate worker_send_sync throughput with one
+// worker per thread.
+void BenchScaling(int threads, int iterations) {
+  std::vector<worker*> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(NewWorker(t));
+  }
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> pool;
+  for (int t = 0; t < threads; t++) {
+    worker* w = workers[t];
+    pool.push_back(std::thread([w, iterations] {
+      for (int i = 0; i < iterations; i++) {
+        SendSync(w, "ping");
+      }
+    }));
+  }
+  for (auto& thread : pool) {
+    thread.join();
+  }
+  int64_t elapsed = Since(start);
+  printf("%-28s %10.0f msgs/s\n",
+         ("scaling " + std::to_string(threads) + " threads").c_str(),
+         double(threads) * iterations * 1e9 / elapsed);
+  for (worker* w : workers) {
+    worker_dispose(w);
+  }
+}
+
+}  // namespace
+
+extern "C" {
+
+module_source* getModuleSources(int32_t id, char** urls, char** errs, int n) {
+  module_source* sources = (module_source*)malloc(n * sizeof(module_source));
+  for (int i = 0; i < n; i++) {
+    std::string url = urls[i];
+    if (url.compare(0, 2, "./") == 0) {
+      url = url.substr(2);
+    }
+    const std::string& source = module_sources[url];
+    sources[i].data = strdup(source.c_str());
+    sources[i].length = source.size();
+    sources[i].file = NULL;
+    errs[i] = NULL;
+  }
+  return sources;
+}
+
+char** resolveModuleURLs(int32_t id, char** specifiers, char** referrers,
+                         char** errs, int n) {
+  return NULL;
+}
+
+void asyncResultCb(int64_t token, int status, char* result,
+                   size_t length) {}
+
+void recvCb(int32_t id, char* msg, size_t length) {
+  received++;
+}
+
+void recvAsyncCb(int32_t id, int64_t promise_id, char* msg, size_t length) {}
+
+void recvBytesCb(int32_t id, void* data, size_t length) {}
+
+void recvValueCb(int32_t id, void* data, size_t length) {}
+
+int readSourceCb(int64_t token, char* buf, size_t size) {
+  return 0;
+}
+
+char* recvSyncCb(int32_t id, char* msg, size_t length,
+                 size_t* response_length) {
+  char* response = (char*)malloc(length);
+  memcpy(response, msg, length);
+  *response_length = length;
+  return response;
+}
+
+}  // extern "C"
+
+int main(int argc, char** argv) {
+  int max_threads = std::thread::hardware_concurrency();
+  if (argc > 1) {
+    max_threads = atoi(argv[1]);
+  }
+  v8_init(NULL);
+  printf("V8 %s\n\n", worker_version());
+
+  BenchInit(100);
+  BenchLoadScript(1000);
+  BenchLoadModule(20);
+  for (size_t size : kPayloadSizes) {
+    BenchSend(false, size, 100000);
+  }
+  for (size_t size : kPayloadSizes) {
+    BenchSend(true, size, 100000);
+  }
+  for (size_t size : kPayloadSizes) {
+    BenchJSSend(size, 100000);
+  }
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    BenchScaling(threads, 100000);
+  }
+  return 0;
+}
@@ -0,0 +1,29 @@
+#! /usr/bin/env bash
+
+# Public Domain (-) 2018-present, The Espian Source Authors.
+# See the Espian Source UNLICENSE file for details.
+
+# Builds the standalone benchmark harness against binding.h, using the V8
+# headers and libraries in the parent directory's include and lib directories.
+
+set -e -o pipefail
+
+cd "$(dirname "$0")"
+
+OS_NAME=$(uname -s | tr 'A-Z' 'a-z')
+
+# Extra flags can be passed with CXXFLAGS, e.g. CXXFLAGS=-DV8WORKER_TRACE to
+# include the latency tracing of calls.
+#
+# binding.cc includes _cgo_export.h from its own directory first, so it's
+# compiled from a copy next to the stub declarations.
+mkdir -p build
+cp ../binding.cc ../binding.h _cgo_export.h build/
+
+c++ -O2 -std=c++11 ${CXXFLAGS:-} -I build -I ../include \
+    -o build/bench bench.cc build/binding.cc \
+    -L "../lib/${OS_NAME}.x64" \
+    -lv8_base -lv8_libplatform -lv8_libbase -lv8_libsampler -lv8_snapshot \
+    -ldl -pthread
+
+echo "Built bench/build/bench"
@@ -1,22 +1,627 @@
 #include "binding.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "libplatform/libplatform.h"
+#include "v8-profiler.h"
 #include "v8.h"
 
 using namespace v8;
 
+// MPSCQueue is a lock-free, intrusive queue with multiple producers and a
+// single consumer, using Dmitry Vyukov's algorithm. T needs to be default
+// constructible and have a std::atomic<T*> next field.
+template <typename T>
+class MPSCQueue {
+ public:
+  MPSCQueue() : head_(&stub_), tail_(&stub_) { stub_.next = NULL; }
+
+  // Push can be called from any thread.
+  void Push(T* item) {
+    item->next.store(NULL, std::memory_order_relaxed);
+    T* prev = head_.exchange(item, std::memory_order_acq_rel);
+    prev->next.store(item, std::memory_order_release);
+  }
+
+  // Pop must only be called from the consumer thread. It returns NULL if the
+  // queue is empty, or if a producer is midway through a Push.
+  T* Pop() {
+    T* tail = tail_;
+    T* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+      if (next == NULL) {
+        return NULL;
+      }
+      tail_ = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != NULL) {
+      tail_ = next;
+      return tail;
+    }
+    if (tail != head_.load(std::memory_order_acquire)) {
+      return NULL;
+    }
+    Push(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != NULL) {
+      tail_ = next;
+      return tail;
+    }
+    return NULL;
+  }
+
+ private:
+  std::atomic<T*> head_;
+  T* tail_;
+  T stub_;
+};
+
+// BoundedQueue is a lock-free, bounded queue with multiple producers and
+// consumers, using Dmitry Vyukov's algorithm. Its capacity is rounded up to a
+// power of two.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : head_(0), tail_(0) {
+    size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    cells_ = new Cell[size];
+    for (size_t i = 0; i < size; i++) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  ~BoundedQueue() { delete[] cells_; }
+
+  // Push returns false if the queue is full.
+  bool Push(const T& value) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = intptr_t(seq) - intptr_t(pos);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = value;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pop returns false if the queue is empty.
+  bool Pop(T* value) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    *value = cell->value;
+    cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  Cell* cells_;
+  size_t mask_;
+  std::atomic<size_t> head_;
+  std::atomic<size_t> tail_;
+};
+
+// AsyncCall is a call queued for a worker's event loop thread, either by
+// worker_send_async, or for delivering the messages on a channel.
+struct AsyncCall {
+  std::atomic<AsyncCall*> next;
+  int64_t token;
+  int sync;
+  std::string msg;
+  channel* chan;
+};
+
+// Settlement is the outcome of a $sendAsync call, queued by worker_settle for
+// whichever thread next holds the isolate's lock.
+struct Settlement {
+  std::atomic<Settlement*> next;
+  int64_t id;
+  int status;
+  std::string value;
+};
+
+// CountingAllocator is the ArrayBuffer allocator used by workers. It allocates
+// with calloc and malloc, like V8's default allocator, and keeps track of the
+// memory outstanding. Buffers may be freed from GC threads, so the counters
+// are atomic.
+class CountingAllocator : public ArrayBuffer::Allocator {
+ public:
+  CountingAllocator() : outstanding_(0), peak_(0), allocations_(0) {}
+
+  void* Allocate(size_t length) override {
+    return Track(calloc(length, 1), length);
+  }
+
+  void* AllocateUninitialized(size_t length) override {
+    return Track(malloc(length), length);
+  }
+
+  void Free(void* data, size_t length) override {
+    Untrack(data, length);
+    free(data);
+  }
+
+  // Trim releases any memory which the allocator has cached for reuse.
+  virtual void Trim() {}
+
+  virtual void GetStats(array_buffer_stats* stats) {
+    stats->outstanding_bytes = outstanding_;
+    stats->peak_outstanding_bytes = peak_;
+    stats->allocations = allocations_;
+    stats->pooled_allocations = 0;
+    stats->cached_bytes = 0;
+  }
+
+ protected:
+  void* Track(void* data, size_t length) {
+    if (data == NULL) {
+      return NULL;
+    }
+    allocations_++;
+    int64_t outstanding = outstanding_ += length;
+    int64_t peak = peak_;
+    while (outstanding > peak &&
+           !peak_.compare_exchange_weak(peak, outstanding)) {
+    }
+    return data;
+  }
+
+  void Untrack(void* data, size_t length) {
+    if (data != NULL) {
+      outstanding_ -= length;
+    }
+  }
+
+ private:
+  std::atomic<int64_t> outstanding_;
+  std::atomic<int64_t> peak_;
+  std::atomic<int64_t> allocations_;
+};
+
+// PoolAllocator recycles the memory of small ArrayBuffers through free lists
+// for power-of-two size classes, so that workloads which create many
+// short-lived typed arrays avoid most of the malloc traffic and the
+// fragmentation that comes with it. Each class caches at most kMaxCachedBytes,
+// and buffers larger than the largest class are passed through to malloc.
+class PoolAllocator : public CountingAllocator {
+ public:
+  PoolAllocator() : pooled_(0) {
+    for (int c = 0; c < kClasses; c++) {
+      free_[c] = NULL;
+      cached_[c] = 0;
+    }
+  }
+
+  ~PoolAllocator() override { Trim(); }
+
+  void* Allocate(size_t length) override {
+    int c = SizeClass(length);
+    if (c < 0) {
+      return CountingAllocator::Allocate(length);
+    }
+    void* data = Take(c);
+    if (data != NULL) {
+      memset(data, 0, length);
+    } else {
+      data = calloc(ClassSize(c), 1);
+    }
+    return Track(data, length);
+  }
+
+  void* AllocateUninitialized(size_t length) override {
+    int c = SizeClass(length);
+    if (c < 0) {
+      return CountingAllocator::AllocateUninitialized(length);
+    }
+    void* data = Take(c);
+    if (data == NULL) {
+      data = malloc(ClassSize(c));
+    }
+    return Track(data, length);
+  }
+
+  void Free(void* data, size_t length) override {
+    int c = SizeClass(length);
+    if (c < 0 || data == NULL) {
+      CountingAllocator::Free(data, length);
+      return;
+    }
+    Untrack(data, length);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cached_[c] + ClassSize(c) > kMaxCachedBytes) {
+      free(data);
+      return;
+    }
+    Block* block = static_cast<Block*>(data);
+    block->next = free_[c];
+    free_[c] = block;
+    cached_[c] += ClassSize(c);
+  }
+
+  void Trim() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int c = 0; c < kClasses; c++) {
+      while (free_[c] != NULL) {
+        Block* block = free_[c];
+        free_[c] = block->next;
+        free(block);
+      }
+      cached_[c] = 0;
+    }
+  }
+
+  void GetStats(array_buffer_stats* stats) override {
+    CountingAllocator::GetStats(stats);
+    stats->pooled_allocations = pooled_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int c = 0; c < kClasses; c++) {
+      stats->cached_bytes += cached_[c];
+    }
+  }
+
+ private:
+  static const int kMinClassBits = 4;
+  static const int kMaxClassBits = 16;
+  static const int kClasses = kMaxClassBits - kMinClassBits + 1;
+  static const size_t kMaxCachedBytes = 1 << 20;
+
+  struct Block {
+    Block* next;
+  };
+
+  static size_t ClassSize(int c) { return size_t(1) << (c + kMinClassBits); }
+
+  // SizeClass returns the smallest class which fits length, or -1 if there
+  // is none.
+  static int SizeClass(size_t length) {
+    if (length > ClassSize(kClasses - 1)) {
+      return -1;
+    }
+    int c = 0;
+    while (ClassSize(c) < length) {
+      c++;
+    }
+    return c;
+  }
+
+  void* Take(int c) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Block* block = free_[c];
+    if (block == NULL) {
+      return NULL;
+    }
+    free_[c] = block->next;
+    cached_[c] -= ClassSize(c);
+    pooled_++;
+    return block;
+  }
+
+  std::mutex mutex_;
+  Block* free_[kClasses];
+  size_t cached_[kClasses];
+  std::atomic<int64_t> pooled_;
+};
+
+// Allocator kinds, as selected by worker_init.
+enum { kMallocAllocator, kPoolAllocator };
+
+CountingAllocator* NewAllocator(int kind) {
+  if (kind == kPoolAllocator) {
+    return new PoolAllocator();
+  }
+  return new CountingAllocator();
+}
+
+#ifdef V8WORKER_TRACE
+// TraceHistogram records the durations of a phase of a call in power-of-two
+// buckets of nanoseconds. It's mostly written by the thread holding the
+// isolate's lock, but $sendSync records its call into Go while the isolate is
+// released, and it can be read at any time, so the counters are atomics which
+// are updated without ordering.
+struct TraceHistogram {
+  TraceHistogram() : count(0), total_ns(0) {
+    for (int i = 0; i < TRACE_BUCKETS; i++) {
+      buckets[i] = 0;
+    }
+  }
+
+  void Record(int64_t ns) {
+    int bucket = ns > 0 ? 63 - __builtin_clzll(uint64_t(ns)) : 0;
+    bucket = std::min(bucket, TRACE_BUCKETS - 1);
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  std::atomic<int64_t> count;
+  std::atomic<int64_t> total_ns;
+  std::atomic<int64_t> buckets[TRACE_BUCKETS];
+};
+#endif
+
 struct worker_s {
   int id;
   Isolate* isolate;
+  // The worker which owns the isolate, which is the worker itself unless it
+  // was created by worker_new_context. The owner is only freed, along with
+  // the isolate, once it and all the contexts sharing its isolate have been
+  // disposed.
+  worker* owner;
+  std::atomic<int> refs;
+  CountingAllocator* allocator;
+  SnapshotCreator* snapshot_creator;
+  snapshot* startup_snapshot;
+  int enable_print;
+  size_t stack_limit_kb;
+  // Whether a stack limit has been set on the owner's isolate, which is
+  // shared by all of its contexts, see ApplyStackLimit.
+  bool stack_limited;
+  std::atomic<bool> heap_limit_reached;
+  // The initial heap limit while NearHeapLimit has raised it, or zero.
+  size_t initial_heap_limit;
+
+  // The execution limits enforced by the watchdog thread. The deadline and
+  // CPU clock are set by the outermost Watch on each call into JavaScript,
+  // and interrupt records why the watchdog terminated the call, if it did.
+  int64_t timeout_ns;
+  int64_t cpu_budget_ns;
+  std::atomic<int64_t> cpu_used_ns;
+  int64_t cpu_start_ns;
+  clockid_t cpu_clock;
+  int64_t deadline_ns;
+  std::atomic<int> watch_depth;
+  std::atomic<int> interrupt;
+
+  // The number of the worker's calls which have released the isolate with an
+  // Unlocker, e.g. during a call into Go. The watchdog leaves the termination
+  // of these to RelockIsolate, but still terminates the JavaScript of any
+  // other call which holds the isolate meanwhile, i.e. whenever there are more
+  // watched calls than released ones.
+  std::atomic<int> unlocked;
+
+  // The CPU profiler, which only exists while a profile is being recorded.
+  CpuProfiler* profiler;
+  int profile_interval_us;
+
+  // The last error, of which only the message and location are extracted
+  // eagerly, see SetException. The exception is kept so that its stack can be
+  // rendered on demand, and the id tells Go whether it's still the last one.
   std::string last_exception;
+  std::string exception_file;
+  int exception_line;
+  int exception_column;
+  int64_t exception_id;
+  Global<Value> exception;
+  Global<Message> exception_message;
+
+  // The template for the global object of the worker's contexts, which is
+  // kept across resets, so that V8 can reuse its instantiation.
+  Global<ObjectTemplate> global_template;
+
+  // The template for the port objects returned by $channel, which is
+  // created on first use, see PortTemplate.
+  Global<FunctionTemplate> port_template;
+
+#ifdef V8WORKER_TRACE
+  // The durations of the phases of traced calls, see Trace.
+  TraceHistogram trace[TRACE_OPS][TRACE_PHASES];
+#endif
+
+  // The buffer into which outbound messages are encoded before being passed
+  // to Go, and the response of the last worker_send_sync call that didn't fit
+  // into the caller's buffer.
+  std::vector<char> scratch;
+  std::string result;
+
+  // GC stats, which are updated by the GC callbacks on the thread running the
+  // GC, and can be read without holding the isolate's lock.
+  int64_t gc_start_ns;
+  std::atomic<int64_t> minor_gc_count;
+  std::atomic<int64_t> minor_gc_pause_ns;
+  std::atomic<int64_t> major_gc_count;
+  std::atomic<int64_t> major_gc_pause_ns;
+  std::atomic<int64_t> max_gc_pause_ns;
   Persistent<Function> recv;
   Persistent<Context> context;
   Persistent<Function> recv_sync_handler;
+  Persistent<Function> recv_buffer;
+  Persistent<Function> recv_batch;
+  Persistent<Function> recv_value;
+
+  // The channels attached by worker_attach_channel, keyed by name, along with
+  // the onmessage handlers that JavaScript has set for the ones this worker
+  // receives from.
+  std::unordered_map<std::string, channel*> channels;
+  std::unordered_map<std::string, Global<Function>> channel_handlers;
+
+  // The outbox for the messages of $send, if they're dispatched to Go
+  // asynchronously.
+  outbox* send_outbox;
+
+  // State for the event loop thread, which is started by the first call to
+  // worker_send_async.
+  MPSCQueue<AsyncCall> calls;
+  std::atomic<int64_t> pending_calls;
+  std::atomic<bool> stopping;
+  std::condition_variable loop_cv;
+  std::mutex loop_mutex;
+  std::once_flag loop_once;
+  std::thread loop;
+
+  // The resolvers for the Promises returned by $sendAsync, keyed by a
+  // per-worker id, along with the settlements that Go has queued for them.
+  int64_t next_promise_id;
+  std::unordered_map<int64_t, Global<Promise::Resolver>> promises;
+  MPSCQueue<Settlement> settlements;
+  std::atomic<int64_t> pending_settlements;
+  std::condition_variable settle_cv;
+  std::mutex settle_mutex;
+};
+
+struct snapshot_s {
+  StartupData blob;
+};
+
+// ChannelMessage is a value serialized by a channel's post method.
+struct ChannelMessage {
+  uint8_t* data;
+  size_t length;
+};
+
+// A channel delivers values posted by any number of workers to a single
+// receiving worker, on that worker's event loop thread. It's reference counted,
+// as it's shared between Go and all attached workers.
+struct channel_s {
+  explicit channel_s(size_t capacity)
+      : queue(capacity), refs(1), receiver(NULL), scheduled(false) {}
+
+  BoundedQueue<ChannelMessage> queue;
+  std::atomic<int> refs;
+  std::mutex mutex;  // guards receiver
+  worker* receiver;
+  std::string receiver_name;
+
+  // Whether a delivery has been queued for the receiver's event loop thread,
+  // so that bursts of posts only result in one.
+  std::atomic<bool> scheduled;
+};
+
+void ChannelUnref(channel* c) {
+  if (--c->refs > 0) {
+    return;
+  }
+  ChannelMessage m;
+  while (c->queue.Pop(&m)) {
+    free(m.data);
+  }
+  delete c;
+}
+
+// An outbox queues the messages of $send for a goroutine in Go, which receives
+// them in batches with outbox_wait, so that JavaScript doesn't wait for Go and
+// a single cgo call covers many messages. It's reference counted, as it's
+// shared between the worker and the goroutine, which may outlive it.
+struct outbox_s {
+  explicit outbox_s(size_t capacity)
+      : queue(capacity),
+        capacity(capacity),
+        refs(2),
+        pending(0),
+        waiters(0),
+        closed(false) {}
+
+  BoundedQueue<outbox_message> queue;
+  int64_t capacity;
+  std::atomic<int> refs;
+  std::atomic<int64_t> pending;
+
+  // The number of threads waiting on cv, either for messages or for space,
+  // so that the other side only needs to take the mutex if there are any.
+  std::atomic<int> waiters;
+  std::atomic<bool> closed;
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  // The messages returned by the last call to outbox_wait, which are only
+  // freed on the next call, so that Go can read them in the meantime.
+  std::vector<outbox_message> batch;
+};
+
+void FreeOutboxBatch(outbox* o) {
+  for (auto& m : o->batch) {
+    free((void*)m.data);
+  }
+  o->batch.clear();
+}
+
+void OutboxUnref(outbox* o) {
+  if (--o->refs > 0) {
+    return;
+  }
+  outbox_message m;
+  while (o->queue.Pop(&m)) {
+    free((void*)m.data);
+  }
+  FreeOutboxBatch(o);
+  delete o;
+}
+
+// OutboxNotify wakes up any threads waiting on the outbox.
+void OutboxNotify(outbox* o) {
+  if (o->waiters > 0) {
+    {
+      std::lock_guard<std::mutex> lock(o->mutex);
+    }
+    o->cv.notify_all();
+  }
+}
+
+// Context embedder data slots. The handler slots are only populated within
+// startup snapshots, so that the $recv and $recvSync callbacks registered
+// during warm-up survive serialization.
+enum {
+  kModuleDataIndex = 1,
+  kRecvIndex = 2,
+  kRecvSyncIndex = 3,
+  kRecvBufferIndex = 4,
+  kRecvBatchIndex = 5,
+  kRecvValueIndex = 6,
+  kWorkerIndex = 7,
 };
 
 // Per-context Module data, allowing sharing of module maps across top-level
@@ -40,125 +645,611 @@ class ModuleData {
 
   std::unordered_map<std::string, Global<Module>> url_to_module_map;
   std::unordered_map<Global<Module>, std::string, ModuleHash> module_to_url_map;
+
+  // The urls that import specifiers have been resolved to, keyed by
+  // ResolvedKey. Specifiers which aren't in the map are used as is.
+  std::unordered_map<std::string, std::string> resolved_urls;
+
+  // Remove drops the module with the given url from the module maps.
+  void Remove(const std::string& url) {
+    auto it = url_to_module_map.find(url);
+    if (it != url_to_module_map.end()) {
+      module_to_url_map.erase(it->second);
+      url_to_module_map.erase(it);
+    }
+  }
 };
 
-// CopyString converts a std::string to a C string.
-const char* CopyString(const std::string& value) {
-  char* c = (char*)malloc(value.length());
-  strcpy(c, value.c_str());
-  return c;
+// ResolvedKey returns the key for a specifier imported by the module with the
+// given url.
+std::string ResolvedKey(const std::string& referrer,
+                        const std::string& specifier) {
+  return referrer + '\0' + specifier;
 }
 
-// ToCString extracts a C string from a V8 Utf8Value.
-const char* ToCString(const String::Utf8Value& value) {
-  return *value ? *value : "<v8worker: string conversion failed>";
-}
+// BundleModule is a module captured by LoadModule for worker_create_bundle,
+// along with the urls that its imports resolved to.
+struct BundleModule {
+  std::string url;
+  std::string source;
+  std::vector<std::pair<std::string, std::string>> imports;
+};
 
-std::string ToStdString(Isolate* isolate, Local<String> value) {
-  String::Utf8Value utf8(isolate, value);
-  return *utf8;
+// Hash returns the 64-bit FNV-1a hash of the given data. It needs to be stable
+// across processes, as it's used to name the code cache files on disk.
+uint64_t Hash(const char* data, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
 }
 
-// ExceptionString gathers details about the latest Exception.
-std::string ExceptionString(Isolate* isolate,
-                            Local<Context> context,
-                            TryCatch* try_catch) {
-  std::string out;
-  size_t scratchSize = 20;
-  char scratch[scratchSize];
-
-  HandleScope handle_scope(isolate);
-  String::Utf8Value exception(try_catch->Exception());
-  const char* exception_string = ToCString(exception);
+// CodeCache is a process-wide store of the code caches produced by V8 for
+// compiled scripts, keyed by their url and a hash of their source code. Entries
+// are optionally persisted within a directory on disk.
+class CodeCache {
+ public:
+  typedef std::shared_ptr<const std::string> Entry;
 
-  Handle<Message> message = try_catch->Message();
+  CodeCache()
+      : hits(0), misses(0), rejections(0), enabled_(false), dir_("") {}
 
-  if (message.IsEmpty()) {
-    // V8 didn't provide any extra information about this error; just
-    // print the exception.
-    out.append(exception_string);
-    out.append("\n");
-  } else {
-    // Print (filename):(line number)
-    String::Utf8Value filename(message->GetScriptOrigin().ResourceName());
-    const char* filename_string = ToCString(filename);
-    int linenum = message->GetLineNumber();
+  void Enable(const char* dir) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dir_ = dir;
+    enabled_ = true;
+  }
 
-    snprintf(scratch, scratchSize, "%i", linenum);
-    out.append(filename_string);
-    out.append(":");
-    out.append(scratch);
-    out.append("\n");
+  bool Enabled() { return enabled_; }
 
-    // Print line of source code.
-    String::Utf8Value sourceline(message->GetSourceLine());
-    const char* sourceline_string = ToCString(sourceline);
+  // Reset drops all the entries held in memory, and zeroes the stats.
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    hits = 0;
+    misses = 0;
+    rejections = 0;
+  }
 
-    out.append(sourceline_string);
-    out.append("\n");
+  // Get returns the cached data for the given key, looking on disk if it's
+  // not available in memory.
+  Entry Get(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      return it->second;
+    }
+    if (dir_.empty()) {
+      return Entry();
+    }
+    FILE* f = fopen(Path(key).c_str(), "rb");
+    if (f == NULL) {
+      return Entry();
+    }
+    std::string* data = new std::string();
+    char buf[8192];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      data->append(buf, n);
+    }
+    fclose(f);
+    Entry entry(data);
+    entries_[key] = entry;
+    return entry;
+  }
 
-    // Print wavy underline.
-    int start = message->GetStartColumn(context).FromMaybe(0);
-    for (int i = 0; i < start; i++) {
-      out.append(" ");
+  void Put(const std::string& key, const uint8_t* data, int length) {
+    Entry entry(new std::string(reinterpret_cast<const char*>(data), length));
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[key] = entry;
+    if (dir_.empty()) {
+      return;
     }
-    int end = message->GetEndColumn(context).FromMaybe(0);
-    for (int i = start; i < end; i++) {
-      out.append("^");
+    // Write to a temporary file first, so that concurrent readers in other
+    // processes never see a partial entry.
+    std::string path = Path(key);
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (f == NULL) {
+      return;
     }
-    out.append("\n");
-    String::Utf8Value stack_trace(try_catch->StackTrace());
-    if (stack_trace.length() > 0) {
-      const char* stack_trace_string = ToCString(stack_trace);
-      out.append(stack_trace_string);
-      out.append("\n");
+    bool ok = fwrite(entry->data(), 1, entry->size(), f) == entry->size();
+    if (fclose(f) == 0 && ok) {
+      rename(tmp.c_str(), path.c_str());
     } else {
-      out.append(exception_string);
-      out.append("\n");
+      remove(tmp.c_str());
     }
   }
-  return out;
+
+  // Remove drops an entry, e.g. after it's been rejected by V8 because of a
+  // mismatched version or flags.
+  void Remove(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.erase(key);
+    if (!dir_.empty()) {
+      remove(Path(key).c_str());
+    }
+  }
+
+  std::atomic<int64_t> hits;
+  std::atomic<int64_t> misses;
+  std::atomic<int64_t> rejections;
+
+ private:
+  std::string Path(const std::string& key) {
+    char name[40];
+    snprintf(name, sizeof(name), "/%016llx.v8cache",
+             (unsigned long long)Hash(key.data(), key.size()));
+    return dir_ + name;
+  }
+
+  std::atomic<bool> enabled_;
+  std::string dir_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::mutex mutex_;
+};
+
+CodeCache code_cache;
+
+// The platform which V8 was initialized with, along with whether it supports
+// idle tasks.
+Platform* default_platform = NULL;
+bool idle_tasks_enabled = false;
+
+// CodeCacheKey derives the key for a script from its url and source code.
+std::string CodeCacheKey(const char* url, const char* source) {
+  char hash[20];
+  snprintf(hash, sizeof(hash), "%016llx",
+           (unsigned long long)Hash(source, strlen(source)));
+  std::string key(url);
+  key.append(1, '\0');
+  key.append(hash);
+  return key;
 }
 
-ModuleData* GetModuleData(Local<Context> context) {
-  return static_cast<ModuleData*>(
-      context->GetAlignedPointerFromEmbedderData(1));
+// CopyString converts a std::string to a C string.
+const char* CopyString(const std::string& value) {
+  char* c = (char*)malloc(value.length() + 1);
+  memcpy(c, value.c_str(), value.length() + 1);
+  return c;
 }
 
-void InitModuleData(Local<Context> context) {
-  context->SetAlignedPointerInEmbedderData(
-      1, new ModuleData(context->GetIsolate()));
+// ToCString extracts a C string from a V8 Utf8Value.
+const char* ToCString(const String::Utf8Value& value) {
+  return *value ? *value : "<v8worker: string conversion failed>";
 }
 
-MaybeLocal<Module> ResolveModuleCallback(Local<Context> context,
-                                         Local<String> url,
-                                         Local<Module> referrer) {
-  Isolate* isolate = context->GetIsolate();
-  ModuleData* d = GetModuleData(context);
-  std::string url_str = ToStdString(isolate, url);
-  auto module_it = d->url_to_module_map.find(url_str);
-  return module_it->second.Get(isolate);
+// Utf8Size returns the number of bytes needed to encode the string as UTF-8,
+// and whether it's pure ASCII, in which case its one-byte representation can
+// be copied as is instead of being encoded.
+size_t Utf8Size(Local<String> value, bool* ascii) {
+  int size = value->Utf8Length();
+  *ascii = value->IsOneByte() && size == value->Length();
+  return size;
 }
 
-extern "C" {
-#include "_cgo_export.h"
+// EncodeString writes the string as UTF-8 into buf, which needs to have room
+// for the number of bytes returned by Utf8Size. No null terminator is written.
+void EncodeString(Local<String> value, bool ascii, char* buf, size_t size) {
+  if (ascii) {
+    value->WriteOneByte(reinterpret_cast<uint8_t*>(buf), 0, size,
+                        String::NO_NULL_TERMINATION);
+  } else {
+    int options = String::NO_NULL_TERMINATION | String::REPLACE_INVALID_UTF8;
+    value->WriteUtf8(buf, size, NULL, options);
+  }
+}
 
-void LoadModule(worker* w,
-                Local<Context> context,
-                Local<String> url,
-                MaybeLocal<Module>& mod) {
-  ScriptOrigin origin(url, Local<Integer>(), Local<Integer>(), Local<Boolean>(),
-                      Local<Integer>(), Local<Value>(), Local<Boolean>(),
-                      Local<Boolean>(), True(w->isolate));
+std::string ToStdString(Isolate* isolate, Local<String> value) {
+  bool ascii;
+  std::string out(Utf8Size(value, &ascii), '\0');
+  EncodeString(value, ascii, &out[0], out.size());
+  return out;
+}
 
-  std::string url_str = ToStdString(w->isolate, url);
-  char* source_str = getModuleSource(w->id, (char*)url_str.c_str());
-  Local<String> source_text = String::NewFromUtf8(w->isolate, source_str);
+// ScratchString encodes the string into the worker's scratch buffer, which is
+// reused across calls, and returns its length. The encoded string is null
+// terminated, and remains valid until the next call.
+size_t ScratchString(worker* w, Local<String> value) {
+  bool ascii;
+  size_t size = Utf8Size(value, &ascii);
+  if (w->scratch.size() < size + 1) {
+    w->scratch.resize(size + 1);
+  }
+  EncodeString(value, ascii, w->scratch.data(), size);
+  w->scratch[size] = '\0';
+  return size;
+}
+
+// Messages from Go which are at least this large, and pure ASCII, are created
+// as external strings, which keeps them out of the JavaScript heap.
+const size_t kExternalStringThreshold = 16 * 1024;
+
+// ExternalMessage holds a copy of a message from Go for an external string.
+// Go memory can't be retained beyond a call, so the copy can't be avoided,
+// but it's a plain memcpy and the GC never has to move the contents.
+class ExternalMessage : public String::ExternalOneByteStringResource {
+ public:
+  ExternalMessage(const char* data, size_t length)
+      : data_(static_cast<char*>(malloc(length))), length_(length) {
+    memcpy(data_, data, length);
+  }
+
+  ~ExternalMessage() override { free(data_); }
+
+  const char* data() const override { return data_; }
+  size_t length() const override { return length_; }
+
+ private:
+  char* data_;
+  size_t length_;
+};
+
+bool IsASCII(const char* data, size_t length) {
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    if (word & 0x8080808080808080ULL) {
+      return false;
+    }
+  }
+  for (; i < length; i++) {
+    if (data[i] & 0x80) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// NewMessageString creates a string from a message of the given length, which
+// doesn't need to be null terminated. External strings can't be serialized, so
+// snapshot creators always get regular ones.
+Local<String> NewMessageString(worker* w, const char* data, size_t length) {
+  if (length == 0) {
+    return String::Empty(w->isolate);
+  }
+  if (length >= kExternalStringThreshold && w->snapshot_creator == NULL &&
+      IsASCII(data, length)) {
+    ExternalMessage* resource = new ExternalMessage(data, length);
+    Local<String> value;
+    if (String::NewExternalOneByte(w->isolate, resource).ToLocal(&value)) {
+      return value;
+    }
+    delete resource;
+  }
+  return String::NewFromUtf8(w->isolate, data, NewStringType::kNormal, length)
+      .FromMaybe(String::Empty(w->isolate));
+}
+
+// A read-only memory mapping of a file, e.g. a bundle of module sources. It's
+// reference counted, as it's shared between Go and the external strings of any
+// number of workers, and is only unmapped once all of them have released it.
+struct mapped_file_s {
+  void* data;
+  size_t size;
+  std::atomic<int> refs;
+};
+
+void MappedFileUnref(mapped_file* f) {
+  if (--f->refs > 0) {
+    return;
+  }
+  if (f->size > 0) {
+    munmap(f->data, f->size);
+  }
+  delete f;
+}
+
+// MappedSource is the resource of an external string whose contents are part
+// of a mapped file, so that they're shared by all workers rather than copied
+// into each of their heaps.
+class MappedSource : public String::ExternalOneByteStringResource {
+ public:
+  MappedSource(mapped_file* file, const char* data, size_t length)
+      : file_(file), data_(data), length_(length) {
+    file_->refs++;
+  }
+
+  ~MappedSource() override { MappedFileUnref(file_); }
+
+  const char* data() const override { return data_; }
+  size_t length() const override { return length_; }
+
+ private:
+  mapped_file* file_;
+  const char* data_;
+  size_t length_;
+};
+
+// FreeModuleSource frees a module source from Go, or releases Go's reference
+// to the mapped file it's within.
+void FreeModuleSource(const module_source& source) {
+  if (source.file == NULL) {
+    free((void*)source.data);
+  } else {
+    MappedFileUnref(source.file);
+  }
+}
+
+// NewModuleSource creates the string for a module source. Sources within a
+// mapped file are used in place if they're ASCII, as one-byte external strings
+// can't represent the rest of UTF-8, while others are copied. The source
+// itself is left to the caller to free.
+Local<String> NewModuleSource(worker* w, const module_source& source) {
+  if (source.file != NULL && w->snapshot_creator == NULL &&
+      IsASCII(source.data, source.length)) {
+    MappedSource* resource =
+        new MappedSource(source.file, source.data, source.length);
+    Local<String> value;
+    if (String::NewExternalOneByte(w->isolate, resource).ToLocal(&value)) {
+      return value;
+    }
+    delete resource;
+  }
+  return NewMessageString(w, source.data, source.length);
+}
+
+// GetLocation extracts the file, line and one-based column of an exception's
+// message.
+void GetLocation(Local<Context> context,
+                 Local<Message> message,
+                 std::string* file,
+                 int* line,
+                 int* column) {
+  String::Utf8Value filename(message->GetScriptOrigin().ResourceName());
+  *file = *filename ? *filename : "";
+  *line = message->GetLineNumber(context).FromMaybe(0);
+  *column = message->GetStartColumn(context).FromMaybe(-1) + 1;
+}
+
+// FormatError describes an error by its message and location, if it has one.
+std::string FormatError(const std::string& message,
+                        const std::string& file,
+                        int line,
+                        int column) {
+  if (file.empty()) {
+    return message;
+  }
+  char scratch[32];
+  snprintf(scratch, sizeof(scratch), ":%d:%d: ", line, column);
+  return file + scratch + message;
+}
+
+// ExceptionSummary describes the caught exception by its message and location
+// only, which, unlike RenderException, doesn't need its stack to be formatted.
+std::string ExceptionSummary(Isolate* isolate,
+                             Local<Context> context,
+                             TryCatch* try_catch) {
+  HandleScope handle_scope(isolate);
+  String::Utf8Value exception(try_catch->Exception());
+  Local<Message> message = try_catch->Message();
+  if (message.IsEmpty()) {
+    return ToCString(exception);
+  }
+  std::string file;
+  int line, column;
+  GetLocation(context, message, &file, &line, &column);
+  return FormatError(ToCString(exception), file, line, column);
+}
+
+// RenderException renders the full details of an exception: its location, the
+// line of source code with a wavy underline, and its stack trace. The message
+// may be empty, in which case only the exception itself is rendered.
+std::string RenderException(Isolate* isolate,
+                            Local<Context> context,
+                            Local<Value> exception,
+                            Local<Message> message) {
+  std::string out;
+  size_t scratchSize = 20;
+  char scratch[scratchSize];
+
+  HandleScope handle_scope(isolate);
+  String::Utf8Value exception_value(exception);
+  const char* exception_string = ToCString(exception_value);
+
+  if (message.IsEmpty()) {
+    // V8 didn't provide any extra information about this error; just
+    // print the exception.
+    out.append(exception_string);
+    out.append("\n");
+  } else {
+    // Print (filename):(line number)
+    String::Utf8Value filename(message->GetScriptOrigin().ResourceName());
+    const char* filename_string = ToCString(filename);
+    int linenum = message->GetLineNumber();
+
+    snprintf(scratch, scratchSize, "%i", linenum);
+    out.append(filename_string);
+    out.append(":");
+    out.append(scratch);
+    out.append("\n");
+
+    // Print line of source code.
+    String::Utf8Value sourceline(message->GetSourceLine());
+    const char* sourceline_string = ToCString(sourceline);
+
+    out.append(sourceline_string);
+    out.append("\n");
+
+    // Print wavy underline.
+    int start = message->GetStartColumn(context).FromMaybe(0);
+    for (int i = 0; i < start; i++) {
+      out.append(" ");
+    }
+    int end = message->GetEndColumn(context).FromMaybe(0);
+    for (int i = start; i < end; i++) {
+      out.append("^");
+    }
+    out.append("\n");
+
+    // The stack is formatted lazily by V8 on first access.
+    Local<Value> stack;
+    if (exception->IsObject() &&
+        exception.As<Object>()
+            ->Get(context, String::NewFromUtf8(isolate, "stack"))
+            .ToLocal(&stack) &&
+        stack->IsString() && stack.As<String>()->Length() > 0) {
+      String::Utf8Value stack_trace(stack);
+      out.append(ToCString(stack_trace));
+      out.append("\n");
+    } else {
+      out.append(exception_string);
+      out.append("\n");
+    }
+  }
+  return out;
+}
+
+// SetException makes the caught exception the worker's last error. Only its
+// message and location are extracted, while the exception itself is kept for
+// worker_error_stack.
+void SetException(worker* w, Local<Context> context, TryCatch* try_catch) {
+  HandleScope handle_scope(w->isolate);
+  String::Utf8Value exception(try_catch->Exception());
+  w->last_exception = ToCString(exception);
+  w->exception_file.clear();
+  w->exception_line = 0;
+  w->exception_column = 0;
+  w->exception.Reset(w->isolate, try_catch->Exception());
+  w->exception_message.Reset();
+  Local<Message> message = try_catch->Message();
+  if (!message.IsEmpty()) {
+    GetLocation(context, message, &w->exception_file, &w->exception_line,
+                &w->exception_column);
+    w->exception_message.Reset(w->isolate, message);
+  }
+  w->exception_id++;
+}
+
+// SetError makes the given message the worker's last error.
+void SetError(worker* w, const char* message) {
+  w->last_exception = message;
+  w->exception_file.clear();
+  w->exception_line = 0;
+  w->exception_column = 0;
+  w->exception.Reset();
+  w->exception_message.Reset();
+  w->exception_id++;
+}
+
+// A PreserveError keeps the worker's last error aside while the event loop
+// thread makes a call, and restores it afterwards. Go only reads the error of
+// a sync call once the call has released the isolate, so the event loop
+// thread mustn't leave its own errors in its place.
+class PreserveError {
+ public:
+  explicit PreserveError(worker* w)
+      : w_(w),
+        message_(w->last_exception),
+        file_(w->exception_file),
+        line_(w->exception_line),
+        column_(w->exception_column),
+        id_(w->exception_id),
+        exception_(std::move(w->exception)),
+        exception_message_(std::move(w->exception_message)) {}
+
+  ~PreserveError() {
+    w_->last_exception.swap(message_);
+    w_->exception_file.swap(file_);
+    w_->exception_line = line_;
+    w_->exception_column = column_;
+    w_->exception_id = id_;
+    w_->exception = std::move(exception_);
+    w_->exception_message = std::move(exception_message_);
+  }
+
+ private:
+  worker* w_;
+  std::string message_;
+  std::string file_;
+  int line_;
+  int column_;
+  int64_t id_;
+  Global<Value> exception_;
+  Global<Message> exception_message_;
+};
+
+// ErrorSummary describes the worker's last error by its message and location.
+std::string ErrorSummary(worker* w) {
+  return FormatError(w->last_exception, w->exception_file, w->exception_line,
+                     w->exception_column);
+}
+
+// The prefix of the urls of the modules which are provided natively rather
+// than loaded from Go.
+const char kBuiltinPrefix[] = "builtin:";
+
+bool IsBuiltinModule(const std::string& url) {
+  return url.compare(0, sizeof(kBuiltinPrefix) - 1, kBuiltinPrefix) == 0;
+}
+
+// GetWorker returns the worker whose context is currently executing. As
+// several workers can share an isolate, it's looked up from the context
+// rather than from the isolate.
+worker* GetWorker(Isolate* isolate) {
+  return static_cast<worker*>(
+      isolate->GetCurrentContext()->GetAlignedPointerFromEmbedderData(
+          kWorkerIndex));
+}
+
+ModuleData* GetModuleData(Local<Context> context) {
+  return static_cast<ModuleData*>(
+      context->GetAlignedPointerFromEmbedderData(kModuleDataIndex));
+}
+
+void InitModuleData(Local<Context> context) {
+  context->SetAlignedPointerInEmbedderData(
+      kModuleDataIndex, new ModuleData(context->GetIsolate()));
+}
+
+MaybeLocal<Module> ResolveModuleCallback(Local<Context> context,
+                                         Local<String> url,
+                                         Local<Module> referrer) {
+  Isolate* isolate = context->GetIsolate();
+  ModuleData* d = GetModuleData(context);
+  std::string url_str = ToStdString(isolate, url);
+  auto referrer_it =
+      d->module_to_url_map.find(Global<Module>(isolate, referrer));
+  if (referrer_it != d->module_to_url_map.end()) {
+    auto resolved_it =
+        d->resolved_urls.find(ResolvedKey(referrer_it->second, url_str));
+    if (resolved_it != d->resolved_urls.end()) {
+      url_str = resolved_it->second;
+    }
+  }
+  auto module_it = d->url_to_module_map.find(url_str);
+  if (module_it == d->url_to_module_map.end()) {
+    isolate->ThrowException(String::NewFromUtf8(
+        isolate, ("v8worker: unknown module: " + url_str).c_str()));
+    return MaybeLocal<Module>();
+  }
+  return module_it->second.Get(isolate);
+}
+
+extern "C" {
+#include "_cgo_export.h"
+
+// CompileModule compiles the given module source and adds the resulting module
+// to the context's module maps.
+MaybeLocal<Module> CompileModule(worker* w,
+                                 Local<Context> context,
+                                 const std::string& url_str,
+                                 Local<String> source_text) {
+  Local<String> url = String::NewFromUtf8(w->isolate, url_str.c_str());
+  ScriptOrigin origin(url, Local<Integer>(), Local<Integer>(), Local<Boolean>(),
+                      Local<Integer>(), Local<Value>(), Local<Boolean>(),
+                      Local<Boolean>(), True(w->isolate));
+
+  // Modules bypass the code cache, as V8 6.6 can neither produce nor consume
+  // one for them.
   ScriptCompiler::Source source(source_text, origin);
 
   Local<Module> module;
   if (!ScriptCompiler::CompileModule(w->isolate, &source).ToLocal(&module)) {
-    return;
+    return MaybeLocal<Module>();
   }
 
   ModuleData* d = GetModuleData(context);
@@ -166,18 +1257,220 @@ void LoadModule(worker* w,
       std::make_pair(url_str, Global<Module>(w->isolate, module)));
   d->module_to_url_map.insert(
       std::make_pair(Global<Module>(w->isolate, module), url_str));
+  return module;
+}
 
-  for (int i = 0, length = module->GetModuleRequestsLength(); i < length; ++i) {
-    Local<String> name = module->GetModuleRequest(i);
-    MaybeLocal<Module> submodule;
-    LoadModule(w, context, name, submodule);
-    if (submodule.IsEmpty()) {
-      return;
+// BuiltinModuleSource returns the source of the builtin: module with the given
+// url, or an empty string if there's no such native module. Only the functions
+// which are enabled for the worker are exported, so that importing any others
+// fails when the module is linked.
+std::string BuiltinModuleSource(const std::string& url, int enable_print);
+
+// CompileBuiltinModule compiles the builtin: module with the given url from
+// the registry of native modules, without asking Go for its source.
+MaybeLocal<Module> CompileBuiltinModule(worker* w,
+                                        Local<Context> context,
+                                        const std::string& url_str) {
+  std::string source = BuiltinModuleSource(url_str, w->enable_print);
+  if (source.empty()) {
+    w->isolate->ThrowException(String::NewFromUtf8(
+        w->isolate, ("v8worker: unknown builtin module: " + url_str).c_str()));
+    return MaybeLocal<Module>();
+  }
+  return CompileModule(w, context, url_str,
+                       String::NewFromUtf8(w->isolate, source.c_str()));
+}
+
+// ResolveImports resolves the specifiers imported by the given modules into
+// urls. With resolve set, they're resolved in a single call to Go's
+// ResolveModuleURL, and otherwise they're used as is. The resolved urls are
+// recorded in the context's module data. If any of them fail to resolve, it
+// throws the first error and returns false.
+bool ResolveImports(
+    worker* w,
+    ModuleData* d,
+    const std::vector<std::pair<std::string, std::string>>& imports,
+    int resolve,
+    std::vector<std::string>* urls) {
+  std::vector<char*> specifiers;
+  std::vector<char*> referrers;
+  for (auto& it : imports) {
+    if (resolve && !IsBuiltinModule(it.second)) {
+      referrers.push_back((char*)it.first.c_str());
+      specifiers.push_back((char*)it.second.c_str());
+    }
+  }
+  char** resolved = NULL;
+  std::vector<char*> errors(specifiers.size(), NULL);
+  if (!specifiers.empty()) {
+    resolved = resolveModuleURLs(w->id, specifiers.data(), referrers.data(),
+                                 errors.data(), specifiers.size());
+  }
+  std::string error;
+  for (size_t i = 0; i < errors.size(); i++) {
+    if (errors[i] != NULL && error.empty()) {
+      error = "v8worker: can't resolve " + std::string(specifiers[i]) +
+              " from " + referrers[i] + ": " + errors[i];
+    }
+    free(errors[i]);
+  }
+  if (!error.empty()) {
+    for (size_t i = 0; i < specifiers.size(); i++) {
+      free(resolved[i]);
+    }
+    free(resolved);
+    w->isolate->ThrowException(
+        String::NewFromUtf8(w->isolate, error.c_str()));
+    return false;
+  }
+  size_t next = 0;
+  for (auto& it : imports) {
+    std::string url = it.second;
+    if (resolve && !IsBuiltinModule(it.second)) {
+      url = resolved[next];
+      free(resolved[next++]);
+      d->resolved_urls[ResolvedKey(it.first, it.second)] = url;
+    }
+    urls->push_back(url);
+  }
+  free(resolved);
+  return true;
+}
+
+// LoadModuleGraph compiles the module with the given url along with its entire
+// import graph, see LoadModule. The urls of the modules it adds to the
+// context's module map are appended to added, and it returns false once an
+// exception has been thrown.
+bool LoadModuleGraph(worker* w,
+                     Local<Context> context,
+                     const std::string& url_str,
+                     int resolve,
+                     std::vector<BundleModule>* capture,
+                     std::vector<std::string>* added) {
+  ModuleData* d = GetModuleData(context);
+  std::vector<std::string> pending;
+  std::unordered_set<std::string> seen;
+  std::unordered_map<std::string, size_t> captured;
+  if (d->url_to_module_map.count(url_str) == 0) {
+    if (IsBuiltinModule(url_str)) {
+      if (CompileBuiltinModule(w, context, url_str).IsEmpty()) {
+        return false;
+      }
+      added->push_back(url_str);
+    } else {
+      pending.push_back(url_str);
+      seen.insert(url_str);
+    }
+  }
+
+  while (!pending.empty()) {
+    HandleScope handle_scope(w->isolate);
+    std::vector<char*> urls;
+    for (size_t i = 0; i < pending.size(); i++) {
+      urls.push_back((char*)pending[i].c_str());
+    }
+    std::vector<char*> errors(pending.size(), NULL);
+    module_source* sources =
+        getModuleSources(w->id, urls.data(), errors.data(), urls.size());
+
+    std::string error;
+    for (size_t i = 0; i < pending.size(); i++) {
+      if (errors[i] != NULL && error.empty()) {
+        error = "v8worker: can't load " + pending[i] + ": " + errors[i];
+      }
+      free(errors[i]);
+    }
+    bool ok = error.empty();
+    if (!ok) {
+      w->isolate->ThrowException(
+          String::NewFromUtf8(w->isolate, error.c_str()));
+    }
+
+    std::vector<std::pair<std::string, std::string>> imports;
+    for (size_t i = 0; i < pending.size(); i++) {
+      if (!ok) {
+        FreeModuleSource(sources[i]);
+        continue;
+      }
+      if (capture != NULL) {
+        captured[pending[i]] = capture->size();
+        capture->emplace_back();
+        capture->back().url = pending[i];
+        capture->back().source.assign(sources[i].data, sources[i].length);
+      }
+      Local<String> text = NewModuleSource(w, sources[i]);
+      FreeModuleSource(sources[i]);
+      Local<Module> module;
+      if (CompileModule(w, context, pending[i], text).ToLocal(&module)) {
+        added->push_back(pending[i]);
+        for (int j = 0, length = module->GetModuleRequestsLength(); j < length;
+             ++j) {
+          imports.push_back(std::make_pair(
+              pending[i],
+              ToStdString(w->isolate, module->GetModuleRequest(j))));
+        }
+      } else {
+        ok = false;
+      }
+    }
+    free(sources);
+    if (!ok) {
+      return false;
+    }
+
+    std::vector<std::string> resolved;
+    if (!ResolveImports(w, d, imports, resolve, &resolved)) {
+      return false;
     }
+    std::vector<std::string> next;
+    for (size_t i = 0; i < imports.size(); i++) {
+      const std::string& name = resolved[i];
+      if (capture != NULL) {
+        (*capture)[captured[imports[i].first]].imports.push_back(
+            std::make_pair(imports[i].second, name));
+      }
+      if (d->url_to_module_map.count(name) != 0 || !seen.insert(name).second) {
+        continue;
+      }
+      if (!IsBuiltinModule(name)) {
+        next.push_back(name);
+      } else if (CompileBuiltinModule(w, context, name).IsEmpty()) {
+        return false;
+      } else {
+        added->push_back(name);
+      }
+    }
+    pending.swap(next);
   }
+  return true;
+}
 
-  mod = module;
-  return;
+// LoadModule compiles the module with the given url along with its entire
+// import graph. The graph is visited breadth first, and the imports and the
+// sources of all the modules newly discovered at each level are resolved and
+// requested from Go in a single call each, so that they can be fetched in
+// parallel. Modules which are already in the context's module map are never
+// fetched or compiled again, so shared dependencies and cycles are only loaded
+// once. If capture is set, the loaded modules are also appended to it. If the
+// load fails partway, the modules it has compiled so far are dropped from the
+// module map again, so that a retry doesn't find them with their imports
+// missing.
+void LoadModule(worker* w,
+                Local<Context> context,
+                Local<String> url,
+                MaybeLocal<Module>& mod,
+                int resolve,
+                std::vector<BundleModule>* capture) {
+  ModuleData* d = GetModuleData(context);
+  std::string url_str = ToStdString(w->isolate, url);
+  std::vector<std::string> added;
+  if (!LoadModuleGraph(w, context, url_str, resolve, capture, &added)) {
+    for (auto& it : added) {
+      d->Remove(it);
+    }
+    return;
+  }
+  mod = d->url_to_module_map[url_str].Get(w->isolate);
 }
 
 // The $print function.
@@ -201,284 +1494,2906 @@ void Print(const FunctionCallbackInfo<Value>& args) {
 // The $recv function. Sets the given callback.
 void Recv(const FunctionCallbackInfo<Value>& args) {
   Isolate* isolate = args.GetIsolate();
-  worker* w = (worker*)isolate->GetData(0);
+  worker* w = GetWorker(isolate);
+  assert(w->isolate == isolate);
+
+  HandleScope handle_scope(isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  Local<Value> v = args[0];
+  assert(v->IsFunction());
+  Local<Function> func = Local<Function>::Cast(v);
+
+  w->recv.Reset(isolate, func);
+}
+
+// The $recvSync function. Sets the given callback.
+void RecvSync(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  worker* w = GetWorker(isolate);
+  assert(w->isolate == isolate);
+
+  HandleScope handle_scope(isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  Local<Value> v = args[0];
+  assert(v->IsFunction());
+  Local<Function> func = Local<Function>::Cast(v);
+
+  w->recv_sync_handler.Reset(isolate, func);
+}
+
+// The $recvBatch function. Sets the given callback.
+void RecvBatch(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  worker* w = GetWorker(isolate);
+  assert(w->isolate == isolate);
+
+  HandleScope handle_scope(isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  Local<Value> v = args[0];
+  assert(v->IsFunction());
+  Local<Function> func = Local<Function>::Cast(v);
+
+  w->recv_batch.Reset(isolate, func);
+}
+
+// The $recvBuffer function. Sets the given callback.
+void RecvBuffer(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  worker* w = GetWorker(isolate);
   assert(w->isolate == isolate);
 
-  HandleScope handle_scope(isolate);
+  HandleScope handle_scope(isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  Local<Value> v = args[0];
+  assert(v->IsFunction());
+  Local<Function> func = Local<Function>::Cast(v);
+
+  w->recv_buffer.Reset(isolate, func);
+}
+
+// The $sendBuffer function. Calls the corresponding worker's BytesCallback in
+// Go with a pointer to the contents of the given ArrayBuffer or view, which
+// is only valid for the duration of the call.
+void SendBuffer(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  worker* w = GetWorker(isolate);
+  assert(w->isolate == isolate);
+
+  HandleScope handle_scope(isolate);
+
+  Local<Value> v = args[0];
+  char* data;
+  size_t length;
+  if (v->IsArrayBufferView()) {
+    Local<ArrayBufferView> view = Local<ArrayBufferView>::Cast(v);
+    data = static_cast<char*>(view->Buffer()->GetContents().Data()) +
+           view->ByteOffset();
+    length = view->ByteLength();
+  } else if (v->IsArrayBuffer()) {
+    ArrayBuffer::Contents contents = Local<ArrayBuffer>::Cast(v)->GetContents();
+    data = static_cast<char*>(contents.Data());
+    length = contents.ByteLength();
+  } else {
+    isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(
+        isolate, "v8worker: $sendBuffer expects an ArrayBuffer or view")));
+    return;
+  }
+  recvBytesCb(w->id, data, length);
+}
+
+// The $recvValue function. Sets the given callback.
+void RecvValue(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  worker* w = GetWorker(isolate);
+  assert(w->isolate == isolate);
+
+  HandleScope handle_scope(isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  Local<Value> v = args[0];
+  assert(v->IsFunction());
+  Local<Function> func = Local<Function>::Cast(v);
+
+  w->recv_value.Reset(isolate, func);
+}
+
+// The $sendValue function. Serializes the given value with the structured
+// clone algorithm, and calls the corresponding worker's ValueCallback in Go
+// with the bytes, which are only valid for the duration of the call. Values
+// which can't be cloned throw a DataCloneError.
+void SendValue(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  worker* w = GetWorker(isolate);
+  assert(w->isolate == isolate);
+
+  HandleScope handle_scope(isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  ValueSerializer serializer(isolate);
+  serializer.WriteHeader();
+  if (serializer.WriteValue(context, args[0]).IsNothing()) {
+    return;
+  }
+  std::pair<uint8_t*, size_t> data = serializer.Release();
+  recvValueCb(w->id, data.first, data.second);
+  free(data.first);
+}
+
+// ScheduleChannel queues a delivery of the channel's messages for the worker's
+// event loop thread.
+void ScheduleChannel(worker* w, channel* c);
+
+// GetChannel returns the channel attached under the given name.
+channel* GetChannel(worker* w, Local<Value> name) {
+  auto it = w->channels.find(ToStdString(w->isolate, name.As<String>()));
+  return it == w->channels.end() ? NULL : it->second;
+}
+
+// PortName returns the name of the channel that a port object is for, which
+// is kept in its internal field. The templates' signatures ensure that the
+// holder of the port's callbacks is always a port object.
+Local<String> PortName(Local<Object> holder) {
+  return holder->GetInternalField(0).As<String>();
+}
+
+// The post method of a channel's port object. Serializes the given value with
+// the structured clone algorithm and queues it for the channel's receiver.
+// Returns false if the channel is full, in which case the value is dropped.
+void ChannelPost(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  worker* w = GetWorker(isolate);
+  assert(w->isolate == isolate);
+
+  HandleScope handle_scope(isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  channel* c = GetChannel(w, PortName(args.Holder()));
+  ValueSerializer serializer(isolate);
+  serializer.WriteHeader();
+  if (serializer.WriteValue(context, args[0]).IsNothing()) {
+    return;
+  }
+  std::pair<uint8_t*, size_t> data = serializer.Release();
+  ChannelMessage m = {data.first, data.second};
+  if (!c->queue.Push(m)) {
+    free(m.data);
+    args.GetReturnValue().Set(false);
+    return;
+  }
+  args.GetReturnValue().Set(true);
+
+  if (!c->scheduled.exchange(true)) {
+    std::lock_guard<std::mutex> lock(c->mutex);
+    if (c->receiver != NULL) {
+      ScheduleChannel(c->receiver, c);
+    } else {
+      // The messages are delivered once a receiver is attached.
+      c->scheduled = false;
+    }
+  }
+}
+
+// The getter for the onmessage property of a channel's port object.
+void ChannelGetOnMessage(Local<Name> property,
+                         const PropertyCallbackInfo<Value>& info) {
+  worker* w = GetWorker(info.GetIsolate());
+  std::string name = ToStdString(w->isolate, PortName(info.Holder()));
+  auto it = w->channel_handlers.find(name);
+  if (it != w->channel_handlers.end()) {
+    info.GetReturnValue().Set(it->second.Get(w->isolate));
+  } else {
+    info.GetReturnValue().SetNull();
+  }
+}
+
+// The setter for the onmessage property of a channel's port object. Setting a
+// function starts the delivery of any messages that are already queued.
+void ChannelSetOnMessage(Local<Name> property,
+                         Local<Value> value,
+                         const PropertyCallbackInfo<void>& info) {
+  worker* w = GetWorker(info.GetIsolate());
+  std::string name = ToStdString(w->isolate, PortName(info.Holder()));
+  if (!value->IsFunction()) {
+    w->channel_handlers.erase(name);
+    return;
+  }
+  w->channel_handlers[name].Reset(w->isolate, value.As<Function>());
+  channel* c = w->channels[name];
+  std::lock_guard<std::mutex> lock(c->mutex);
+  if (c->receiver == w && !c->scheduled.exchange(true)) {
+    ScheduleChannel(w, c);
+  }
+}
+
+// PortTemplate returns the template for the port objects of channels, which
+// is created once per worker, so that V8 can reuse its instantiation.
+Local<FunctionTemplate> PortTemplate(worker* w) {
+  Isolate* isolate = w->isolate;
+  if (w->port_template.IsEmpty()) {
+    Local<FunctionTemplate> t = FunctionTemplate::New(isolate);
+    Local<ObjectTemplate> port = t->InstanceTemplate();
+    port->SetInternalFieldCount(1);
+    port->Set(String::NewFromUtf8(isolate, "post"),
+              FunctionTemplate::New(isolate, ChannelPost, Local<Value>(),
+                                    Signature::New(isolate, t)));
+    port->SetAccessor(String::NewFromUtf8(isolate, "onmessage"),
+                      ChannelGetOnMessage, ChannelSetOnMessage, Local<Value>(),
+                      DEFAULT, None, AccessorSignature::New(isolate, t));
+    w->port_template.Reset(isolate, t);
+  }
+  return Local<FunctionTemplate>::New(isolate, w->port_template);
+}
+
+// The $channel function. Returns a port object for the channel attached under
+// the given name, with a post method, and an onmessage property for the
+// receiving worker.
+void Channel(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  worker* w = GetWorker(isolate);
+  assert(w->isolate == isolate);
+
+  HandleScope handle_scope(isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  Local<String> name;
+  if (!args[0]->ToString(context).ToLocal(&name)) {
+    return;
+  }
+  if (GetChannel(w, name) == NULL) {
+    std::string msg = "v8worker: no channel named ";
+    msg.append(ToStdString(isolate, name));
+    isolate->ThrowException(
+        Exception::Error(String::NewFromUtf8(isolate, msg.c_str())));
+    return;
+  }
+
+  Local<Object> port;
+  if (!PortTemplate(w)->InstanceTemplate()->NewInstance(context).ToLocal(
+          &port)) {
+    return;
+  }
+  port->SetInternalField(0, name);
+  args.GetReturnValue().Set(port);
+}
+
+// UnlockIsolate is called just before a call releases the worker's isolate
+// with an Unlocker, and needs to be paired with RelockIsolate.
+void UnlockIsolate(worker* w) {
+  w->unlocked++;
+}
+
+// RelockIsolate is called once an Unlocker around a call into Go has locked
+// the worker's isolate again, and applies any termination that the watchdog
+// left to it in the meantime.
+void RelockIsolate(worker* w) {
+  w->unlocked--;
+  if (w->interrupt != INTERRUPT_NONE) {
+    w->isolate->TerminateExecution();
+  }
+}
+
+// OutboxPush queues a message in the worker's outbox. If the outbox is full,
+// the isolate is released until Go has caught up. It needs to be called with
+// the isolate locked.
+void OutboxPush(worker* w, const outbox_message& m) {
+  outbox* o = w->send_outbox;
+  while (!o->queue.Push(m)) {
+    UnlockIsolate(w);
+    {
+      Unlocker unlocker(w->isolate);
+      std::unique_lock<std::mutex> lock(o->mutex);
+      o->waiters++;
+      o->cv.wait(lock, [o] { return o->pending < o->capacity; });
+      o->waiters--;
+    }
+    RelockIsolate(w);
+  }
+  o->pending++;
+  OutboxNotify(o);
+}
+
+#ifdef V8WORKER_TRACE
+// MonotonicNanos returns the current time of a monotonic clock in nanoseconds.
+int64_t MonotonicNanos();
+
+// Trace records the phases of a call into the worker's histograms for the
+// given operation. Each Mark records the time since the previous one, or since
+// the call began, which needs to be before the isolate is locked.
+class Trace {
+ public:
+  Trace(worker* w, int op) : w_(w), op_(op), last_(MonotonicNanos()) {}
+
+  void Mark(int phase) {
+    int64_t now = MonotonicNanos();
+    w_->trace[op_][phase].Record(now - last_);
+    last_ = now;
+  }
+
+ private:
+  worker* w_;
+  int op_;
+  int64_t last_;
+};
+
+#define TRACE_BEGIN(w, op) Trace trace(w, op)
+#define TRACE_MARK(phase) trace.Mark(phase)
+#else
+#define TRACE_BEGIN(w, op)
+#define TRACE_MARK(phase)
+#endif
+
+// The $send function. Calls the corresponding worker's Callback in Go, or
+// queues the message in the worker's outbox if it has one.
+void Send(const FunctionCallbackInfo<Value>& args) {
+  size_t length = 0;
+  worker* w = GetWorker(args.GetIsolate());
+  TRACE_BEGIN(w, TRACE_JS_SEND);
+  {
+    Isolate* isolate = args.GetIsolate();
+    assert(w->isolate == isolate);
+
+    Locker locker(w->isolate);
+    HandleScope handle_scope(isolate);
+
+    Local<Context> context = Local<Context>::New(w->isolate, w->context);
+    Context::Scope context_scope(context);
+
+    Local<Value> v = args[0];
+    assert(v->IsString());
+
+    if (w->send_outbox != NULL) {
+      bool ascii;
+      Local<String> str = Local<String>::Cast(v);
+      outbox_message m;
+      m.length = Utf8Size(str, &ascii);
+      char* data = static_cast<char*>(malloc(m.length + 1));
+      EncodeString(str, ascii, data, m.length);
+      m.data = data;
+      TRACE_MARK(TRACE_ENTER);
+      OutboxPush(w, m);
+      TRACE_MARK(TRACE_EXEC);
+      return;
+    }
+    length = ScratchString(w, Local<String>::Cast(v));
+  }
+  TRACE_MARK(TRACE_ENTER);
+  recvCb(w->id, w->scratch.data(), length);
+  TRACE_MARK(TRACE_EXEC);
+}
+
+// The $sendAsync function. Calls the corresponding worker's AsyncCallback in
+// Go, and returns a Promise which is settled once Go calls worker_settle.
+void SendAsync(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  worker* w = GetWorker(isolate);
+  assert(w->isolate == isolate);
+
+  HandleScope handle_scope(isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  Local<Value> v = args[0];
+  assert(v->IsString());
+
+  size_t length = ScratchString(w, Local<String>::Cast(v));
+
+  Local<Promise::Resolver> resolver =
+      Promise::Resolver::New(context).ToLocalChecked();
+  int64_t id = ++w->next_promise_id;
+  w->promises.emplace(id, Global<Promise::Resolver>(isolate, resolver));
+  args.GetReturnValue().Set(resolver->GetPromise());
+
+  recvAsyncCb(w->id, id, w->scratch.data(), length);
+}
+
+// The $sendSync function. Calls the corresponding worker's SyncCallback in Go,
+// which returns the response along with its length.
+void SendSync(const FunctionCallbackInfo<Value>& args) {
+  size_t length = 0;
+  worker* w = GetWorker(args.GetIsolate());
+  TRACE_BEGIN(w, TRACE_JS_SEND_SYNC);
+  {
+    Isolate* isolate = args.GetIsolate();
+    assert(w->isolate == isolate);
+
+    Locker locker(w->isolate);
+    HandleScope handle_scope(isolate);
+
+    Local<Context> context = Local<Context>::New(w->isolate, w->context);
+    Context::Scope context_scope(context);
+
+    Local<Value> v = args[0];
+    assert(v->IsString());
+
+    length = ScratchString(w, Local<String>::Cast(v));
+  }
+  TRACE_MARK(TRACE_ENTER);
+  char* returnMsg;
+  size_t returnLength = 0;
+  if (w->send_outbox != NULL) {
+    // The isolate is released during the call, so that it can be used by
+    // other workers sharing it and by the event loop thread meanwhile. The
+    // message is moved out of the scratch buffer, as they may reuse it.
+    std::vector<char> msg;
+    msg.swap(w->scratch);
+    UnlockIsolate(w);
+    {
+      Unlocker unlocker(w->isolate);
+      returnMsg = recvSyncCb(w->id, msg.data(), length, &returnLength);
+      TRACE_MARK(TRACE_EXEC);
+    }
+    RelockIsolate(w);
+    TRACE_MARK(TRACE_LOCK);
+    w->scratch.swap(msg);
+  } else {
+    returnMsg = recvSyncCb(w->id, w->scratch.data(), length, &returnLength);
+    TRACE_MARK(TRACE_EXEC);
+  }
+  args.GetReturnValue().Set(NewMessageString(w, returnMsg, returnLength));
+  free(returnMsg);
+  TRACE_MARK(TRACE_RETURN);
+}
+
+// A native function which is exposed to JavaScript.
+struct NativeBinding {
+  const char* name;
+  FunctionCallback callback;
+};
+
+// A group of native functions which can be imported by scripts as the
+// builtin:<name> module. The functions of the "worker" module are also exposed
+// on the global object with a $ prefix.
+struct NativeModule {
+  const char* name;
+  const NativeBinding* bindings;
+};
+
+const NativeBinding kWorkerBindings[] = {
+    {"print", Print},
+    {"recv", Recv},
+    {"send", Send},
+    {"sendSync", SendSync},
+    {"recvSync", RecvSync},
+    {"recvBuffer", RecvBuffer},
+    {"sendBuffer", SendBuffer},
+    {"recvBatch", RecvBatch},
+    {"sendAsync", SendAsync},
+    {"recvValue", RecvValue},
+    {"sendValue", SendValue},
+    {"channel", Channel},
+    {NULL, NULL},
+};
+
+// The registry of native modules. New bindings should be added to a module
+// here rather than to the global template, as the cost of a module is only
+// paid by the contexts which import it.
+const NativeModule kNativeModules[] = {
+    {"worker", kWorkerBindings},
+    {NULL, NULL},
+};
+
+// BindingEnabled reports whether a native function is exposed to a worker,
+// which is the case for all of them apart from print, unless it's enabled.
+bool BindingEnabled(const NativeBinding* b, int enable_print) {
+  return b->callback != Print || enable_print;
+}
+
+const NativeModule* FindNativeModule(const std::string& name) {
+  for (const NativeModule* m = kNativeModules; m->name != NULL; m++) {
+    if (name == m->name) {
+      return m;
+    }
+  }
+  return NULL;
+}
+
+// The $builtin function, which returns an object with the functions of the
+// named native module. It's used by the generated source of the builtin:
+// modules.
+void Builtin(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+  const NativeModule* m = NULL;
+  if (args.Length() > 0 && args[0]->IsString()) {
+    m = FindNativeModule(ToStdString(isolate, Local<String>::Cast(args[0])));
+  }
+  if (m == NULL) {
+    isolate->ThrowException(
+        String::NewFromUtf8(isolate, "v8worker: unknown builtin module"));
+    return;
+  }
+  worker* w = GetWorker(isolate);
+  Local<Object> exports = Object::New(isolate);
+  for (const NativeBinding* b = m->bindings; b->name != NULL; b++) {
+    if (!BindingEnabled(b, w->enable_print)) {
+      continue;
+    }
+    Local<Function> fn;
+    if (!Function::New(context, b->callback).ToLocal(&fn) ||
+        exports->Set(context, String::NewFromUtf8(isolate, b->name), fn)
+            .IsNothing()) {
+      return;
+    }
+  }
+  args.GetReturnValue().Set(exports);
+}
+
+// The getter for the lazy data properties of the global object, which creates
+// the $function with the given index into kWorkerBindings, or $builtin for a
+// negative index, the first time that it's accessed. V8 then replaces the
+// accessor with a plain data property.
+void LazyBinding(Local<Name> name, const PropertyCallbackInfo<Value>& info) {
+  Isolate* isolate = info.GetIsolate();
+  int index = Local<Integer>::Cast(info.Data())->Value();
+  FunctionCallback callback =
+      index < 0 ? Builtin : kWorkerBindings[index].callback;
+  Local<Function> fn;
+  if (Function::New(isolate->GetCurrentContext(), callback).ToLocal(&fn)) {
+    info.GetReturnValue().Set(fn);
+  }
+}
+
+std::string BuiltinModuleSource(const std::string& url, int enable_print) {
+  const NativeModule* m =
+      FindNativeModule(url.substr(sizeof(kBuiltinPrefix) - 1));
+  if (m == NULL) {
+    return "";
+  }
+  std::string source =
+      "const m = $builtin('" + std::string(m->name) + "');\n";
+  for (const NativeBinding* b = m->bindings; b->name != NULL; b++) {
+    if (!BindingEnabled(b, enable_print)) {
+      continue;
+    }
+    source += "export const " + std::string(b->name) + " = m." + b->name +
+              ";\n";
+  }
+  return source;
+}
+
+// The addresses of all native callbacks that can be reachable from a startup
+// snapshot. It needs to be null-terminated.
+const intptr_t external_references[] = {
+    reinterpret_cast<intptr_t>(Print),
+    reinterpret_cast<intptr_t>(Recv),
+    reinterpret_cast<intptr_t>(RecvSync),
+    reinterpret_cast<intptr_t>(Send),
+    reinterpret_cast<intptr_t>(SendSync),
+    reinterpret_cast<intptr_t>(RecvBuffer),
+    reinterpret_cast<intptr_t>(SendBuffer),
+    reinterpret_cast<intptr_t>(RecvBatch),
+    reinterpret_cast<intptr_t>(SendAsync),
+    reinterpret_cast<intptr_t>(RecvValue),
+    reinterpret_cast<intptr_t>(SendValue),
+    reinterpret_cast<intptr_t>(Channel),
+    reinterpret_cast<intptr_t>(ChannelPost),
+    reinterpret_cast<intptr_t>(ChannelGetOnMessage),
+    reinterpret_cast<intptr_t>(ChannelSetOnMessage),
+    reinterpret_cast<intptr_t>(LazyBinding),
+    reinterpret_cast<intptr_t>(Builtin),
+    0,
+};
+
+// NewGlobalTemplate creates the template for the global object of a worker's
+// context, which exposes the $functions. They're installed as lazy data
+// properties, so that the functions are only created for the contexts which
+// use them.
+Local<ObjectTemplate> NewGlobalTemplate(Isolate* isolate, int enable_print) {
+  Local<ObjectTemplate> global = ObjectTemplate::New(isolate);
+
+  for (int i = 0; kWorkerBindings[i].name != NULL; i++) {
+    if (!BindingEnabled(&kWorkerBindings[i], enable_print)) {
+      continue;
+    }
+    std::string name = std::string("$") + kWorkerBindings[i].name;
+    global->SetLazyDataProperty(String::NewFromUtf8(isolate, name.c_str()),
+                                LazyBinding, Integer::New(isolate, i));
+  }
+
+  global->SetLazyDataProperty(String::NewFromUtf8(isolate, "$builtin"),
+                              LazyBinding, Integer::New(isolate, -1));
+
+  return global;
+}
+
+// NearHeapLimit is called by V8 when a worker's heap is close to its limit.
+// Rather than letting V8 abort the whole process, it terminates the worker's
+// current execution, and raises the limit just enough for that to complete.
+// The limit is restored by RestoreHeapLimit once the call has returned.
+size_t NearHeapLimit(void* data,
+                     size_t current_heap_limit,
+                     size_t initial_heap_limit) {
+  worker* w = static_cast<worker*>(data);
+  w->heap_limit_reached = true;
+  w->initial_heap_limit = initial_heap_limit;
+  w->isolate->TerminateExecution();
+  return current_heap_limit + initial_heap_limit / 4;
+}
+
+// RestoreHeapLimit lowers the heap limit of the owner's isolate back to its
+// initial value if NearHeapLimit has raised it, so that repeatedly exceeding
+// it can't grow the heap without bound. V8 6.6 only restores the limit when
+// the callback is removed, so it's added again afterwards.
+void RestoreHeapLimit(worker* owner) {
+  size_t limit = owner->initial_heap_limit;
+  if (limit == 0) {
+    return;
+  }
+  owner->initial_heap_limit = 0;
+  owner->isolate->RemoveNearHeapLimitCallback(NearHeapLimit, limit);
+  owner->isolate->AddNearHeapLimitCallback(NearHeapLimit, owner);
+}
+
+// MonotonicNanos returns the current time of a monotonic clock in nanoseconds.
+int64_t MonotonicNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void GCPrologue(Isolate* isolate, GCType type, GCCallbackFlags flags) {
+  worker* w = static_cast<worker*>(isolate->GetData(0));
+  w->gc_start_ns = MonotonicNanos();
+}
+
+// GCEpilogue records the pause for a GC. Only scavenges and full mark-sweeps
+// are tracked, as they're the ones that pause the main thread.
+void GCEpilogue(Isolate* isolate, GCType type, GCCallbackFlags flags) {
+  worker* w = static_cast<worker*>(isolate->GetData(0));
+  int64_t pause = MonotonicNanos() - w->gc_start_ns;
+  if (type == kGCTypeScavenge) {
+    w->minor_gc_count++;
+    w->minor_gc_pause_ns += pause;
+  } else {
+    w->major_gc_count++;
+    w->major_gc_pause_ns += pause;
+  }
+  if (pause > w->max_gc_pause_ns) {
+    w->max_gc_pause_ns = pause;
+  }
+}
+
+// NewIsolate creates an isolate with the given limits, which may be NULL, and
+// allocator, which must outlive it. It's deserialized from the given startup
+// snapshot, if it's not NULL.
+Isolate* NewIsolate(snapshot* s,
+                    worker_limits* limits,
+                    ArrayBuffer::Allocator* allocator) {
+  Isolate::CreateParams create_params;
+  create_params.array_buffer_allocator = allocator;
+  if (s != NULL) {
+    create_params.snapshot_blob = &s->blob;
+    create_params.external_references = external_references;
+  }
+  if (limits != NULL) {
+    ResourceConstraints& constraints = create_params.constraints;
+    if (limits->max_old_space_mb > 0) {
+      constraints.set_max_old_space_size(limits->max_old_space_mb);
+    }
+    if (limits->max_semi_space_kb > 0) {
+      constraints.set_max_semi_space_size_in_kb(limits->max_semi_space_kb);
+    }
+    if (limits->code_range_mb > 0) {
+      constraints.set_code_range_size(limits->code_range_mb);
+    }
+  }
+  return Isolate::New(create_params);
+}
+
+// V8's default stack size, in kilobytes, which is what the limit of contexts
+// without one of their own is reset to.
+const size_t kDefaultStackKB = 984;
+
+// ApplyStackLimit sets the worker's stack limit relative to the current stack
+// position. It needs to be called on entry with the isolate locked, as calls
+// can be made from different threads. The limit is per isolate, so once any of
+// an isolate's contexts has set one, it's reapplied on every call, to replace
+// a limit relative to the stack of another call.
+void ApplyStackLimit(worker* w) {
+  size_t kb = w->stack_limit_kb;
+  if (kb == 0) {
+    if (!w->owner->stack_limited) {
+      return;
+    }
+    kb = kDefaultStackKB;
+  }
+  w->owner->stack_limited = true;
+  char here;
+  uintptr_t here_addr = reinterpret_cast<uintptr_t>(&here);
+  w->isolate->SetStackLimit(here_addr - kb * 1024);
+}
+
+// ApplyLimits applies the limits which are enforced per call, rather than
+// by the isolate itself.
+void ApplyLimits(worker* w, worker_limits* limits) {
+  w->stack_limit_kb = limits->stack_kb;
+  w->timeout_ns = limits->timeout_ns;
+  w->cpu_budget_ns = limits->cpu_budget_ns;
+}
+
+// The interval at which the watchdog checks CPU budgets.
+const int64_t kWatchdogTickNs = 1000000;
+
+// ThreadCPUNanos returns the CPU time used by the thread with the given clock.
+// Where per-thread CPU clocks aren't available, wall time is used instead.
+int64_t ThreadCPUNanos(clockid_t clock) {
+#ifdef __linux__
+  struct timespec ts;
+  if (clock_gettime(clock, &ts) == 0) {
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+#endif
+  return MonotonicNanos();
+}
+
+// CPUUsed returns the CPU time that the worker has used so far, including
+// that of the current call, which needs to be covered by a Watch.
+int64_t CPUUsed(worker* w) {
+  return w->cpu_used_ns + ThreadCPUNanos(w->cpu_clock) - w->cpu_start_ns;
+}
+
+// Interrupt terminates the worker's current call for the given reason. Any
+// wait within AwaitPromise is woken up, as it wouldn't notice otherwise.
+void Interrupt(worker* w, int reason) {
+  w->interrupt = reason;
+  if (w->watch_depth > w->unlocked) {
+    w->isolate->TerminateExecution();
+  }
+  {
+    std::lock_guard<std::mutex> lock(w->settle_mutex);
+  }
+  w->settle_cv.notify_all();
+}
+
+// Watchdog is a single thread, shared by all workers, which terminates calls
+// that have run past their deadline or CPU budget. It only tracks workers
+// while they are executing a call with a limit, and sleeps until the earliest
+// deadline, or for a tick while a CPU budget is being tracked.
+class Watchdog {
+ public:
+  void Arm(worker* w) {
+    std::call_once(once_,
+                   [this] { std::thread(&Watchdog::Run, this).detach(); });
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      armed_.insert(w);
+    }
+    cv_.notify_one();
+  }
+
+  // Disarm stops tracking the worker. Once it returns, the watchdog won't
+  // interrupt the worker's current call anymore.
+  void Disarm(worker* w) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    armed_.erase(w);
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      int64_t now = MonotonicNanos();
+      int64_t next = INT64_MAX;
+      for (auto it = armed_.begin(); it != armed_.end();) {
+        worker* w = *it;
+        int reason = INTERRUPT_NONE;
+        if (w->deadline_ns > 0 && now >= w->deadline_ns) {
+          reason = INTERRUPT_TIMEOUT;
+        } else if (w->cpu_budget_ns > 0 && CPUUsed(w) >= w->cpu_budget_ns) {
+          reason = INTERRUPT_CPU_BUDGET;
+        }
+        if (reason != INTERRUPT_NONE) {
+          Interrupt(w, reason);
+          it = armed_.erase(it);
+          continue;
+        }
+        if (w->deadline_ns > 0) {
+          next = std::min(next, w->deadline_ns);
+        }
+        if (w->cpu_budget_ns > 0) {
+          next = std::min(next, now + kWatchdogTickNs);
+        }
+        ++it;
+      }
+      if (next == INT64_MAX) {
+        cv_.wait(lock);
+      } else {
+        cv_.wait_for(lock, std::chrono::nanoseconds(next - now));
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_set<worker*> armed_;
+  std::once_flag once_;
+};
+
+Watchdog watchdog;
+
+// Watch arms the watchdog for a call into JavaScript if the worker has a
+// timeout or CPU budget, and disarms it once the call has returned. It needs
+// to be created with the isolate locked. Nested calls are covered by the
+// outermost Watch, which also clears the heap limit flag, so that it's only
+// reported for the call that reached the limit. If the call was interrupted,
+// the termination is cancelled, so that the worker can be used again, and any
+// heap limit raised by NearHeapLimit is restored once the outermost call has
+// returned.
+class Watch {
+ public:
+  explicit Watch(worker* w) : w_(w), armed_(false) {
+    if (w->watch_depth++ > 0) {
+      return;
+    }
+    w->owner->heap_limit_reached = false;
+    if (w->timeout_ns <= 0 && w->cpu_budget_ns <= 0) {
+      return;
+    }
+    armed_ = true;
+    w->interrupt = INTERRUPT_NONE;
+    w->deadline_ns = w->timeout_ns > 0 ? MonotonicNanos() + w->timeout_ns : 0;
+#ifdef __linux__
+    pthread_getcpuclockid(pthread_self(), &w->cpu_clock);
+#endif
+    w->cpu_start_ns = ThreadCPUNanos(w->cpu_clock);
+    if (w->cpu_budget_ns > 0 && w->cpu_used_ns >= w->cpu_budget_ns) {
+      Interrupt(w, INTERRUPT_CPU_BUDGET);
+      return;
+    }
+    watchdog.Arm(w);
+  }
+
+  ~Watch() {
+    if (--w_->watch_depth == 0) {
+      RestoreHeapLimit(w_->owner);
+    }
+    if (!armed_) {
+      return;
+    }
+    watchdog.Disarm(w_);
+    w_->cpu_used_ns += ThreadCPUNanos(w_->cpu_clock) - w_->cpu_start_ns;
+    w_->deadline_ns = 0;
+    if (w_->interrupt == INTERRUPT_TIMEOUT) {
+      SetError(w_, "v8worker: execution timed out");
+    } else if (w_->interrupt == INTERRUPT_CPU_BUDGET) {
+      SetError(w_, "v8worker: CPU budget exhausted");
+    } else {
+      return;
+    }
+    w_->isolate->CancelTerminateExecution();
+  }
+
+ private:
+  worker* w_;
+  bool armed_;
+};
+
+// AllocWorker allocates a worker for the given isolate, which it owns.
+worker* AllocWorker(int id, Isolate* isolate, int enable_print, snapshot* s) {
+  worker* w = new (worker);
+  w->id = id;
+  w->isolate = isolate;
+  w->owner = w;
+  w->refs = 1;
+  w->allocator = NULL;
+  w->snapshot_creator = NULL;
+  w->startup_snapshot = s;
+  w->enable_print = enable_print;
+  w->stack_limit_kb = 0;
+  w->stack_limited = false;
+  w->timeout_ns = 0;
+  w->cpu_budget_ns = 0;
+  w->cpu_used_ns = 0;
+  w->cpu_start_ns = 0;
+  w->cpu_clock = CLOCK_THREAD_CPUTIME_ID;
+  w->deadline_ns = 0;
+  w->watch_depth = 0;
+  w->interrupt = INTERRUPT_NONE;
+  w->unlocked = 0;
+  w->send_outbox = NULL;
+  w->profiler = NULL;
+  w->profile_interval_us = 0;
+  w->exception_line = 0;
+  w->exception_column = 0;
+  w->exception_id = 0;
+  w->heap_limit_reached = false;
+  w->initial_heap_limit = 0;
+  w->gc_start_ns = 0;
+  w->minor_gc_count = 0;
+  w->minor_gc_pause_ns = 0;
+  w->major_gc_count = 0;
+  w->major_gc_pause_ns = 0;
+  w->max_gc_pause_ns = 0;
+  w->pending_calls = 0;
+  w->stopping = false;
+  w->next_promise_id = 0;
+  w->pending_settlements = 0;
+  return w;
+}
+
+// NewWorker allocates a worker for the given isolate, and sets up the
+// isolate's callbacks.
+worker* NewWorker(int id, Isolate* isolate, int enable_print, snapshot* s) {
+  worker* w = AllocWorker(id, isolate, enable_print, s);
+  w->isolate->SetCaptureStackTraceForUncaughtExceptions(true);
+  w->isolate->SetData(0, w);
+  w->isolate->AddNearHeapLimitCallback(NearHeapLimit, w);
+  GCType tracked =
+      static_cast<GCType>(kGCTypeScavenge | kGCTypeMarkSweepCompact);
+  w->isolate->AddGCPrologueCallback(GCPrologue, tracked);
+  w->isolate->AddGCEpilogueCallback(GCEpilogue, tracked);
+  return w;
+}
+
+// StashHandler moves a handler into the given slot of the context's embedder
+// data, so that it can be serialized within a startup snapshot.
+void StashHandler(worker* w,
+                  Local<Context> context,
+                  int index,
+                  Persistent<Function>& handler) {
+  Local<Value> v = Undefined(w->isolate);
+  if (!handler.IsEmpty()) {
+    v = Local<Function>::New(w->isolate, handler);
+  }
+  context->SetEmbedderData(index, v);
+  handler.Reset();
+}
+
+// RestoreHandler is the inverse of StashHandler, and is used on contexts that
+// have been deserialized from a startup snapshot.
+void RestoreHandler(worker* w,
+                    Local<Context> context,
+                    int index,
+                    Persistent<Function>& handler) {
+  Local<Value> v = context->GetEmbedderData(index);
+  if (v->IsFunction()) {
+    handler.Reset(w->isolate, Local<Function>::Cast(v));
+  }
+  context->SetEmbedderData(index, Undefined(w->isolate));
+}
+
+void StashHandlers(worker* w, Local<Context> context) {
+  StashHandler(w, context, kRecvIndex, w->recv);
+  StashHandler(w, context, kRecvSyncIndex, w->recv_sync_handler);
+  StashHandler(w, context, kRecvBufferIndex, w->recv_buffer);
+  StashHandler(w, context, kRecvBatchIndex, w->recv_batch);
+  StashHandler(w, context, kRecvValueIndex, w->recv_value);
+}
+
+void RestoreHandlers(worker* w, Local<Context> context) {
+  RestoreHandler(w, context, kRecvIndex, w->recv);
+  RestoreHandler(w, context, kRecvSyncIndex, w->recv_sync_handler);
+  RestoreHandler(w, context, kRecvBufferIndex, w->recv_buffer);
+  RestoreHandler(w, context, kRecvBatchIndex, w->recv_batch);
+  RestoreHandler(w, context, kRecvValueIndex, w->recv_value);
+}
+
+// InitContext creates the worker's context, either from scratch or from the
+// worker's startup snapshot.
+void InitContext(worker* w) {
+  Local<Context> context;
+  if (w->startup_snapshot != NULL) {
+    context = Context::FromSnapshot(w->isolate, 0).ToLocalChecked();
+  } else {
+    if (w->global_template.IsEmpty()) {
+      w->global_template.Reset(
+          w->isolate, NewGlobalTemplate(w->isolate, w->enable_print));
+    }
+    context = Context::New(
+        w->isolate, NULL,
+        Local<ObjectTemplate>::New(w->isolate, w->global_template));
+  }
+  w->context.Reset(w->isolate, context);
+  context->SetAlignedPointerInEmbedderData(kWorkerIndex, w);
+  InitModuleData(context);
+  if (w->startup_snapshot != NULL) {
+    RestoreHandlers(w, context);
+  }
+}
+
+// DisposeContext releases the worker's context along with its module maps and
+// handlers. It needs to be called with the isolate locked.
+void DisposeContext(worker* w) {
+  HandleScope handle_scope(w->isolate);
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  delete GetModuleData(context);
+  context->SetAlignedPointerInEmbedderData(kModuleDataIndex, NULL);
+  context->SetAlignedPointerInEmbedderData(kWorkerIndex, NULL);
+
+  w->recv.Reset();
+  w->recv_sync_handler.Reset();
+  w->recv_buffer.Reset();
+  w->recv_batch.Reset();
+  w->recv_value.Reset();
+  w->channel_handlers.clear();
+  w->promises.clear();
+  w->exception.Reset();
+  w->exception_message.Reset();
+  w->context.Reset();
+
+  // This lets V8 know that the context is now garbage, so that it's collected
+  // along with everything it references sooner.
+  w->isolate->ContextDisposedNotification();
+}
+
+// DrainSettlements applies all settlements queued by worker_settle. It needs to
+// be called with the isolate locked, and returns whether anything was applied.
+bool DrainSettlements(worker* w, Local<Context> context) {
+  bool applied = false;
+  while (w->pending_settlements > 0) {
+    Settlement* s = w->settlements.Pop();
+    if (s == NULL) {
+      // A producer is midway through a push.
+      std::this_thread::yield();
+      continue;
+    }
+    w->pending_settlements--;
+    auto it = w->promises.find(s->id);
+    // The promise may have been discarded by a context reset in the meantime.
+    if (it != w->promises.end()) {
+      HandleScope handle_scope(w->isolate);
+      Local<Promise::Resolver> resolver = it->second.Get(w->isolate);
+      Local<String> value =
+          NewMessageString(w, s->value.data(), s->value.size());
+      if (s->status == 0) {
+        resolver->Resolve(context, value).FromJust();
+      } else {
+        resolver->Reject(context, Exception::Error(value)).FromJust();
+      }
+      w->promises.erase(it);
+      applied = true;
+    }
+    delete s;
+  }
+  return applied;
+}
+
+// AwaitPromise runs microtasks, and applies settlements from Go as they come
+// in, until the given promise is no longer pending. It blocks on a condition
+// variable while waiting on Go, so there's no busy-waiting. It returns false
+// if the promise is still pending once there's nothing left that could settle
+// it.
+bool AwaitPromise(worker* w, Local<Context> context, Local<Promise> promise) {
+  while (true) {
+    w->isolate->RunMicrotasks();
+    if (promise->State() != Promise::kPending) {
+      return true;
+    }
+    if (w->pending_settlements == 0) {
+      if (w->promises.empty()) {
+        return false;
+      }
+      // The isolate is released while waiting, so that other calls, e.g. the
+      // worker_settle which is being waited for, aren't blocked meanwhile.
+      // The wait ends with the call's timeout, if it has one, as the watchdog
+      // interrupts it, and when the worker is being disposed of.
+      UnlockIsolate(w);
+      {
+        Unlocker unlocker(w->isolate);
+        std::unique_lock<std::mutex> lock(w->settle_mutex);
+        w->settle_cv.wait(lock, [w] {
+          return w->pending_settlements > 0 ||
+                 w->interrupt != INTERRUPT_NONE || w->stopping;
+        });
+      }
+      RelockIsolate(w);
+    }
+    if (w->interrupt != INTERRUPT_NONE || w->stopping) {
+      return false;
+    }
+    DrainSettlements(w, context);
+  }
+}
+
+// Initializes V8 with the given platform options, which may be NULL for V8's
+// defaults.
+void v8_init(platform_options* options) {
+  const char* flags = "--harmony_public_fields --harmony_private_fields";
+  V8::SetFlagsFromString(flags, strlen(flags));
+  int thread_pool_size = 0;
+  platform::IdleTaskSupport idle = platform::IdleTaskSupport::kDisabled;
+  if (options != NULL) {
+    thread_pool_size = options->thread_pool_size;
+    if (options->idle_tasks) {
+      idle = platform::IdleTaskSupport::kEnabled;
+      idle_tasks_enabled = true;
+    }
+  }
+  default_platform = platform::CreateDefaultPlatform(thread_pool_size, idle);
+  V8::InitializePlatform(default_platform);
+  V8::Initialize();
+}
+
+// Stops the worker's event loop thread, if it has one, once its current call
+// has returned, and cancels any calls still queued for it. A wait within
+// AwaitPromise is woken up, so that the current call doesn't wait for a
+// settlement that may never come. It's also done by worker_dispose, but can be
+// called beforehand, without holding up the settlements from Go.
+void worker_stop_loop(worker* w) {
+  // Stop receiving before the event loop thread goes away.
+  for (auto& it : w->channels) {
+    std::lock_guard<std::mutex> lock(it.second->mutex);
+    if (it.second->receiver == w) {
+      it.second->receiver = NULL;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(w->loop_mutex);
+    w->stopping = true;
+  }
+  w->loop_cv.notify_one();
+  {
+    std::lock_guard<std::mutex> lock(w->settle_mutex);
+  }
+  w->settle_cv.notify_all();
+  if (w->loop.joinable()) {
+    w->loop.join();
+  }
+}
+
+void worker_dispose(worker* w) {
+  worker_stop_loop(w);
+  if (w->send_outbox != NULL) {
+    // The goroutine draining the outbox exits once it's empty.
+    outbox* o = w->send_outbox;
+    {
+      std::lock_guard<std::mutex> lock(o->mutex);
+      o->closed = true;
+    }
+    o->cv.notify_all();
+    OutboxUnref(o);
+  }
+  if (w->snapshot_creator != NULL) {
+    // A SnapshotCreator has to create its blob before it can be destroyed.
+    snapshot_dispose(worker_create_snapshot(w));
+    return;
+  }
+  {
+    // Global handles need to be reset while the isolate is still alive.
+    Locker locker(w->isolate);
+    Isolate::Scope isolate_scope(w->isolate);
+    DisposeContext(w);
+    w->global_template.Reset();
+    w->port_template.Reset();
+    if (w->profiler != NULL) {
+      w->profiler->Dispose();
+    }
+  }
+  for (auto& it : w->channels) {
+    ChannelUnref(it.second);
+  }
+  worker* owner = w->owner;
+  if (w != owner) {
+    delete (w);
+  }
+  if (--owner->refs == 0) {
+    owner->isolate->Dispose();
+    delete owner->allocator;
+    delete (owner);
+  }
+}
+
+// Returns a copy of the message of the worker's last error, which the caller
+// needs to free.
+const char* worker_last_exception(worker* w) {
+  // The lock keeps the event loop thread from swapping the error out while
+  // it's being read, see PreserveError.
+  Locker locker(w->isolate);
+  return CopyString(w->last_exception);
+}
+
+// Fills in the details of the worker's last error. The message and file are
+// copies which the caller needs to free.
+void worker_last_error(worker* w, worker_error* e) {
+  Locker locker(w->isolate);
+  e->message = CopyString(w->last_exception);
+  e->file = CopyString(w->exception_file);
+  e->line = w->exception_line;
+  e->column = w->exception_column;
+  e->id = w->exception_id;
+}
+
+// Renders the full details of the error with the given id, including its
+// source line and stack trace, into a string which the caller needs to free.
+// It returns NULL if the error is no longer the worker's last, if the context
+// has been reset since, or if the error didn't come from an exception.
+const char* worker_error_stack(worker* w, int64_t id) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  HandleScope handle_scope(w->isolate);
+
+  if (id != w->exception_id || w->exception.IsEmpty()) {
+    return NULL;
+  }
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+  TryCatch try_catch(w->isolate);
+  return CopyString(RenderException(
+      w->isolate, context, Local<Value>::New(w->isolate, w->exception),
+      Local<Message>::New(w->isolate, w->exception_message)));
+}
+
+// RunModule instantiates and evaluates a module, and returns a non-zero value
+// on error, when it also sets the worker's last exception.
+int RunModule(worker* w,
+              Local<Context> context,
+              Local<Module> module,
+              TryCatch* try_catch) {
+  if (!module->InstantiateModule(context, ResolveModuleCallback)
+           .FromMaybe(false)) {
+    SetException(w, context, try_catch);
+    return 2;
+  }
+
+  MaybeLocal<Value> maybe_result = module->Evaluate(context);
+  Local<Value> result;
+  if (!maybe_result.ToLocal(&result)) {
+    SetException(w, context, try_catch);
+    return 3;
+  }
+
+  return 0;
+}
+
+// Loads the module with the given url, and evaluates it. With resolve set, the
+// urls of imports are resolved by Go's ResolveModuleURL. A non-zero return
+// value indicates error. Check worker_last_exception().
+int worker_load_module(worker* w, char* url_s, int resolve) {
+  TRACE_BEGIN(w, TRACE_LOAD_MODULE);
+  Locker locker(w->isolate);
+  TRACE_MARK(TRACE_LOCK);
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+  TryCatch try_catch(w->isolate);
+
+  Local<String> url = String::NewFromUtf8(w->isolate, url_s);
+  TRACE_MARK(TRACE_ENTER);
+  MaybeLocal<Module> mod;
+  LoadModule(w, context, url, mod, resolve, NULL);
+
+  Local<Module> module;
+  if (!mod.ToLocal(&module)) {
+    SetException(w, context, &try_catch);
+    return 1;
+  }
+  int r = RunModule(w, context, module, &try_catch);
+  TRACE_MARK(TRACE_EXEC);
+  return r;
+}
+
+// The bundle format. All integers are 32-bit little endian, and strings are
+// prefixed with their length:
+//
+//   "V8WB" version:u32 count:u32 entry:str
+//   count * (url:str source:str code_cache:str imports:u32
+//            imports * (specifier:str url:str))
+//
+// The code cache of modules is reserved for when V8 supports it, as V8 6.6
+// can neither produce nor consume one for modules, and is left empty.
+const char kBundleMagic[] = "V8WB";
+const uint32_t kBundleVersion = 1;
+
+void AppendU32(std::string* out, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    out->push_back(char((v >> (8 * i)) & 0xff));
+  }
+}
+
+void AppendStr(std::string* out, const std::string& s) {
+  AppendU32(out, s.size());
+  out->append(s);
+}
+
+// BundleReader decodes a bundle, and stops decoding once it runs out of data.
+class BundleReader {
+ public:
+  BundleReader(const char* data, size_t length)
+      : p_(data), end_(data + length), ok_(true) {}
+
+  uint32_t U32() {
+    if (end_ - p_ < 4) {
+      ok_ = false;
+      return 0;
+    }
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(p_);
+    p_ += 4;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | (uint32_t(b[3]) << 24);
+  }
+
+  // Str returns a pointer to a string within the bundle, and its length.
+  const char* Str(size_t* length) {
+    *length = U32();
+    if (!ok_ || size_t(end_ - p_) < *length) {
+      ok_ = false;
+      *length = 0;
+      return "";
+    }
+    const char* s = p_;
+    p_ += *length;
+    return s;
+  }
+
+  std::string StdStr() {
+    size_t length;
+    const char* s = Str(&length);
+    return std::string(s, length);
+  }
+
+  bool ok() const { return ok_; }
+
+ private:
+  const char* p_;
+  const char* end_;
+  bool ok_;
+};
+
+// Loads the import graph of the module with the given url in a separate
+// context, without evaluating it, and encodes it as a bundle into out, which
+// needs to be freed by the caller. A non-zero return value indicates error.
+// Check worker_last_exception().
+int worker_create_bundle(worker* w,
+                         char* url_s,
+                         int resolve,
+                         char** out,
+                         size_t* length) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
+
+  Local<Context> context = Context::New(w->isolate);
+  Context::Scope context_scope(context);
+  InitModuleData(context);
+  TryCatch try_catch(w->isolate);
+
+  std::vector<BundleModule> modules;
+  Local<String> url = String::NewFromUtf8(w->isolate, url_s);
+  MaybeLocal<Module> mod;
+  LoadModule(w, context, url, mod, resolve, &modules);
+  delete GetModuleData(context);
+  context->SetAlignedPointerInEmbedderData(kModuleDataIndex, NULL);
+  if (mod.IsEmpty()) {
+    SetException(w, context, &try_catch);
+    return 1;
+  }
+
+  std::string bundle(kBundleMagic, 4);
+  AppendU32(&bundle, kBundleVersion);
+  AppendU32(&bundle, modules.size());
+  AppendStr(&bundle, url_s);
+  for (auto& m : modules) {
+    AppendStr(&bundle, m.url);
+    AppendStr(&bundle, m.source);
+    AppendStr(&bundle, "");
+    AppendU32(&bundle, m.imports.size());
+    for (auto& it : m.imports) {
+      AppendStr(&bundle, it.first);
+      AppendStr(&bundle, it.second);
+    }
+  }
+  *out = static_cast<char*>(malloc(bundle.size()));
+  memcpy(*out, bundle.data(), bundle.size());
+  *length = bundle.size();
+  return 0;
+}
+
+// Loads all the modules within a bundle created by worker_create_bundle, and
+// evaluates its entry module, without any calls into Go. If file is not NULL,
+// the bundle's data is within it, and the sources are used in place. A non-zero
+// return value indicates error. Check worker_last_exception().
+int worker_load_bundle(worker* w,
+                       const char* data,
+                       size_t length,
+                       mapped_file* file) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+  TryCatch try_catch(w->isolate);
+
+  ModuleData* d = GetModuleData(context);
+  BundleReader r(data, length);
+  if (length < 4 || memcmp(data, kBundleMagic, 4) != 0) {
+    SetError(w, "v8worker: invalid bundle");
+    return 1;
+  }
+  r.U32();
+  if (r.U32() != kBundleVersion) {
+    SetError(w, "v8worker: unsupported bundle version");
+    return 1;
+  }
+  uint32_t count = r.U32();
+  std::string entry = r.StdStr();
+  std::vector<std::string> builtins;
+  for (uint32_t i = 0; i < count && r.ok(); i++) {
+    std::string url = r.StdStr();
+    module_source source;
+    source.data = r.Str(&source.length);
+    source.file = file;
+    size_t code_cache_length;
+    r.Str(&code_cache_length);
+    uint32_t imports = r.U32();
+    for (uint32_t j = 0; j < imports && r.ok(); j++) {
+      std::string specifier = r.StdStr();
+      std::string resolved = r.StdStr();
+      if (IsBuiltinModule(resolved)) {
+        builtins.push_back(resolved);
+      }
+      d->resolved_urls[ResolvedKey(url, specifier)] = resolved;
+    }
+    if (!r.ok() || d->url_to_module_map.count(url) != 0) {
+      continue;
+    }
+    HandleScope module_scope(w->isolate);
+    Local<String> text = file != NULL
+                             ? NewModuleSource(w, source)
+                             : NewMessageString(w, source.data, source.length);
+    if (CompileModule(w, context, url, text).IsEmpty()) {
+      SetException(w, context, &try_catch);
+      return 1;
+    }
+  }
+  if (!r.ok()) {
+    SetError(w, "v8worker: truncated bundle");
+    return 1;
+  }
+  for (auto& url : builtins) {
+    if (d->url_to_module_map.count(url) == 0 &&
+        CompileBuiltinModule(w, context, url).IsEmpty()) {
+      SetException(w, context, &try_catch);
+      return 1;
+    }
+  }
+
+  auto it = d->url_to_module_map.find(entry);
+  if (it == d->url_to_module_map.end()) {
+    SetError(w, "v8worker: bundle is missing its entry module");
+    return 1;
+  }
+  return RunModule(w, context, it->second.Get(w->isolate), &try_catch);
+}
+
+int worker_load_script(worker* w, char* name_s, char* source_s) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  TryCatch try_catch(w->isolate);
+
+  Local<String> name = String::NewFromUtf8(w->isolate, name_s);
+  Local<String> source_text = String::NewFromUtf8(w->isolate, source_s);
+
+  ScriptOrigin origin(name);
+
+  // Use the code cache from a previous compile of the same script if there is
+  // one. The CachedData only borrows the entry's buffer, which is kept alive
+  // by the local reference to it for the duration of the compile.
+  std::string key;
+  CodeCache::Entry cached;
+  ScriptCompiler::CompileOptions options = ScriptCompiler::kNoCompileOptions;
+  ScriptCompiler::CachedData* cached_data = NULL;
+  if (code_cache.Enabled()) {
+    key = CodeCacheKey(name_s, source_s);
+    cached = code_cache.Get(key);
+    if (cached) {
+      cached_data = new ScriptCompiler::CachedData(
+          reinterpret_cast<const uint8_t*>(cached->data()), cached->size());
+      options = ScriptCompiler::kConsumeCodeCache;
+    }
+  }
+  ScriptCompiler::Source source(source_text, origin, cached_data);
+
+  MaybeLocal<Script> maybe_script =
+      ScriptCompiler::Compile(context, &source, options);
+  Local<Script> script;
+
+  if (!maybe_script.ToLocal(&script)) {
+    assert(try_catch.HasCaught());
+    SetException(w, context, &try_catch);
+    return 1;
+  }
+
+  bool produce = false;
+  if (code_cache.Enabled()) {
+    if (!cached) {
+      code_cache.misses++;
+      produce = true;
+    } else if (source.GetCachedData()->rejected) {
+      code_cache.rejections++;
+      code_cache.Remove(key);
+      produce = true;
+    } else {
+      code_cache.hits++;
+    }
+  }
+
+  Handle<Value> result = script->Run();
+
+  if (result.IsEmpty()) {
+    assert(try_catch.HasCaught());
+    SetException(w, context, &try_catch);
+    return 2;
+  }
+
+  // The cache is produced after the script has run, so that it also includes
+  // the functions which were lazily compiled during its execution.
+  if (produce) {
+    std::unique_ptr<ScriptCompiler::CachedData> data(
+        ScriptCompiler::CreateCodeCache(script->GetUnboundScript(),
+                                        source_text));
+    if (data) {
+      code_cache.Put(key, data->data, data->length);
+    }
+  }
+
+  return 0;
+}
+
+// CompileJob is a script queued for background compilation.
+struct CompileJob {
+  std::string name;
+  std::string source;
+};
+
+// A compile service compiles scripts on a pool of background threads, each of
+// which has an isolate of its own, and puts the resulting code caches into the
+// process-wide code cache, so that workers which later load the same scripts
+// skip compilation. Each unique script is only compiled once per service.
+struct compile_service_s {
+  compile_service_s() : pending(0), failures(0), stopping(false) {}
+
+  std::mutex mutex;  // guards everything below but threads
+  std::condition_variable cv;
+  std::condition_variable done_cv;
+  std::vector<CompileJob> jobs;
+  std::unordered_set<std::string> keys;
+  int pending;
+  int failures;
+  std::string error;
+  bool stopping;
+  std::vector<std::thread> threads;
+};
+
+// Precompile eagerly compiles the job's script, so that the code cache covers
+// all of its functions and not only those which are run on load, and puts the
+// cache into the code cache. It returns false with the error otherwise.
+bool Precompile(Isolate* isolate,
+                Local<Context> context,
+                const CompileJob& job,
+                std::string* error) {
+  HandleScope handle_scope(isolate);
+  TryCatch try_catch(isolate);
+
+  std::string key = CodeCacheKey(job.name.c_str(), job.source.c_str());
+  if (code_cache.Get(key)) {
+    return true;
+  }
+
+  Local<String> source_text = String::NewFromUtf8(isolate, job.source.c_str());
+  ScriptOrigin origin(String::NewFromUtf8(isolate, job.name.c_str()));
+  ScriptCompiler::Source source(source_text, origin);
+
+  Local<UnboundScript> script;
+  if (!ScriptCompiler::CompileUnboundScript(isolate, &source,
+                                            ScriptCompiler::kEagerCompile)
+           .ToLocal(&script)) {
+    *error = ExceptionSummary(isolate, context, &try_catch);
+    return false;
+  }
+  std::unique_ptr<ScriptCompiler::CachedData> data(
+      ScriptCompiler::CreateCodeCache(script, source_text));
+  if (!data) {
+    *error = job.name + ": couldn't create code cache";
+    return false;
+  }
+  code_cache.Put(key, data->data, data->length);
+  return true;
+}
+
+// RunCompileThread compiles the service's jobs until it's disposed.
+void RunCompileThread(compile_service* s) {
+  CountingAllocator allocator;
+  Isolate* isolate = NewIsolate(NULL, NULL, &allocator);
+  {
+    Locker locker(isolate);
+    Isolate::Scope isolate_scope(isolate);
+    HandleScope handle_scope(isolate);
+    Local<Context> context = Context::New(isolate);
+    Context::Scope context_scope(context);
+
+    std::unique_lock<std::mutex> lock(s->mutex);
+    while (true) {
+      s->cv.wait(lock, [s] { return s->stopping || !s->jobs.empty(); });
+      if (s->stopping) {
+        break;
+      }
+      CompileJob job = std::move(s->jobs.back());
+      s->jobs.pop_back();
+      lock.unlock();
+      std::string error;
+      bool ok = Precompile(isolate, context, job, &error);
+      while (platform::PumpMessageLoop(default_platform, isolate)) {
+      }
+      lock.lock();
+      if (!ok && s->failures++ == 0) {
+        s->error = error;
+      }
+      if (--s->pending == 0) {
+        s->done_cv.notify_all();
+      }
+    }
+  }
+  isolate->Dispose();
+}
+
+// The size of the chunks in which streamed sources are read from Go.
+const size_t kSourceChunkSize = 64 * 1024;
+
+// SourceStream feeds a streamed compile with chunks of a script read from Go.
+// It's called by V8 from the streaming task, which runs on the thread that
+// called worker_load_script_stream. V8 takes ownership of each chunk,
+// and doesn't retain the source, so the chunks are also appended to a copy
+// from which the full source string is created once streaming has finished.
+class SourceStream : public ScriptCompiler::ExternalSourceStream {
+ public:
+  explicit SourceStream(int64_t token) : token_(token), failed_(false) {}
+
+  size_t GetMoreData(const uint8_t** src) override {
+    if (failed_) {
+      return 0;
+    }
+    char* chunk = new char[kSourceChunkSize];
+    int n = readSourceCb(token_, chunk, kSourceChunkSize);
+    if (n <= 0) {
+      delete[] chunk;
+      failed_ = n < 0;
+      return 0;
+    }
+    source_.append(chunk, n);
+    *src = reinterpret_cast<const uint8_t*>(chunk);
+    return n;
+  }
+
+  bool failed() const { return failed_; }
+  std::string* source() { return &source_; }
+
+ private:
+  int64_t token_;
+  bool failed_;
+  std::string source_;
+};
+
+// ExternalSource backs the string of a streamed source, taking over its
+// buffer rather than copying it.
+class ExternalSource : public String::ExternalOneByteStringResource {
+ public:
+  explicit ExternalSource(std::string* source) { source_.swap(*source); }
+
+  const char* data() const override { return source_.data(); }
+  size_t length() const override { return source_.size(); }
+
+ private:
+  std::string source_;
+};
+
+// NewSourceString creates the string for a streamed source, leaving the given
+// source empty if it could be moved into an external string.
+Local<String> NewSourceString(worker* w, std::string* source) {
+  if (source->size() >= kExternalStringThreshold &&
+      w->snapshot_creator == NULL && IsASCII(source->data(), source->size())) {
+    ExternalSource* resource = new ExternalSource(source);
+    Local<String> value;
+    if (String::NewExternalOneByte(w->isolate, resource).ToLocal(&value)) {
+      return value;
+    }
+    Local<String> copy =
+        NewMessageString(w, resource->data(), resource->length());
+    delete resource;
+    return copy;
+  }
+  return NewMessageString(w, source->data(), source->size());
+}
+
+// Loads a script whose source is streamed from Go, by calling readSourceCb
+// with the given token until it returns 0 at the end of the source, or -1 on
+// error. The streaming task parses each chunk once it has been read, and runs
+// on the calling thread with the isolate released, so that other threads can
+// use the isolate meanwhile. Reading only overlaps with parsing by way of Go's
+// read-ahead. A non-zero return value indicates error. Check
+// worker_last_exception().
+int worker_load_script_stream(worker* w, char* name_s, int64_t token) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  TryCatch try_catch(w->isolate);
+
+  SourceStream* stream = new SourceStream(token);
+  ScriptCompiler::StreamedSource source(
+      stream, ScriptCompiler::StreamedSource::UTF8);
+  std::unique_ptr<ScriptCompiler::ScriptStreamingTask> task(
+      ScriptCompiler::StartStreamingScript(w->isolate, &source));
+  UnlockIsolate(w);
+  {
+    Unlocker unlocker(w->isolate);
+    task->Run();
+  }
+  RelockIsolate(w);
+  if (stream->failed()) {
+    SetError(w, "v8worker: failed to read the source");
+    return 1;
+  }
+
+  Local<String> name = String::NewFromUtf8(w->isolate, name_s);
+  ScriptOrigin origin(name);
+  Local<String> source_text = NewSourceString(w, stream->source());
+  Local<Script> script;
+  if (!ScriptCompiler::Compile(context, &source, source_text, origin)
+           .ToLocal(&script)) {
+    assert(try_catch.HasCaught());
+    SetException(w, context, &try_catch);
+    return 1;
+  }
+
+  Handle<Value> result = script->Run();
+  if (result.IsEmpty()) {
+    assert(try_catch.HasCaught());
+    SetException(w, context, &try_catch);
+    return 2;
+  }
+  return 0;
+}
+
+// Enables the process-wide code cache for compiled scripts. If dir is not
+// empty, cache entries are also persisted within it.
+void code_cache_enable(const char* dir) {
+  code_cache.Enable(dir);
+}
+
+void code_cache_get_stats(code_cache_stats* stats) {
+  stats->hits = code_cache.hits;
+  stats->misses = code_cache.misses;
+  stats->rejections = code_cache.rejections;
+}
+
+// Empties the in-memory code cache and zeroes its stats, so that tests start
+// from a cold cache. It's only meant for tests.
+void code_cache_reset() {
+  code_cache.Reset();
+}
+
+// Creates a compile service with the given number of threads. It enables the
+// code cache in memory if it hasn't been enabled already.
+compile_service* compile_service_new(int threads) {
+  if (!code_cache.Enabled()) {
+    code_cache.Enable("");
+  }
+  compile_service* s = new compile_service();
+  for (int i = 0; i < threads; i++) {
+    s->threads.push_back(std::thread(RunCompileThread, s));
+  }
+  return s;
+}
+
+// Queues a script for compilation, unless the same script has been queued
+// before.
+void compile_service_submit(compile_service* s,
+                            const char* name_s,
+                            const char* source_s) {
+  std::string key = CodeCacheKey(name_s, source_s);
+  {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    if (!s->keys.insert(key).second) {
+      return;
+    }
+    s->jobs.push_back(CompileJob{name_s, source_s});
+    s->pending++;
+  }
+  s->cv.notify_one();
+}
+
+// Waits for all queued scripts to be compiled, and returns the number that
+// failed since the last call. If any did, error is set to a copy of the first
+// of their errors, which the caller needs to free.
+int compile_service_wait(compile_service* s, char** error) {
+  std::unique_lock<std::mutex> lock(s->mutex);
+  s->done_cv.wait(lock, [s] { return s->pending == 0; });
+  int failures = s->failures;
+  if (failures > 0) {
+    *error = strdup(s->error.c_str());
+  }
+  s->failures = 0;
+  s->error.clear();
+  return failures;
+}
+
+// Stops the service's threads, dropping any scripts which are still queued.
+// It must not be called concurrently with compile_service_wait.
+void compile_service_dispose(compile_service* s) {
+  {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->stopping = true;
+  }
+  s->cv.notify_all();
+  for (auto& thread : s->threads) {
+    thread.join();
+  }
+  delete s;
+}
+
+// Creates a worker with the given limits, which may be NULL, whose
+// ArrayBuffers are backed by the given kind of allocator.
+worker* worker_init(int id,
+                    int enable_print,
+                    worker_limits* limits,
+                    int allocator) {
+  CountingAllocator* a = NewAllocator(allocator);
+  Isolate* isolate = NewIsolate(NULL, limits, a);
+  worker* w = NewWorker(id, isolate, enable_print, NULL);
+  w->allocator = a;
+  if (limits != NULL) {
+    ApplyLimits(w, limits);
+  }
+
+  Locker locker(isolate);
+  Isolate::Scope isolate_scope(isolate);
+  HandleScope handle_scope(isolate);
+
+  InitContext(w);
+  return w;
+}
+
+// Creates a worker with a context of its own within the isolate of the given
+// worker, i.e. with separate globals, modules and handlers, but sharing the
+// owner's heap. This is much cheaper than creating a worker with its own
+// isolate. If the owner was created from a snapshot, the context is
+// deserialized from it too. The limits may be NULL, and the heap limits within
+// them are ignored in favour of the owner's. Calls into workers sharing an
+// isolate are serialized. The owner stays alive until it and all its
+// contexts have been disposed. It returns NULL for snapshot creators.
+worker* worker_new_context(worker* owner,
+                           int id,
+                           int enable_print,
+                           worker_limits* limits) {
+  owner = owner->owner;
+  if (owner->snapshot_creator != NULL) {
+    return NULL;
+  }
+  Locker locker(owner->isolate);
+  Isolate::Scope isolate_scope(owner->isolate);
+  HandleScope handle_scope(owner->isolate);
+
+  worker* w =
+      AllocWorker(id, owner->isolate, enable_print, owner->startup_snapshot);
+  w->owner = owner;
+  w->refs = 0;
+  w->allocator = owner->allocator;
+  if (limits != NULL) {
+    ApplyLimits(w, limits);
+  }
+  if (w->stack_limit_kb == 0) {
+    w->stack_limit_kb = owner->stack_limit_kb;
+  }
+  owner->refs++;
+
+  InitContext(w);
+  return w;
+}
+
+// Creates a worker whose isolate is owned by a SnapshotCreator. Scripts and
+// modules can be loaded into it as usual, before worker_create_snapshot is
+// called to serialize its heap. The isolate is entered by the calling thread,
+// so callers need to ensure that all subsequent calls are made from the same
+// thread.
+worker* worker_init_snapshot_creator(int id, int enable_print) {
+  SnapshotCreator* creator = new SnapshotCreator(external_references);
+  Isolate* isolate = creator->GetIsolate();
+  worker* w = NewWorker(id, isolate, enable_print, NULL);
+  w->snapshot_creator = creator;
+
+  Locker locker(isolate);
+  Isolate::Scope isolate_scope(isolate);
+  HandleScope handle_scope(isolate);
+
+  InitContext(w);
+  return w;
+}
+
+// Serializes the heap of a worker created with worker_init_snapshot_creator.
+// The worker is disposed in the process and must not be used afterwards.
+snapshot* worker_create_snapshot(worker* w) {
+  SnapshotCreator* creator = w->snapshot_creator;
+  snapshot* s = new (snapshot);
+  {
+    Locker locker(w->isolate);
+    Isolate::Scope isolate_scope(w->isolate);
+    {
+      HandleScope handle_scope(w->isolate);
+      Local<Context> context = Local<Context>::New(w->isolate, w->context);
+
+      // Global handles can't be serialized, so the handlers are moved into
+      // the context itself, and the module maps are dropped.
+      StashHandlers(w, context);
+      w->promises.clear();
+      delete GetModuleData(context);
+      context->SetAlignedPointerInEmbedderData(kModuleDataIndex, NULL);
+      context->SetAlignedPointerInEmbedderData(kWorkerIndex, NULL);
+      w->context.Reset();
+      w->global_template.Reset();
+      w->port_template.Reset();
+      w->exception.Reset();
+      w->exception_message.Reset();
+
+      creator->SetDefaultContext(Context::New(w->isolate));
+      creator->AddContext(context);
+    }
+    s->blob =
+        creator->CreateBlob(SnapshotCreator::FunctionCodeHandling::kKeep);
+  }
+  delete creator;
+  delete (w);
+  return s;
+}
+
+// Creates a worker by deserializing the context within the given snapshot. The
+// snapshot must outlive the worker.
+worker* worker_init_from_snapshot(int id,
+                                  snapshot* s,
+                                  worker_limits* limits,
+                                  int allocator) {
+  CountingAllocator* a = NewAllocator(allocator);
+  Isolate* isolate = NewIsolate(s, limits, a);
+  worker* w = NewWorker(id, isolate, 0, s);
+  w->allocator = a;
+  if (limits != NULL) {
+    ApplyLimits(w, limits);
+  }
+
+  Locker locker(isolate);
+  Isolate::Scope isolate_scope(isolate);
+  HandleScope handle_scope(isolate);
+
+  InitContext(w);
+  return w;
+}
+
+// Discards the worker's current context, along with its module maps and
+// handlers, and replaces it with a fresh one, which is deserialized from the
+// startup snapshot if there is one. The isolate, and with it the heap and the
+// compiled code, is kept, as is the template for the global object. A
+// non-zero return value indicates that the worker can't be reset, as is the
+// case for snapshot creators.
+int worker_reset_context(worker* w) {
+  if (w->snapshot_creator != NULL) {
+    SetError(w, "v8worker: snapshot creators can't be reset");
+    return 1;
+  }
+
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  HandleScope handle_scope(w->isolate);
+
+  DisposeContext(w);
+  w->cpu_used_ns = 0;
+
+  InitContext(w);
+  return 0;
+}
+
+void snapshot_dispose(snapshot* s) {
+  delete[] s->blob.data;
+  delete (s);
+}
+
+// Called from Go to send a message of the given length, which doesn't need to
+// be null terminated, to JavaScript. It will call the callback registered with
+// $recv. A non-zero return value indicates error. Check
+// worker_last_exception().
+int worker_send(worker* w, const char* msg, size_t length) {
+  TRACE_BEGIN(w, TRACE_SEND);
+  Locker locker(w->isolate);
+  TRACE_MARK(TRACE_LOCK);
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  TryCatch try_catch(w->isolate);
+
+  Local<Function> recv = Local<Function>::New(w->isolate, w->recv);
+  if (recv.IsEmpty()) {
+    SetError(w, "v8worker: callback not registered with $recv");
+    return 1;
+  }
+
+  Local<Value> args[1];
+  args[0] = NewMessageString(w, msg, length);
+  TRACE_MARK(TRACE_ENTER);
+
+  assert(!try_catch.HasCaught());
+
+  recv->Call(context->Global(), 1, args);
+  TRACE_MARK(TRACE_EXEC);
+
+  if (try_catch.HasCaught()) {
+    SetException(w, context, &try_catch);
+    return 2;
+  }
+
+  return 0;
+}
+
+// Called from Go to send a batch of messages to JavaScript, with the isolate
+// and context only being entered once. The messages are packed back to back
+// in data, with their lengths given by lengths. If a callback has been
+// registered with $recvBatch, it is called once with an array of all the
+// messages. Otherwise, the callback registered with $recv is called once per
+// message. Errors are reported per message in the errors array, which needs to
+// have room for n entries, and the return value is the number of messages
+// which failed.
+int worker_send_batch(worker* w,
+                      const char* data,
+                      const size_t* lengths,
+                      int n,
+                      char** errors) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  TryCatch try_catch(w->isolate);
+
+  Local<Function> recv_batch = Local<Function>::New(w->isolate, w->recv_batch);
+  if (!recv_batch.IsEmpty()) {
+    Local<Array> batch = Array::New(w->isolate, n);
+    const char* msg = data;
+    for (int i = 0; i < n; i++) {
+      batch->Set(context, i, NewMessageString(w, msg, lengths[i])).FromJust();
+      msg += lengths[i];
+    }
+    Local<Value> args[1];
+    args[0] = batch;
+
+    recv_batch->Call(context->Global(), 1, args);
+
+    if (try_catch.HasCaught()) {
+      // The batch was handled as a whole, so none of its messages are known
+      // to have been delivered.
+      std::string exception = ExceptionSummary(w->isolate, context, &try_catch);
+      for (int i = 0; i < n; i++) {
+        errors[i] = (char*)CopyString(exception);
+      }
+      return n;
+    }
+    return 0;
+  }
+
+  Local<Function> recv = Local<Function>::New(w->isolate, w->recv);
+  if (recv.IsEmpty()) {
+    for (int i = 0; i < n; i++) {
+      errors[i] = (char*)CopyString(
+          "v8worker: callback not registered with $recv or $recvBatch");
+    }
+    return n;
+  }
+
+  int failed = 0;
+  const char* msg = data;
+  for (int i = 0; i < n; i++) {
+    HandleScope message_scope(w->isolate);
+    Local<Value> args[1];
+    args[0] = NewMessageString(w, msg, lengths[i]);
+    msg += lengths[i];
+
+    recv->Call(context->Global(), 1, args);
+
+    if (try_catch.HasCaught()) {
+      std::string exception = ExceptionSummary(w->isolate, context, &try_catch);
+      errors[i] = (char*)CopyString(exception);
+      failed++;
+      if (!try_catch.CanContinue()) {
+        // Execution has been terminated, so the remaining messages can't be
+        // delivered either.
+        for (int j = i + 1; j < n; j++) {
+          errors[j] = (char*)CopyString(exception);
+          failed++;
+        }
+        break;
+      }
+      try_catch.Reset();
+    }
+  }
+  return failed;
+}
+
+// Called from Go to send binary data to JavaScript. It will call the callback
+// registered with $recvBuffer with an ArrayBuffer that is backed directly by
+// the given memory. The ArrayBuffer is neutered once the callback returns, so
+// JavaScript can't access the memory after this call. A non-zero return value
+// indicates error. Check worker_last_exception().
+int worker_send_bytes(worker* w, void* data, size_t length) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
 
   Local<Context> context = Local<Context>::New(w->isolate, w->context);
   Context::Scope context_scope(context);
 
-  Local<Value> v = args[0];
-  assert(v->IsFunction());
-  Local<Function> func = Local<Function>::Cast(v);
+  TryCatch try_catch(w->isolate);
 
-  w->recv.Reset(isolate, func);
-}
+  Local<Function> recv_buffer =
+      Local<Function>::New(w->isolate, w->recv_buffer);
+  if (recv_buffer.IsEmpty()) {
+    SetError(w, "v8worker: callback not registered with $recvBuffer");
+    return 1;
+  }
 
-// The $recvSync function. Sets the given callback.
-void RecvSync(const FunctionCallbackInfo<Value>& args) {
-  Isolate* isolate = args.GetIsolate();
-  worker* w = (worker*)isolate->GetData(0);
-  assert(w->isolate == isolate);
+  Local<ArrayBuffer> buffer = ArrayBuffer::New(
+      w->isolate, data, length, ArrayBufferCreationMode::kExternalized);
+  Local<Value> args[1];
+  args[0] = buffer;
 
-  HandleScope handle_scope(isolate);
+  recv_buffer->Call(context->Global(), 1, args);
+  buffer->Neuter();
+
+  if (try_catch.HasCaught()) {
+    SetException(w, context, &try_catch);
+    return 2;
+  }
+
+  return 0;
+}
+
+// Called from Go to send a value serialized by $sendValue, or by another
+// ValueSerializer using a compatible format, to JavaScript. It will call the
+// callback registered with $recvValue with the deserialized value. The data
+// only needs to be valid for the duration of the call, so values can be passed
+// straight from one worker to another. A non-zero return value indicates
+// error. Check worker_last_exception().
+int worker_send_value(worker* w, const void* data, size_t length) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
 
   Local<Context> context = Local<Context>::New(w->isolate, w->context);
   Context::Scope context_scope(context);
 
-  Local<Value> v = args[0];
-  assert(v->IsFunction());
-  Local<Function> func = Local<Function>::Cast(v);
+  TryCatch try_catch(w->isolate);
 
-  w->recv_sync_handler.Reset(isolate, func);
-}
+  Local<Function> recv_value = Local<Function>::New(w->isolate, w->recv_value);
+  if (recv_value.IsEmpty()) {
+    SetError(w, "v8worker: callback not registered with $recvValue");
+    return 1;
+  }
 
-// The $send function. Calls the corresponding worker's Callback in Go.
-void Send(const FunctionCallbackInfo<Value>& args) {
-  std::string msg;
-  worker* w = NULL;
-  {
-    Isolate* isolate = args.GetIsolate();
-    w = static_cast<worker*>(isolate->GetData(0));
-    assert(w->isolate == isolate);
+  ValueDeserializer deserializer(
+      w->isolate, static_cast<const uint8_t*>(data), length);
+  Local<Value> args[1];
+  if (deserializer.ReadHeader(context).IsNothing() ||
+      !deserializer.ReadValue(context).ToLocal(&args[0])) {
+    if (try_catch.HasCaught()) {
+      SetException(w, context, &try_catch);
+    } else {
+      SetError(w, "v8worker: invalid serialized value");
+    }
+    return 1;
+  }
 
-    Locker locker(w->isolate);
-    HandleScope handle_scope(isolate);
+  recv_value->Call(context->Global(), 1, args);
 
-    Local<Context> context = Local<Context>::New(w->isolate, w->context);
-    Context::Scope context_scope(context);
+  if (try_catch.HasCaught()) {
+    SetException(w, context, &try_catch);
+    return 2;
+  }
 
-    Local<Value> v = args[0];
-    assert(v->IsString());
+  return 0;
+}
 
-    String::Utf8Value str(v);
-    msg = ToCString(str);
+// CallRecvSync calls the callback registered with $recvSync, waiting for the
+// Promise it returns to settle if need be, and returns its string value, or a
+// description of why there isn't one.
+Local<String> CallRecvSync(worker* w,
+                           Local<Context> context,
+                           Local<String> msg) {
+  Local<Function> recv_sync_handler =
+      Local<Function>::New(w->isolate, w->recv_sync_handler);
+  if (recv_sync_handler.IsEmpty()) {
+    return String::NewFromUtf8(
+        w->isolate, "v8worker: callback not registered with $recvSync");
   }
-  // TODO(tav): should we use Unlocker?
-  recvCb(w->id, (char*)msg.c_str());
-}
 
-// The $sendSync function. Calls the corresponding worker's SyncCallback in Go.
-void SendSync(const FunctionCallbackInfo<Value>& args) {
-  std::string msg;
-  worker* w = NULL;
-  {
-    Isolate* isolate = args.GetIsolate();
-    w = static_cast<worker*>(isolate->GetData(0));
-    assert(w->isolate == isolate);
+  Local<Value> args[1];
+  args[0] = msg;
+  Local<Value> response_value =
+      recv_sync_handler->Call(context->Global(), 1, args);
 
-    Locker locker(w->isolate);
-    HandleScope handle_scope(isolate);
+  if (!response_value.IsEmpty() && response_value->IsPromise()) {
+    Local<Promise> promise = Local<Promise>::Cast(response_value);
+    if (!AwaitPromise(w, context, promise)) {
+      return String::NewFromUtf8(w->isolate,
+                                 w->stopping
+                                     ? "v8worker: worker has been disposed"
+                                     : "v8worker: promise was never settled");
+    }
+    if (promise->State() == Promise::kRejected) {
+      String::Utf8Value reason(promise->Result());
+      std::string out("v8worker: promise rejected: ");
+      out.append(ToCString(reason));
+      return String::NewFromUtf8(w->isolate, out.c_str());
+    }
+    response_value = promise->Result();
+  }
 
-    Local<Context> context = Local<Context>::New(w->isolate, w->context);
-    Context::Scope context_scope(context);
+  if (!response_value.IsEmpty() && response_value->IsString()) {
+    return Local<String>::Cast(response_value);
+  }
+  return String::NewFromUtf8(w->isolate, "v8worker: non-string return value");
+}
 
-    Local<Value> v = args[0];
-    assert(v->IsString());
+// SendSyncInto sends a message to the $recvSync callback, and encodes its
+// response into buf if it fits within cap bytes, or into overflow otherwise.
+// It returns the length of the response.
+size_t SendSyncInto(worker* w,
+                    const char* msg,
+                    size_t length,
+                    char* buf,
+                    size_t cap,
+                    std::string* overflow) {
+  TRACE_BEGIN(w, TRACE_SEND_SYNC);
+  Locker locker(w->isolate);
+  TRACE_MARK(TRACE_LOCK);
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
 
-    String::Utf8Value str(v);
-    msg = ToCString(str);
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  Local<String> message = NewMessageString(w, msg, length);
+  TRACE_MARK(TRACE_ENTER);
+  Local<String> response = CallRecvSync(w, context, message);
+  TRACE_MARK(TRACE_EXEC);
+  bool ascii;
+  size_t size = Utf8Size(response, &ascii);
+  if (size <= cap) {
+    EncodeString(response, ascii, buf, size);
+  } else {
+    overflow->resize(size);
+    EncodeString(response, ascii, &(*overflow)[0], size);
   }
-  char* returnMsg = recvSyncCb(w->id, (char*)msg.c_str());
-  Local<String> returnV = String::NewFromUtf8(w->isolate, returnMsg);
-  args.GetReturnValue().Set(returnV);
-  free(returnMsg);
+  TRACE_MARK(TRACE_RETURN);
+  return size;
 }
 
-void v8_init() {
-  const char* options = "--harmony_public_fields --harmony_private_fields";
-  V8::SetFlagsFromString(options, strlen(options));
-  Platform* platform = platform::CreateDefaultPlatform();
-  V8::InitializePlatform(platform);
-  V8::Initialize();
+// Called from Go to send a message of the given length to JavaScript. It will
+// call the callback registered with $recvSync and return the length of its
+// string value. The value is written directly into buf if it fits within cap
+// bytes. Otherwise, it's retained until it's copied out by worker_read_result,
+// which must be called before the worker is used again.
+size_t worker_send_sync(worker* w,
+                        const char* msg,
+                        size_t length,
+                        char* buf,
+                        size_t cap) {
+  return SendSyncInto(w, msg, length, buf, cap, &w->result);
 }
 
-void worker_dispose(worker* w) {
-  w->isolate->Dispose();
-  delete (w);
+// Copies the response retained by worker_send_sync into buf, which needs to
+// be large enough to hold it, and then releases it.
+void worker_read_result(worker* w, char* buf) {
+  memcpy(buf, w->result.data(), w->result.size());
+  std::string().swap(w->result);
 }
 
-const char* worker_last_exception(worker* w) {
-  return CopyString(w->last_exception);
-}
+// Called from Go to settle the Promise returned by a $sendAsync call. A zero
+// status resolves it with the given value, and any other status rejects it
+// with an Error using the value as its message. The settlement is queued
+// first, so that a worker_send_sync waiting on it while holding the lock is
+// woken up, and then applied directly if no one else does so beforehand.
+void worker_settle(worker* w, int64_t id, int status, const char* value) {
+  Settlement* s = new Settlement();
+  s->id = id;
+  s->status = status;
+  s->value = value;
+  w->settlements.Push(s);
+  {
+    std::lock_guard<std::mutex> lock(w->settle_mutex);
+    w->pending_settlements++;
+  }
+  w->settle_cv.notify_all();
 
-int worker_load_module(worker* w, char* url_s) {
   Locker locker(w->isolate);
   Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
   HandleScope handle_scope(w->isolate);
 
   Local<Context> context = Local<Context>::New(w->isolate, w->context);
   Context::Scope context_scope(context);
-  TryCatch try_catch(w->isolate);
-
-  Local<String> url = String::NewFromUtf8(w->isolate, url_s);
-  MaybeLocal<Module> mod;
-  LoadModule(w, context, url, mod);
 
-  Local<Module> module;
-  if (!mod.ToLocal(&module)) {
-    w->last_exception = ExceptionString(w->isolate, context, &try_catch);
-    return 1;
+  if (DrainSettlements(w, context)) {
+    w->isolate->RunMicrotasks();
   }
+}
 
-  MaybeLocal<Value> maybe_result;
-  if (!module->InstantiateModule(context, ResolveModuleCallback)
-           .FromMaybe(false)) {
-    w->last_exception = ExceptionString(w->isolate, context, &try_catch);
-    return 2;
-  }
+// DrainChannel delivers the messages queued on a channel to the onmessage
+// handler that the receiving worker has set for it. If there's no handler yet,
+// the messages stay queued. Exceptions thrown by the handler are dropped, as
+// there is no caller to report them to, and the worker's last error belongs
+// to its sync calls.
+void DrainChannel(worker* w, channel* c) {
+  c->scheduled = false;
 
-  maybe_result = module->Evaluate(context);
-  Local<Value> result;
-  if (!maybe_result.ToLocal(&result)) {
-    w->last_exception = ExceptionString(w->isolate, context, &try_catch);
-    return 3;
+  Isolate::Scope isolate_scope(w->isolate);
+  ApplyStackLimit(w);
+  Watch watch(w);
+  HandleScope handle_scope(w->isolate);
+
+  Local<Context> context = Local<Context>::New(w->isolate, w->context);
+  Context::Scope context_scope(context);
+
+  auto it = w->channel_handlers.find(c->receiver_name);
+  if (it == w->channel_handlers.end()) {
+    return;
+  }
+  Local<Function> handler = it->second.Get(w->isolate);
+  ChannelMessage m;
+  while (c->queue.Pop(&m)) {
+    HandleScope handle_scope(w->isolate);
+    // Catches, and so drops, anything thrown by the handler.
+    TryCatch try_catch(w->isolate);
+    ValueDeserializer deserializer(w->isolate, m.data, m.length);
+    Local<Value> args[1];
+    if (deserializer.ReadHeader(context).FromMaybe(false) &&
+        deserializer.ReadValue(context).ToLocal(&args[0])) {
+      handler->Call(context->Global(), 1, args);
+    }
+    free(m.data);
   }
+  w->isolate->RunMicrotasks();
+}
 
-  return 0;
+// AsyncResult reports the outcome of a queued call to Go, passing its length
+// so that results containing null bytes arrive intact.
+void AsyncResult(int64_t token, int status, const std::string& result) {
+  asyncResultCb(token, status, (char*)result.data(), result.size());
 }
 
-int worker_load_script(worker* w, char* name_s, char* source_s) {
+// RunAsyncCall runs a queued call on the event loop thread and reports its
+// result back to Go. Any error it raises is only reported through the
+// result, as the worker's last error belongs to Go's sync calls.
+void RunAsyncCall(worker* w, AsyncCall* t) {
+  Locker locker(w->isolate);
+  PreserveError preserve(w);
+  if (t->chan != NULL) {
+    DrainChannel(w, t->chan);
+    return;
+  }
+  if (t->sync) {
+    std::string response;
+    SendSyncInto(w, t->msg.data(), t->msg.size(), NULL, 0, &response);
+    AsyncResult(t->token, 0, response);
+    return;
+  }
+  int r = worker_send(w, t->msg.data(), t->msg.size());
+  AsyncResult(t->token, r, r != 0 ? ErrorSummary(w) : std::string());
+}
+
+void RunLoop(worker* w);
+
+// PumpMessageLoop runs the foreground tasks which V8 has posted for the
+// worker's isolate, e.g. to finalize work done on the platform's background
+// threads, and returns the number that were run.
+int PumpMessageLoop(worker* w) {
   Locker locker(w->isolate);
   Isolate::Scope isolate_scope(w->isolate);
-  HandleScope handle_scope(w->isolate);
+  int n = 0;
+  while (platform::PumpMessageLoop(default_platform, w->isolate)) {
+    n++;
+  }
+  return n;
+}
 
-  Local<Context> context = Local<Context>::New(w->isolate, w->context);
-  Context::Scope context_scope(context);
+// QueueCall queues a call for the worker's event loop thread, which is started
+// on first use.
+void QueueCall(worker* w, AsyncCall* t) {
+  std::call_once(w->loop_once, [w] { w->loop = std::thread(RunLoop, w); });
+  w->calls.Push(t);
+  if (w->pending_calls.fetch_add(1) == 0) {
+    // The lock ensures that the wakeup can't be missed by a loop thread that
+    // is about to wait.
+    std::lock_guard<std::mutex> lock(w->loop_mutex);
+    w->loop_cv.notify_one();
+  }
+}
 
-  TryCatch try_catch(w->isolate);
+// RunLoop is the body of a worker's event loop thread. It runs queued calls in
+// order until the worker is disposed, at which point any remaining calls are
+// cancelled.
+void RunLoop(worker* w) {
+  while (true) {
+    AsyncCall* t = w->calls.Pop();
+    if (t == NULL) {
+      if (w->pending_calls > 0) {
+        // A producer is midway through a push.
+        std::this_thread::yield();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(w->loop_mutex);
+      w->loop_cv.wait(lock,
+                      [w] { return w->pending_calls > 0 || w->stopping; });
+      if (w->pending_calls == 0) {
+        return;
+      }
+      continue;
+    }
+    w->pending_calls--;
+    if (w->stopping) {
+      if (t->chan == NULL) {
+        AsyncResult(t->token, 1, "v8worker: worker has been disposed");
+      }
+    } else {
+      RunAsyncCall(w, t);
+      PumpMessageLoop(w);
+    }
+    delete t;
+  }
+}
 
-  Local<String> name = String::NewFromUtf8(w->isolate, name_s);
-  Local<String> source = String::NewFromUtf8(w->isolate, source_s);
+// Called from Go to queue a message for the worker's event loop thread, which
+// is started on first use. It will call the callback registered with $recv,
+// or with $recvSync if sync is non-zero, and report the result to Go's
+// asyncResultCb with the given token. The message is copied, so it needn't
+// outlive the call, which never blocks on JavaScript execution.
+void worker_send_async(worker* w,
+                       const char* msg,
+                       size_t length,
+                       int64_t token,
+                       int sync) {
+  AsyncCall* t = new AsyncCall();
+  t->token = token;
+  t->sync = sync;
+  if (length > 0) {
+    t->msg.assign(msg, length);
+  }
+  t->chan = NULL;
+  QueueCall(w, t);
+}
 
-  ScriptOrigin origin(name);
+void ScheduleChannel(worker* w, channel* c) {
+  AsyncCall* t = new AsyncCall();
+  t->token = 0;
+  t->sync = 0;
+  t->chan = c;
+  QueueCall(w, t);
+}
 
-  Local<Script> script = Script::Compile(source, &origin);
+// Makes $send queue its messages in an outbox of the given capacity instead
+// of calling into Go, and makes $sendSync release the isolate while it calls
+// into Go. The outbox needs to be drained with outbox_wait, and disposed of
+// with outbox_dispose once outbox_wait has returned -1.
+outbox* worker_outbox_new(worker* w, size_t capacity) {
+  Locker locker(w->isolate);
+  w->send_outbox = new outbox(capacity);
+  return w->send_outbox;
+}
 
-  if (script.IsEmpty()) {
-    assert(try_catch.HasCaught());
-    w->last_exception = ExceptionString(w->isolate, context, &try_catch);
-    return 1;
+// Waits for messages to be queued in the outbox, and returns up to max of
+// them in msgs, where they stay valid until the next call. It returns -1 once
+// the worker has been disposed and all its messages have been returned.
+int outbox_wait(outbox* o, outbox_message* msgs, int max) {
+  FreeOutboxBatch(o);
+  outbox_message m;
+  while (true) {
+    while (int(o->batch.size()) < max && o->queue.Pop(&m)) {
+      o->batch.push_back(m);
+    }
+    if (!o->batch.empty()) {
+      break;
+    }
+    std::unique_lock<std::mutex> lock(o->mutex);
+    if (o->closed && o->pending == 0) {
+      return -1;
+    }
+    o->waiters++;
+    o->cv.wait(lock, [o] { return o->pending > 0 || o->closed; });
+    o->waiters--;
   }
+  o->pending -= o->batch.size();
+  // Wake up any producer waiting for space.
+  OutboxNotify(o);
+  memcpy(msgs, o->batch.data(), o->batch.size() * sizeof(outbox_message));
+  return o->batch.size();
+}
 
-  Handle<Value> result = script->Run();
+void outbox_dispose(outbox* o) {
+  OutboxUnref(o);
+}
 
-  if (result.IsEmpty()) {
-    assert(try_catch.HasCaught());
-    w->last_exception = ExceptionString(w->isolate, context, &try_catch);
-    return 2;
+// Maps the file at the given path into memory, and sets data and size to its
+// contents. It returns NULL and sets errno on failure. The mapping is only
+// removed once it's been released, and no worker has any strings pointing
+// into it anymore.
+mapped_file* mapped_file_open(const char* path,
+                              const char** data,
+                              size_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
   }
-
-  return 0;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  void* addr = NULL;
+  if (st.st_size > 0) {
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      return NULL;
+    }
+  }
+  close(fd);
+  mapped_file* f = new mapped_file;
+  f->data = addr;
+  f->size = st.st_size;
+  f->refs = 1;
+  *data = static_cast<const char*>(addr);
+  *size = f->size;
+  return f;
 }
 
-worker* worker_init(int id, int enable_print) {
-  worker* w = new (worker);
+// Takes another reference to the mapping, e.g. for a source passed to C.
+void mapped_file_ref(mapped_file* f) {
+  f->refs++;
+}
 
-  Isolate::CreateParams create_params;
-  create_params.array_buffer_allocator =
-      ArrayBuffer::Allocator::NewDefaultAllocator();
-  Isolate* isolate = Isolate::New(create_params);
-  Locker locker(isolate);
-  Isolate::Scope isolate_scope(isolate);
-  HandleScope handle_scope(isolate);
+void mapped_file_release(mapped_file* f) {
+  MappedFileUnref(f);
+}
 
-  w->isolate = isolate;
-  w->isolate->SetCaptureStackTraceForUncaughtExceptions(true);
-  w->isolate->SetData(0, w);
-  w->id = id;
+// Creates a channel which can hold up to capacity messages, rounded up to a
+// power of two. It's released by channel_dispose once it's no longer attached
+// to any workers.
+channel* channel_new(size_t capacity) {
+  return new channel(capacity);
+}
 
-  Local<ObjectTemplate> global = ObjectTemplate::New(w->isolate);
+void channel_dispose(channel* c) {
+  ChannelUnref(c);
+}
 
-  if (enable_print) {
-    global->Set(String::NewFromUtf8(w->isolate, "$print"),
-                FunctionTemplate::New(w->isolate, Print));
+// Makes the channel available to the worker's JavaScript as $channel(name). If
+// receive is non-zero, the worker becomes the channel's receiver, and messages
+// posted to it are delivered to the onmessage handler of its port object. A
+// channel can only have one receiver. Snapshot creators can't be attached to
+// channels. A non-zero return value indicates error. Check
+// worker_last_exception().
+int worker_attach_channel(worker* w,
+                          const char* name,
+                          channel* c,
+                          int receive) {
+  Locker locker(w->isolate);
+  if (w->snapshot_creator != NULL) {
+    SetError(w, "v8worker: snapshot creators can't attach channels");
+    return 1;
+  }
+  if (w->channels.count(name) != 0) {
+    SetError(w, "v8worker: channel name already in use");
+    return 1;
+  }
+  if (receive) {
+    std::lock_guard<std::mutex> lock(c->mutex);
+    if (c->receiver != NULL) {
+      SetError(w, "v8worker: channel already has a receiver");
+      return 1;
+    }
+    c->receiver = w;
+    c->receiver_name = name;
+    // Deliver anything that was posted before the receiver was attached.
+    c->scheduled = true;
+    ScheduleChannel(w, c);
   }
+  c->refs++;
+  w->channels[name] = c;
+  return 0;
+}
 
-  global->Set(String::NewFromUtf8(w->isolate, "$recv"),
-              FunctionTemplate::New(w->isolate, Recv));
+// Fills in the worker's heap and GC stats, along with the stats for up to n of
+// its heap spaces, and returns the total number of heap spaces.
+int worker_heap_stats(worker* w,
+                      heap_stats* stats,
+                      heap_space_stats* spaces,
+                      int n) {
+  Locker locker(w->isolate);
 
-  global->Set(String::NewFromUtf8(w->isolate, "$send"),
-              FunctionTemplate::New(w->isolate, Send));
+  HeapStatistics hs;
+  w->isolate->GetHeapStatistics(&hs);
+  stats->total_heap_size = hs.total_heap_size();
+  stats->total_heap_size_executable = hs.total_heap_size_executable();
+  stats->total_physical_size = hs.total_physical_size();
+  stats->total_available_size = hs.total_available_size();
+  stats->used_heap_size = hs.used_heap_size();
+  stats->heap_size_limit = hs.heap_size_limit();
+  stats->malloced_memory = hs.malloced_memory();
+  stats->peak_malloced_memory = hs.peak_malloced_memory();
+  stats->number_of_native_contexts = hs.number_of_native_contexts();
+  stats->number_of_detached_contexts = hs.number_of_detached_contexts();
+  worker_gc_stats(w, &stats->gc);
+  worker_array_buffer_stats(w, &stats->array_buffers);
 
-  global->Set(String::NewFromUtf8(w->isolate, "$sendSync"),
-              FunctionTemplate::New(w->isolate, SendSync));
+  int count = w->isolate->NumberOfHeapSpaces();
+  for (int i = 0; i < n && i < count; i++) {
+    HeapSpaceStatistics ss;
+    w->isolate->GetHeapSpaceStatistics(&ss, i);
+    spaces[i].space_name = ss.space_name();
+    spaces[i].space_size = ss.space_size();
+    spaces[i].space_used_size = ss.space_used_size();
+    spaces[i].space_available_size = ss.space_available_size();
+    spaces[i].physical_space_size = ss.physical_space_size();
+  }
+  return count;
+}
 
-  global->Set(String::NewFromUtf8(w->isolate, "$recvSync"),
-              FunctionTemplate::New(w->isolate, RecvSync));
+// Fills in the stats for the worker's ArrayBuffer allocator. Like
+// worker_gc_stats, it doesn't need to lock the isolate.
+void worker_array_buffer_stats(worker* w, array_buffer_stats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (w->allocator != NULL) {
+    w->allocator->GetStats(stats);
+  }
+}
 
-  Local<Context> context = Context::New(w->isolate, NULL, global);
-  w->context.Reset(w->isolate, context);
+// Fills in the worker's GC stats. Unlike worker_heap_stats, it doesn't need to
+// lock the isolate, so it's cheap enough to be polled for metrics.
+void worker_gc_stats(worker* w, gc_stats* stats) {
+  // GCs are per isolate, so they're tracked by its owner.
+  w = w->owner;
+  stats->minor_count = w->minor_gc_count;
+  stats->minor_pause_ns = w->minor_gc_pause_ns;
+  stats->major_count = w->major_gc_count;
+  stats->major_pause_ns = w->major_gc_pause_ns;
+  stats->max_pause_ns = w->max_gc_pause_ns;
+}
 
-  InitModuleData(context);
-  return w;
+// Reports whether the worker's heap limit was reached during its last call, in
+// which case its execution will have been terminated. The flag is cleared once
+// it has been reported, and whenever a new call starts.
+int worker_heap_limit_reached(worker* w) {
+  return w->owner->heap_limit_reached.exchange(false);
 }
 
-// Called from Go to send messages to JavaScript. It will call the callback
-// registered with $recv. A non-zero return value indicates error. Check
+// V8's default sampling interval, in microseconds.
+const int kDefaultProfileIntervalUs = 1000;
+
+// Starts recording a CPU profile of the worker, sampling its JavaScript stack
+// every interval_us microseconds, or at V8's default interval if it's zero.
+// Only the functions' hit counts are recorded, rather than every sample, so
+// that the cost stays low enough for long-running profiles. Note that V8
+// samples the thread which started the profile, so calls should be made from
+// that same thread. A non-zero return value indicates error. Check
 // worker_last_exception().
-int worker_send(worker* w, const char* msg) {
+int worker_profile_start(worker* w, int interval_us) {
   Locker locker(w->isolate);
   Isolate::Scope isolate_scope(w->isolate);
   HandleScope handle_scope(w->isolate);
 
-  Local<Context> context = Local<Context>::New(w->isolate, w->context);
-  Context::Scope context_scope(context);
+  if (w->profiler != NULL) {
+    SetError(w, "v8worker: CPU profile already started");
+    return 1;
+  }
+  if (interval_us <= 0) {
+    interval_us = kDefaultProfileIntervalUs;
+  }
+  w->profiler = CpuProfiler::New(w->isolate);
+  w->profiler->SetSamplingInterval(interval_us);
+  w->profiler->StartProfiling(String::Empty(w->isolate), false);
+  w->profile_interval_us = interval_us;
+  return 0;
+}
 
-  TryCatch try_catch(w->isolate);
+// Stops the CPU profile started by worker_profile_start, and returns its call
+// tree as a flat list of nodes, parents first. It returns NULL if there's no
+// profile being recorded. The result needs to be freed with
+// cpu_profile_dispose.
+cpu_profile* worker_profile_stop(worker* w) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  HandleScope handle_scope(w->isolate);
 
-  Local<Function> recv = Local<Function>::New(w->isolate, w->recv);
-  if (recv.IsEmpty()) {
-    w->last_exception = "v8worker: callback not registered with $recv";
-    return 1;
+  if (w->profiler == NULL) {
+    SetError(w, "v8worker: CPU profile not started");
+    return NULL;
   }
+  CpuProfile* profile = w->profiler->StopProfiling(String::Empty(w->isolate));
 
-  Local<Value> args[1];
-  args[0] = String::NewFromUtf8(w->isolate, msg);
+  std::vector<profile_node> nodes;
+  std::vector<std::pair<const CpuProfileNode*, int>> pending;
+  pending.push_back(std::make_pair(profile->GetTopDownRoot(), 0));
+  while (!pending.empty()) {
+    const CpuProfileNode* node = pending.back().first;
+    profile_node n;
+    n.id = node->GetNodeId();
+    n.parent_id = pending.back().second;
+    n.function_name = strdup(node->GetFunctionNameStr());
+    n.url = strdup(node->GetScriptResourceNameStr());
+    n.line = node->GetLineNumber();
+    n.column = node->GetColumnNumber();
+    n.hit_count = node->GetHitCount();
+    nodes.push_back(n);
+    pending.pop_back();
+    for (int i = node->GetChildrenCount() - 1; i >= 0; i--) {
+      pending.push_back(std::make_pair(node->GetChild(i), n.id));
+    }
+  }
 
-  assert(!try_catch.HasCaught());
+  cpu_profile* p = static_cast<cpu_profile*>(malloc(sizeof(cpu_profile)));
+  p->nodes =
+      static_cast<profile_node*>(malloc(nodes.size() * sizeof(profile_node)));
+  memcpy(p->nodes, nodes.data(), nodes.size() * sizeof(profile_node));
+  p->count = nodes.size();
+  p->start_us = profile->GetStartTime();
+  p->end_us = profile->GetEndTime();
+  p->interval_us = w->profile_interval_us;
 
-  recv->Call(context->Global(), 1, args);
+  profile->Delete();
+  w->profiler->Dispose();
+  w->profiler = NULL;
+  return p;
+}
 
-  if (try_catch.HasCaught()) {
-    w->last_exception = ExceptionString(w->isolate, context, &try_catch);
-    return 2;
+void cpu_profile_dispose(cpu_profile* p) {
+  for (int i = 0; i < p->count; i++) {
+    free((void*)p->nodes[i].function_name);
+    free((void*)p->nodes[i].url);
   }
+  free(p->nodes);
+  free(p);
+}
+
+// Returns why the watchdog terminated the worker's last call with a limit, or
+// INTERRUPT_NONE if it didn't. Like worker_heap_limit_reached, the reason is
+// cleared once it has been reported.
+int worker_interrupt_reason(worker* w) {
+  return w->interrupt.exchange(INTERRUPT_NONE);
+}
 
+// Copies the worker's trace histograms into out, which needs to have room for
+// TRACE_OPS * TRACE_PHASES of them, indexed by operation and then phase. It
+// returns zero, without copying anything, if the binding was built without
+// V8WORKER_TRACE.
+int worker_trace_stats(worker* w, trace_histogram* out) {
+#ifdef V8WORKER_TRACE
+  for (int op = 0; op < TRACE_OPS; op++) {
+    for (int phase = 0; phase < TRACE_PHASES; phase++) {
+      TraceHistogram& h = w->trace[op][phase];
+      trace_histogram* o = &out[op * TRACE_PHASES + phase];
+      o->count = h.count.load(std::memory_order_relaxed);
+      o->total_ns = h.total_ns.load(std::memory_order_relaxed);
+      for (int i = 0; i < TRACE_BUCKETS; i++) {
+        o->buckets[i] = h.buckets[i].load(std::memory_order_relaxed);
+      }
+    }
+  }
+  return 1;
+#else
   return 0;
+#endif
 }
 
-// Called from Go to send messages to JavaScript. It will call the callback
-// registered with $recvSync and return its string value.
-const char* worker_send_sync(worker* w, const char* msg) {
-  std::string out;
+// Runs the foreground tasks which V8 has posted for the worker's isolate, and
+// returns the number that were run. Workers with an event loop thread also do
+// this after each of its calls.
+int worker_pump_message_loop(worker* w) {
+  return PumpMessageLoop(w);
+}
+
+// Runs V8's idle tasks for the worker's isolate, e.g. incremental marking or
+// heap compaction, for up to the given number of seconds. It does nothing if
+// V8 was initialized without idle task support.
+void worker_run_idle_tasks(worker* w, double seconds) {
+  if (!idle_tasks_enabled) {
+    return;
+  }
   Locker locker(w->isolate);
   Isolate::Scope isolate_scope(w->isolate);
-  HandleScope handle_scope(w->isolate);
-
-  Local<Context> context = Local<Context>::New(w->isolate, w->context);
-  Context::Scope context_scope(context);
+  platform::RunIdleTasks(default_platform, w->isolate, seconds);
+}
 
-  Local<Function> recv_sync_handler =
-      Local<Function>::New(w->isolate, w->recv_sync_handler);
-  if (recv_sync_handler.IsEmpty()) {
-    out.append("v8worker: callback not registered with $recvSync");
-    return CopyString(out);
+// TrimAllocator releases the memory that the worker's allocator has cached
+// for reuse, which is safe from any thread. It's called once the worker is
+// idle or under memory pressure, rather than on every reset, so that busy
+// workers keep reusing their cached buffers across requests.
+void TrimAllocator(worker* w) {
+  if (w->allocator != NULL) {
+    w->allocator->Trim();
   }
+}
 
-  Local<Value> args[1];
-  args[0] = String::NewFromUtf8(w->isolate, msg);
-  Local<Value> response_value =
-      recv_sync_handler->Call(context->Global(), 1, args);
+// Tells V8 that the worker is idle for up to the given number of seconds, so
+// that it can do GC work meanwhile. It returns non-zero if there's no more GC
+// work left to do.
+int worker_idle_notification(worker* w, double seconds) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  double deadline = default_platform->MonotonicallyIncreasingTime() + seconds;
+  int done = w->isolate->IdleNotificationDeadline(deadline);
+  TrimAllocator(w);
+  return done;
+}
 
-  if (response_value->IsString()) {
-    String::Utf8Value response(response_value->ToString());
-    out.append(*response);
-  } else {
-    out.append("v8worker: non-string return value");
+// Makes V8 release as much memory as it can, with full GCs, along with the
+// memory cached by the worker's allocator.
+void worker_low_memory_notification(worker* w) {
+  Locker locker(w->isolate);
+  Isolate::Scope isolate_scope(w->isolate);
+  w->isolate->LowMemoryNotification();
+  TrimAllocator(w);
+}
+
+// Tells V8 about the memory pressure on the process, with 0 for none, 1 for
+// moderate and 2 for critical. It can be called from any thread, and doesn't
+// wait for the worker's isolate to be unlocked. Under any pressure, the memory
+// cached by the worker's allocator is released straight away.
+void worker_memory_pressure(worker* w, int level) {
+  w->isolate->MemoryPressureNotification(MemoryPressureLevel(level));
+  if (level != 0) {
+    TrimAllocator(w);
   }
-  return CopyString(out);
 }
 
 void worker_terminate_execution(worker* w) {
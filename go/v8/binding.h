@@ -1,3 +1,9 @@
+#ifndef V8WORKER_BINDING_H
+#define V8WORKER_BINDING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -5,24 +11,269 @@ extern "C" {
 struct worker_s;
 typedef struct worker_s worker;
 
-void v8_init();
+struct snapshot_s;
+typedef struct snapshot_s snapshot;
+
+struct channel_s;
+typedef struct channel_s channel;
+
+struct outbox_s;
+typedef struct outbox_s outbox;
+
+struct compile_service_s;
+typedef struct compile_service_s compile_service;
+
+struct mapped_file_s;
+typedef struct mapped_file_s mapped_file;
+
+typedef struct {
+  const char* data;
+  size_t length;
+  mapped_file* file;
+} module_source;
+
+typedef struct {
+  const char* data;
+  size_t length;
+} outbox_message;
+
+typedef struct {
+  const char* message;
+  const char* file;
+  int line;
+  int column;
+  int64_t id;
+} worker_error;
+
+typedef struct {
+  size_t max_old_space_mb;
+  size_t max_semi_space_kb;
+  size_t code_range_mb;
+  size_t stack_kb;
+  int64_t timeout_ns;
+  int64_t cpu_budget_ns;
+} worker_limits;
+
+typedef struct {
+  int64_t minor_count;
+  int64_t minor_pause_ns;
+  int64_t major_count;
+  int64_t major_pause_ns;
+  int64_t max_pause_ns;
+} gc_stats;
+
+typedef struct {
+  int64_t outstanding_bytes;
+  int64_t peak_outstanding_bytes;
+  int64_t allocations;
+  int64_t pooled_allocations;
+  int64_t cached_bytes;
+} array_buffer_stats;
+
+typedef struct {
+  size_t total_heap_size;
+  size_t total_heap_size_executable;
+  size_t total_physical_size;
+  size_t total_available_size;
+  size_t used_heap_size;
+  size_t heap_size_limit;
+  size_t malloced_memory;
+  size_t peak_malloced_memory;
+  size_t number_of_native_contexts;
+  size_t number_of_detached_contexts;
+  gc_stats gc;
+  array_buffer_stats array_buffers;
+} heap_stats;
+
+typedef struct {
+  const char* space_name;
+  size_t space_size;
+  size_t space_used_size;
+  size_t space_available_size;
+  size_t physical_space_size;
+} heap_space_stats;
+
+typedef struct {
+  int id;
+  int parent_id;
+  const char* function_name;
+  const char* url;
+  int line;
+  int column;
+  int64_t hit_count;
+} profile_node;
+
+typedef struct {
+  profile_node* nodes;
+  int count;
+  int64_t start_us;
+  int64_t end_us;
+  int interval_us;
+} cpu_profile;
+
+// The reasons for the watchdog to terminate a call, as returned by
+// worker_interrupt_reason.
+enum {
+  INTERRUPT_NONE,
+  INTERRUPT_TIMEOUT,
+  INTERRUPT_CPU_BUDGET,
+};
 
+// The operations and phases within them which are traced when the binding is
+// built with V8WORKER_TRACE.
+enum {
+  TRACE_LOAD_MODULE,
+  TRACE_SEND,
+  TRACE_SEND_SYNC,
+  TRACE_JS_SEND,
+  TRACE_JS_SEND_SYNC,
+  TRACE_OPS,
+};
+
+enum {
+  TRACE_LOCK,
+  TRACE_ENTER,
+  TRACE_EXEC,
+  TRACE_RETURN,
+  TRACE_PHASES,
+};
+
+#define TRACE_BUCKETS 64
+
+typedef struct {
+  int64_t count;
+  int64_t total_ns;
+  int64_t buckets[TRACE_BUCKETS];
+} trace_histogram;
+
+typedef struct {
+  int thread_pool_size;
+  int idle_tasks;
+} platform_options;
+
+typedef struct {
+  int64_t hits;
+  int64_t misses;
+  int64_t rejections;
+} code_cache_stats;
+
+void v8_init(platform_options* options);
+
+void code_cache_enable(const char* dir);
+void code_cache_get_stats(code_cache_stats* stats);
+
+// Test-only: empties the in-memory code cache and zeroes its stats. It isn't
+// part of the API.
+void code_cache_reset();
+
+compile_service* compile_service_new(int threads);
+void compile_service_submit(compile_service* s,
+                            const char* name_s,
+                            const char* source_s);
+int compile_service_wait(compile_service* s, char** error);
+void compile_service_dispose(compile_service* s);
+
+void worker_stop_loop(worker* w);
 void worker_dispose(worker* w);
 
-worker* worker_init(int id, int enable_print);
+worker* worker_init(int id,
+                    int enable_print,
+                    worker_limits* limits,
+                    int allocator);
+worker* worker_init_from_snapshot(int id,
+                                  snapshot* s,
+                                  worker_limits* limits,
+                                  int allocator);
+worker* worker_init_snapshot_creator(int id, int enable_print);
+worker* worker_new_context(worker* owner,
+                           int id,
+                           int enable_print,
+                           worker_limits* limits);
+
+int worker_reset_context(worker* w);
+
+channel* channel_new(size_t capacity);
+void channel_dispose(channel* c);
+int worker_attach_channel(worker* w,
+                          const char* name,
+                          channel* c,
+                          int receive);
+
+mapped_file* mapped_file_open(const char* path,
+                              const char** data,
+                              size_t* size);
+void mapped_file_ref(mapped_file* f);
+void mapped_file_release(mapped_file* f);
+
+outbox* worker_outbox_new(worker* w, size_t capacity);
+int outbox_wait(outbox* o, outbox_message* msgs, int max);
+void outbox_dispose(outbox* o);
+
+snapshot* worker_create_snapshot(worker* w);
+void snapshot_dispose(snapshot* s);
 
 const char* worker_last_exception(worker* w);
+void worker_last_error(worker* w, worker_error* e);
+const char* worker_error_stack(worker* w, int64_t id);
 
-int worker_load_module(worker* w, char* url_s);
+int worker_load_module(worker* w, char* url_s, int resolve);
+int worker_create_bundle(worker* w,
+                         char* url_s,
+                         int resolve,
+                         char** out,
+                         size_t* length);
+int worker_load_bundle(worker* w,
+                       const char* data,
+                       size_t length,
+                       mapped_file* file);
 int worker_load_script(worker* w, char* name_s, char* source_s);
+int worker_load_script_stream(worker* w, char* name_s, int64_t token);
 
-int worker_send(worker* w, const char* msg);
-const char* worker_send_sync(worker* w, const char* msg);
+int worker_send(worker* w, const char* msg, size_t length);
+int worker_send_batch(worker* w,
+                      const char* data,
+                      const size_t* lengths,
+                      int n,
+                      char** errors);
+int worker_send_bytes(worker* w, void* data, size_t length);
+int worker_send_value(worker* w, const void* data, size_t length);
+void worker_send_async(worker* w,
+                       const char* msg,
+                       size_t length,
+                       int64_t token,
+                       int sync);
+size_t worker_send_sync(worker* w,
+                        const char* msg,
+                        size_t length,
+                        char* buf,
+                        size_t cap);
+void worker_read_result(worker* w, char* buf);
+void worker_settle(worker* w, int64_t id, int status, const char* value);
 
+int worker_heap_limit_reached(worker* w);
+int worker_interrupt_reason(worker* w);
+
+int worker_profile_start(worker* w, int interval_us);
+cpu_profile* worker_profile_stop(worker* w);
+void cpu_profile_dispose(cpu_profile* p);
+int worker_heap_stats(worker* w,
+                      heap_stats* stats,
+                      heap_space_stats* spaces,
+                      int n);
+void worker_gc_stats(worker* w, gc_stats* stats);
+void worker_array_buffer_stats(worker* w, array_buffer_stats* stats);
 void worker_terminate_execution(worker* w);
+int worker_trace_stats(worker* w, trace_histogram* out);
+int worker_idle_notification(worker* w, double seconds);
+void worker_low_memory_notification(worker* w);
+void worker_memory_pressure(worker* w, int level);
+int worker_pump_message_loop(worker* w);
+void worker_run_idle_tasks(worker* w, double seconds);
 
 const char* worker_version();
 
 #ifdef __cplusplus
 }  // extern "C"
 #endif
+
+#endif  // V8WORKER_BINDING_H
@@ -0,0 +1,279 @@
+package v8
+
+import (
+	"errors"
+	"sync"
+	"time"
+)
+
+// ErrPoolClosed is returned by Pool.Get once the Pool has been closed.
+var ErrPoolClosed = errors.New("v8: pool has been closed")
+
+// Pool maintains a set of pre-initialised Workers, so that the cost of creating
+// JavaScript VM instances is kept off the request path. Workers are leased with
+// Get and returned with Put, which resets their context for the next caller.
+//
+// The various configuration options must be set before any of the Pool's
+// methods are called.
+type Pool struct {
+	collect  chan struct{}
+	cond     *sync.Cond
+	closed   bool
+	idle     []pooledWorker
+	mutex    sync.Mutex
+	once     sync.Once
+	refill   chan struct{}
+	returned []*Worker
+	stop     chan struct{}
+	workers  int
+
+	// IdleGC is the time given to V8 for GC work when a Worker is returned
+	// with Put, so that the garbage left by its lease, and by its old context,
+	// is collected before the next lease rather than during it. The work is
+	// done by the Pool's maintenance goroutine, one Worker at a time, and a
+	// Worker only becomes available to Get again once it's done. If it is
+	// zero, no time is given.
+	IdleGC time.Duration
+
+	// IdleTimeout is the duration after which idle Workers in excess of Size
+	// are disposed of. If it is zero, excess Workers are kept until the Pool is
+	// closed.
+	IdleTimeout time.Duration
+
+	// MaxSize limits the total number of Workers, both idle and leased, that
+	// the Pool will create. Get blocks once the limit has been reached. If it
+	// is zero, the number of Workers is unlimited, and if it is less than Size,
+	// then Size is used.
+	MaxSize int
+
+	// New returns a new Worker for the Pool. Its config will be used for the
+	// lifetime of the Worker, across all of its leases.
+	New func() *Worker
+
+	// Size is the number of idle Workers that the Pool tries to keep warm.
+	Size int
+}
+
+type pooledWorker struct {
+	since  time.Time
+	worker *Worker
+}
+
+// Close disposes of all idle Workers, and of leased Workers as they are
+// returned. Any callers blocked in Get will receive ErrPoolClosed.
+func (p *Pool) Close() {
+	p.mutex.Lock()
+	p.init()
+	if p.closed {
+		p.mutex.Unlock()
+		return
+	}
+	p.closed = true
+	idle := p.idle
+	p.idle = nil
+	returned := p.returned
+	p.returned = nil
+	p.workers -= len(idle) + len(returned)
+	p.cond.Broadcast()
+	p.mutex.Unlock()
+
+	close(p.stop)
+	for _, pw := range idle {
+		pw.worker.Dispose()
+	}
+	for _, w := range returned {
+		w.Dispose()
+	}
+}
+
+// Get leases a Worker from the Pool. If no idle Worker is available, a new one
+// is created, unless MaxSize has been reached, in which case Get blocks until
+// a Worker is returned with Put.
+func (p *Pool) Get() (*Worker, error) {
+	p.mutex.Lock()
+	p.init()
+	for {
+		if p.closed {
+			p.mutex.Unlock()
+			return nil, ErrPoolClosed
+		}
+		if n := len(p.idle); n > 0 {
+			// Favour the most recently used Worker, as it's the most likely
+			// to still be cache-warm.
+			w := p.idle[n-1].worker
+			p.idle[n-1] = pooledWorker{}
+			p.idle = p.idle[:n-1]
+			p.mutex.Unlock()
+			p.wake()
+			return w, nil
+		}
+		if p.workers < p.maxSize() {
+			p.workers++
+			p.mutex.Unlock()
+			p.wake()
+			return p.newWorker(), nil
+		}
+		p.cond.Wait()
+	}
+}
+
+// Put returns a leased Worker to the Pool. Its context is reset, so that no
+// state leaks between leases, and it's then given IdleGC for GC work in the
+// background. Workers which can't be reset are disposed of.
+func (p *Pool) Put(w *Worker) {
+	err := w.Reset()
+	p.mutex.Lock()
+	p.init()
+	if err != nil || p.closed {
+		p.workers--
+		p.cond.Signal()
+		p.mutex.Unlock()
+		w.Dispose()
+		return
+	}
+	if p.IdleGC > 0 {
+		p.returned = append(p.returned, w)
+		p.mutex.Unlock()
+		signal(p.collect)
+		return
+	}
+	p.idle = append(p.idle, pooledWorker{time.Now(), w})
+	p.cond.Signal()
+	p.mutex.Unlock()
+}
+
+// Lazily set up the Pool and start its maintenance goroutine. It needs to be
+// called with the mutex held.
+func (p *Pool) init() {
+	p.once.Do(func() {
+		p.collect = make(chan struct{}, 1)
+		p.cond = sync.NewCond(&p.mutex)
+		p.refill = make(chan struct{}, 1)
+		p.stop = make(chan struct{})
+		go p.maintain()
+	})
+}
+
+// Keep Size Workers warm, give returned Workers their IdleGC, and evict Workers
+// that have been idle for longer than IdleTimeout.
+func (p *Pool) maintain() {
+	var tick <-chan time.Time
+	if p.IdleTimeout > 0 {
+		ticker := time.NewTicker(p.IdleTimeout / 2)
+		defer ticker.Stop()
+		tick = ticker.C
+	}
+	p.fill()
+	for {
+		select {
+		case <-p.collect:
+			p.collectGarbage()
+		case <-p.refill:
+			p.fill()
+		case <-tick:
+			p.evict()
+		case <-p.stop:
+			return
+		}
+	}
+}
+
+// Give each returned Worker IdleGC for GC work, and then make it available to
+// Get.
+func (p *Pool) collectGarbage() {
+	for {
+		p.mutex.Lock()
+		if p.closed || len(p.returned) == 0 {
+			p.mutex.Unlock()
+			return
+		}
+		w := p.returned[0]
+		p.returned[0] = nil
+		p.returned = p.returned[1:]
+		p.mutex.Unlock()
+		w.Idle(time.Now().Add(p.IdleGC))
+		p.mutex.Lock()
+		if p.closed {
+			p.workers--
+			p.mutex.Unlock()
+			w.Dispose()
+			return
+		}
+		p.idle = append(p.idle, pooledWorker{time.Now(), w})
+		p.cond.Signal()
+		p.mutex.Unlock()
+	}
+}
+
+func (p *Pool) evict() {
+	var evicted []*Worker
+	deadline := time.Now().Add(-p.IdleTimeout)
+	p.mutex.Lock()
+	// The idle list is ordered by the time of return, so the oldest Workers
+	// are at the front.
+	for len(p.idle) > p.Size && p.idle[0].since.Before(deadline) {
+		evicted = append(evicted, p.idle[0].worker)
+		p.idle[0] = pooledWorker{}
+		p.idle = p.idle[1:]
+		p.workers--
+	}
+	p.mutex.Unlock()
+	for _, w := range evicted {
+		w.Dispose()
+	}
+}
+
+func (p *Pool) fill() {
+	for {
+		p.mutex.Lock()
+		if p.closed || len(p.idle) >= p.Size || p.workers >= p.maxSize() {
+			p.mutex.Unlock()
+			return
+		}
+		p.workers++
+		p.mutex.Unlock()
+		w := p.newWorker()
+		p.mutex.Lock()
+		if p.closed {
+			p.workers--
+			p.mutex.Unlock()
+			w.Dispose()
+			return
+		}
+		p.idle = append(p.idle, pooledWorker{time.Now(), w})
+		p.cond.Signal()
+		p.mutex.Unlock()
+	}
+}
+
+func (p *Pool) maxSize() int {
+	if p.MaxSize == 0 {
+		return int(^uint(0) >> 1)
+	}
+	if p.MaxSize < p.Size {
+		return p.Size
+	}
+	return p.MaxSize
+}
+
+// Create and initialise a new Worker, so that its VM instance is ready for use.
+func (p *Pool) newWorker() *Worker {
+	w := p.New()
+	w.mutex.Lock()
+	w.init()
+	w.mutex.Unlock()
+	return w
+}
+
+// Signal the maintenance goroutine to top up the idle Workers.
+func (p *Pool) wake() {
+	signal(p.refill)
+}
+
+// Signal the maintenance goroutine through ch, unless it's already pending.
+func signal(ch chan struct{}) {
+	select {
+	case ch <- struct{}{}:
+	default:
+	}
+}
@@ -0,0 +1,69 @@
+package v8
+
+import (
+	"testing"
+	"time"
+)
+
+func TestPool(t *testing.T) {
+	pool := &Pool{
+		IdleGC:      time.Millisecond,
+		IdleTimeout: 100 * time.Millisecond,
+		MaxSize:     2,
+		New: func() *Worker {
+			return &Worker{}
+		},
+		Size: 1,
+	}
+	defer pool.Close()
+
+	w1, err := pool.Get()
+	if err != nil {
+		t.Fatal(err)
+	}
+	err = w1.LoadScript("state.js", `
+	var state = "leased";
+	$recvSync(function(msg) { return state; });
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	w2, err := pool.Get()
+	if err != nil {
+		t.Fatal(err)
+	}
+	pool.Put(w1)
+	pool.Put(w2)
+
+	w3, err := pool.Get()
+	if err != nil {
+		t.Fatal(err)
+	}
+	err = w3.LoadScript("check.js", `
+	$recvSync(function(msg) { return typeof state; });
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	response, err := w3.SendSync("")
+	if err != nil {
+		t.Fatal(err)
+	}
+	if got, want := response, "undefined"; got != want {
+		t.Errorf("state leaked across leases: got %q want %q", got, want)
+	}
+	pool.Put(w3)
+
+	time.Sleep(300 * time.Millisecond)
+	pool.mutex.Lock()
+	idle := len(pool.idle)
+	pool.mutex.Unlock()
+	if idle != 1 {
+		t.Errorf("got %d idle workers after eviction, want 1", idle)
+	}
+
+	pool.Close()
+	if _, err := pool.Get(); err != ErrPoolClosed {
+		t.Errorf("got %v want ErrPoolClosed", err)
+	}
+}
@@ -0,0 +1,208 @@
+package v8
+
+import (
+	"compress/gzip"
+	"io"
+	"time"
+)
+
+// profileNode is a node of the call tree recorded by V8's CPU profiler.
+type profileNode struct {
+	function string
+	hits     int64
+	id       uint64
+	line     int64
+	parent   uint64
+	url      string
+}
+
+// The field numbers of the messages in pprof's profile.proto.
+const (
+	profileSampleType    = 1
+	profileSample        = 2
+	profileLocation      = 4
+	profileFunction      = 5
+	profileStringTable   = 6
+	profileTimeNanos     = 9
+	profileDurationNanos = 10
+	profilePeriodType    = 11
+	profilePeriod        = 12
+
+	valueTypeType = 1
+	valueTypeUnit = 2
+
+	sampleLocationID = 1
+	sampleValue      = 2
+
+	locationID   = 1
+	locationLine = 4
+
+	lineFunctionID = 1
+	lineLine       = 2
+
+	functionID         = 1
+	functionName       = 2
+	functionSystemName = 3
+	functionFilename   = 4
+	functionStartLine  = 5
+)
+
+// protoBuffer is a minimal encoder for the subset of the protocol buffer wire
+// format that pprof's profile.proto needs.
+type protoBuffer struct {
+	data []byte
+}
+
+func (b *protoBuffer) varint(x uint64) {
+	for x >= 0x80 {
+		b.data = append(b.data, byte(x)|0x80)
+		x >>= 7
+	}
+	b.data = append(b.data, byte(x))
+}
+
+func (b *protoBuffer) uint64(field int, x uint64) {
+	if x == 0 {
+		return
+	}
+	b.varint(uint64(field) << 3)
+	b.varint(x)
+}
+
+func (b *protoBuffer) int64(field int, x int64) {
+	b.uint64(field, uint64(x))
+}
+
+func (b *protoBuffer) bytes(field int, data []byte) {
+	b.varint(uint64(field)<<3 | 2)
+	b.varint(uint64(len(data)))
+	b.data = append(b.data, data...)
+}
+
+func (b *protoBuffer) message(field int, m *protoBuffer) {
+	b.bytes(field, m.data)
+}
+
+// packed encodes a repeated varint field in its packed form.
+func (b *protoBuffer) packed(field int, xs []uint64) {
+	var p protoBuffer
+	for _, x := range xs {
+		p.varint(x)
+	}
+	b.bytes(field, p.data)
+}
+
+// profileBuilder assembles a pprof profile from V8's call tree. Every node of
+// the tree gets its own location, so that the stacks can be rebuilt by
+// following the parent links, while functions are shared between nodes.
+type profileBuilder struct {
+	functions map[profileFunctionKey]uint64
+	out       protoBuffer
+	strings   map[string]int64
+	table     []string
+}
+
+type profileFunctionKey struct {
+	line int64
+	name string
+	url  string
+}
+
+func (p *profileBuilder) stringID(s string) int64 {
+	if id, ok := p.strings[s]; ok {
+		return id
+	}
+	id := int64(len(p.table))
+	p.strings[s] = id
+	p.table = append(p.table, s)
+	return id
+}
+
+func (p *profileBuilder) valueType(field int, typ string, unit string) {
+	var m protoBuffer
+	m.int64(valueTypeType, p.stringID(typ))
+	m.int64(valueTypeUnit, p.stringID(unit))
+	p.out.message(field, &m)
+}
+
+func (p *profileBuilder) functionID(node *profileNode) uint64 {
+	name := node.function
+	if name == "" {
+		name = "(anonymous)"
+	}
+	key := profileFunctionKey{node.line, name, node.url}
+	if id, ok := p.functions[key]; ok {
+		return id
+	}
+	id := uint64(len(p.functions) + 1)
+	p.functions[key] = id
+	var m protoBuffer
+	m.uint64(functionID, id)
+	m.int64(functionName, p.stringID(name))
+	m.int64(functionSystemName, p.stringID(name))
+	m.int64(functionFilename, p.stringID(node.url))
+	m.int64(functionStartLine, node.line)
+	p.out.message(profileFunction, &m)
+	return id
+}
+
+// writeProfile writes the call tree as a gzipped pprof profile with the same
+// sample types as Go's own CPU profiles, so that the two can be merged. The
+// nodes need to be ordered parents first, with the root first of all.
+func writeProfile(w io.Writer, nodes []profileNode, start time.Time, duration time.Duration, interval time.Duration) error {
+	p := &profileBuilder{
+		functions: map[profileFunctionKey]uint64{},
+		strings:   map[string]int64{},
+	}
+	p.stringID("")
+	p.valueType(profileSampleType, "samples", "count")
+	p.valueType(profileSampleType, "cpu", "nanoseconds")
+
+	parents := make(map[uint64]uint64, len(nodes))
+	for idx := range nodes {
+		node := &nodes[idx]
+		parents[node.id] = node.parent
+		// The root node only serves to connect the call tree.
+		if node.parent == 0 {
+			continue
+		}
+		var line protoBuffer
+		line.uint64(lineFunctionID, p.functionID(node))
+		line.int64(lineLine, node.line)
+		var loc protoBuffer
+		loc.uint64(locationID, node.id)
+		loc.message(locationLine, &line)
+		p.out.message(profileLocation, &loc)
+	}
+
+	for idx := range nodes {
+		node := &nodes[idx]
+		if node.hits == 0 || node.parent == 0 {
+			continue
+		}
+		var stack []uint64
+		for id := node.id; parents[id] != 0; id = parents[id] {
+			stack = append(stack, id)
+		}
+		var sample protoBuffer
+		sample.packed(sampleLocationID, stack)
+		sample.packed(sampleValue, []uint64{
+			uint64(node.hits), uint64(node.hits * int64(interval)),
+		})
+		p.out.message(profileSample, &sample)
+	}
+
+	p.out.int64(profileTimeNanos, start.UnixNano())
+	p.out.int64(profileDurationNanos, int64(duration))
+	p.valueType(profilePeriodType, "cpu", "nanoseconds")
+	p.out.int64(profilePeriod, int64(interval))
+	for _, s := range p.table {
+		p.out.bytes(profileStringTable, []byte(s))
+	}
+
+	zw := gzip.NewWriter(w)
+	if _, err := zw.Write(p.out.data); err != nil {
+		return err
+	}
+	return zw.Close()
+}
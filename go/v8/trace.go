@@ -0,0 +1,180 @@
+package v8
+
+// #include "binding.h"
+import "C"
+
+import (
+	"math"
+	"math/bits"
+	"sync/atomic"
+	"time"
+	"unsafe"
+)
+
+// The number of buckets in a TraceHistogram.
+const traceBuckets = C.TRACE_BUCKETS
+
+// TraceHistogram is a histogram of the durations of one phase of a kind of
+// call. Bucket i counts the durations from 2^i up to 2^(i+1) nanoseconds.
+type TraceHistogram struct {
+	Buckets [traceBuckets]int64
+	Count   int64
+	Total   time.Duration
+}
+
+// Mean returns the mean duration.
+func (h *TraceHistogram) Mean() time.Duration {
+	if h.Count == 0 {
+		return 0
+	}
+	return h.Total / time.Duration(h.Count)
+}
+
+// Percentile returns the upper bound of the bucket which contains the given
+// percentile, e.g. 0.99, which is clamped to (0, 1]. It returns 0 if the
+// histogram is empty.
+func (h *TraceHistogram) Percentile(p float64) time.Duration {
+	if h.Count == 0 {
+		return 0
+	}
+	target := int64(math.Ceil(math.Min(p, 1) * float64(h.Count)))
+	if target < 1 {
+		target = 1
+	}
+	var seen int64
+	for bucket, n := range h.Buckets {
+		seen += n
+		if seen >= target {
+			return time.Duration(1) << uint(bucket+1)
+		}
+	}
+	return 0
+}
+
+// TracePhases breaks down the latency of a kind of call by phase.
+type TracePhases struct {
+	// Call is the whole of the call as seen from Go, including the
+	// wait for the Worker's mutex and the cgo call itself. The overhead of
+	// these is the difference between its mean and the sum of the means of
+	// the other phases.
+	Call TraceHistogram
+	// Enter covers entering the VM and the Worker's context, and converting
+	// the message into a JavaScript string.
+	Enter TraceHistogram
+	// Exec is the execution of JavaScript, i.e. of the $recv or $recvSync
+	// callback, or of the module graph, including the time spent in Go
+	// callbacks made by it.
+	Exec TraceHistogram
+	// Lock is the wait for the VM's lock, which is held by other threads
+	// while they make calls into it, e.g. into Workers sharing it.
+	Lock TraceHistogram
+	// Return covers encoding the response of $recvSync for Go.
+	Return TraceHistogram
+}
+
+// TraceStats holds the latency histograms of a Worker's calls. The native
+// phases also include the calls made by SendAsync and SendSyncAsync on the
+// Worker's event loop thread, which Call doesn't.
+//
+// JSSend and JSSendSync cover the calls made by JavaScript with $send and
+// $sendSync, which have no Call phase. Their Enter phase is the encoding of
+// the message, Exec the handler in Go, and Return the conversion of the
+// response of $sendSync. Lock is the wait to lock the VM again after a
+// $sendSync that released it, i.e. when Outbox is set.
+type TraceStats struct {
+	LoadModule TracePhases
+	Send       TracePhases
+	SendSync   TracePhases
+	JSSend     TracePhases
+	JSSendSync TracePhases
+}
+
+// traceHistogram is the Go counterpart of a native histogram, for the phase
+// which is recorded in Go. It's updated atomically, as calls can be made from
+// many goroutines.
+type traceHistogram struct {
+	buckets [traceBuckets]int64
+	count   int64
+	total   int64
+}
+
+func (h *traceHistogram) record(d time.Duration) {
+	bucket := bits.Len64(uint64(d)) - 1
+	if bucket < 0 {
+		bucket = 0
+	}
+	atomic.AddInt64(&h.buckets[bucket], 1)
+	atomic.AddInt64(&h.count, 1)
+	atomic.AddInt64(&h.total, int64(d))
+}
+
+func (h *traceHistogram) load(out *TraceHistogram) {
+	for idx := range h.buckets {
+		out.Buckets[idx] = atomic.LoadInt64(&h.buckets[idx])
+	}
+	out.Count = atomic.LoadInt64(&h.count)
+	out.Total = time.Duration(atomic.LoadInt64(&h.total))
+}
+
+// traceStart returns the start time of a call, or the zero time unless the
+// package is built with the v8worker_trace tag.
+func traceStart() time.Time {
+	if traceEnabled {
+		return time.Now()
+	}
+	return time.Time{}
+}
+
+// traceCall records the duration of a call into the given instance which
+// started at the given time. The instance needs to be captured while the
+// Worker's mutex is held, as the Worker may be disposed once it's released.
+// It's only called when the package is built with the v8worker_trace tag.
+func traceCall(i *instance, op int, start time.Time) {
+	if i.trace != nil {
+		i.trace[op].record(time.Since(start))
+	}
+}
+
+// TraceStats returns the latency histograms of the Worker's calls, broken down
+// by phase. They're only recorded if the package was built with the
+// v8worker_trace build tag, and ok is false otherwise. Like GCStats, it
+// doesn't wait for any JavaScript that is currently executing.
+func (w *Worker) TraceStats() (stats TraceStats, ok bool) {
+	if !traceEnabled {
+		return stats, false
+	}
+	i := w.current()
+	i.mutex.RLock()
+	defer i.mutex.RUnlock()
+	if i.worker == nil {
+		return stats, false
+	}
+
+	var native [C.TRACE_OPS * C.TRACE_PHASES]C.trace_histogram
+	if C.worker_trace_stats(i.worker, &native[0]) == 0 {
+		return stats, false
+	}
+	ops := []*TracePhases{
+		C.TRACE_LOAD_MODULE:  &stats.LoadModule,
+		C.TRACE_SEND:         &stats.Send,
+		C.TRACE_SEND_SYNC:    &stats.SendSync,
+		C.TRACE_JS_SEND:      &stats.JSSend,
+		C.TRACE_JS_SEND_SYNC: &stats.JSSendSync,
+	}
+	for op, phases := range ops {
+		i.trace[op].load(&phases.Call)
+		for phase, out := range [C.TRACE_PHASES]*TraceHistogram{
+			C.TRACE_LOCK:   &phases.Lock,
+			C.TRACE_ENTER:  &phases.Enter,
+			C.TRACE_EXEC:   &phases.Exec,
+			C.TRACE_RETURN: &phases.Return,
+		} {
+			h := &native[op*C.TRACE_PHASES+phase]
+			buckets := (*[traceBuckets]int64)(unsafe.Pointer(&h.buckets[0]))
+			out.Buckets = *buckets
+			out.Count = int64(h.count)
+			out.Total = time.Duration(h.total_ns)
+		}
+	}
+	return stats, true
+}
@@ -0,0 +1,8 @@
+//go:build !v8worker_trace
+// +build !v8worker_trace
+
+package v8
+
+// traceEnabled reports whether the package was built with the v8worker_trace
+// build tag, which records the latencies of the phases of calls.
+const traceEnabled = false
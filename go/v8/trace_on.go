@@ -0,0 +1,11 @@
+//go:build v8worker_trace
+// +build v8worker_trace
+
+package v8
+
+// #cgo CXXFLAGS: -DV8WORKER_TRACE
+import "C"
+
+// traceEnabled reports whether the package was built with the v8worker_trace
+// build tag, which records the latencies of the phases of calls.
+const traceEnabled = true
@@ -0,0 +1,36 @@
+package v8
+
+import (
+	"testing"
+	"time"
+)
+
+func TestTraceHistogramPercentile(t *testing.T) {
+	var h TraceHistogram
+	if got := h.Percentile(0.5); got != 0 {
+		t.Errorf("got %s for an empty histogram, want 0", got)
+	}
+	// 90 durations in [2, 4)ns, 9 in [16, 32)ns and 1 in [1024, 2048)ns.
+	h.Buckets[1] = 90
+	h.Buckets[4] = 9
+	h.Buckets[10] = 1
+	h.Count = 100
+	for _, tc := range []struct {
+		p    float64
+		want time.Duration
+	}{
+		{-1, 4},
+		{0, 4},
+		{0.5, 4},
+		{0.9, 4},
+		{0.91, 32},
+		{0.99, 32},
+		{0.995, 2048},
+		{1, 2048},
+		{2, 2048},
+	} {
+		if got := h.Percentile(tc.p); got != tc.want {
+			t.Errorf("Percentile(%v): got %s want %s", tc.p, got, tc.want)
+		}
+	}
+}
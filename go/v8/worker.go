@@ -15,24 +15,335 @@ import "C"
 
 import (
 	"errors"
+	"expvar"
+	"fmt"
+	"io"
+	"os"
 	"runtime"
 	"sync"
+	"sync/atomic"
+	"time"
 	"unsafe"
 )
 
+// ErrHeapLimit is returned when a Worker's execution was terminated because
+// its heap was about to exceed its limit. The Worker should be disposed of or
+// reset, as its heap is likely to be close to the limit still.
+var ErrHeapLimit = errors.New("v8: heap limit reached")
+
+// ErrTimeout is returned when a call was terminated because it ran for longer
+// than the Worker's Limits.Timeout. The Worker can be used again afterwards.
+var ErrTimeout = errors.New("v8: execution timed out")
+
+// ErrCPUBudget is returned when a call was terminated because the Worker has
+// used up its Limits.CPUBudget. Further calls fail in the same way until the
+// Worker is Reset.
+var ErrCPUBudget = errors.New("v8: CPU budget exhausted")
+
+// The registry of active instances is a two-level slab indexed by instance id,
+// with the pointers to chunks and instances being published atomically. This
+// keeps lookups from callbacks lock-free, so that dispatch scales with cores.
+// The mutex only serialises registration and removal, which are rare in
+// comparison. Freed slots are reused, so that the slab stays compact, but ids
+// carry a generation above their slot which is bumped on each reuse, so that a
+// late callback for a disposed instance can't reach the one in its place.
+const (
+	registryChunkBits = 10
+	registryChunkSize = 1 << registryChunkBits
+	registryChunks    = 1 << 12
+	registrySlotBits  = registryChunkBits + 12
+	registrySlotMask  = 1<<registrySlotBits - 1
+	registryGenBits   = 31 - registrySlotBits
+)
+
+type registryChunk [registryChunkSize]unsafe.Pointer
+
+var asyncResults sync.Map
+var sourceReaders sync.Map
+var freeIDs []int32
 var mutex sync.Mutex
 var nextID int32
+var nextToken int64
+var mappedFiles []*MappedFile
+var mappedMutex sync.RWMutex // guards mappedFiles
 var once sync.Once
-var registry = make(map[int32]*instance)
+var registry [registryChunks]unsafe.Pointer
+
+// BatchError is returned by SendBatch when some of the messages in a batch
+// couldn't be delivered.
+type BatchError struct {
+	// Errors has an entry for every message in the batch, which is nil for
+	// those that were delivered successfully.
+	Errors []error
+}
+
+func (e *BatchError) Error() string {
+	failed := 0
+	var first error
+	for _, err := range e.Errors {
+		if err != nil {
+			if first == nil {
+				first = err
+			}
+			failed++
+		}
+	}
+	return fmt.Sprintf("v8: %d of %d messages failed: %s", failed, len(e.Errors), first)
+}
 
-// Internal struct which is stored in the registry map using the weakref
-// pattern.
+// Error is an error raised within a Worker, which is usually an uncaught
+// JavaScript exception. Only its message and location are extracted when it's
+// raised, while the full details, including the stack trace, are rendered on
+// demand by Stack.
+type Error struct {
+	// Column is the one-based column at which the exception was thrown, or
+	// zero if it's unknown.
+	Column int
+	// File is the filename or module url of the script which threw the
+	// exception, if it's known.
+	File string
+	// Line is the one-based line at which the exception was thrown, or zero
+	// if it's unknown.
+	Line int
+	// Message is the exception converted to a string, e.g. "TypeError: x is
+	// not a function", or the description of an error raised by the binding
+	// itself.
+	Message string
+
+	id       int64
+	instance *instance
+	once     sync.Once
+	stack    string
+}
+
+func (e *Error) Error() string {
+	if e.File == "" {
+		return e.Message
+	}
+	return fmt.Sprintf("%s:%d:%d: %s", e.File, e.Line, e.Column, e.Message)
+}
+
+// Stack returns the full details of the error: its location, the line of
+// source code, and the stack trace. These can only be rendered until the
+// Worker raises another error, or is reset or disposed of, after which Stack
+// falls back to the value of Error.
+func (e *Error) Stack() string {
+	e.once.Do(func() {
+		e.stack = e.Error()
+		i := e.instance
+		if i == nil {
+			return
+		}
+		i.mutex.RLock()
+		defer i.mutex.RUnlock()
+		if i.worker == nil {
+			return
+		}
+		stack := C.worker_error_stack(i.worker, C.int64_t(e.id))
+		if stack != nil {
+			e.stack = C.GoString(stack)
+			C.free(unsafe.Pointer(stack))
+		}
+	})
+	return e.stack
+}
+
+// GCStats represents the garbage collection activity of a Worker. Only the
+// GCs which pause JavaScript execution are included, i.e. scavenges of the
+// young generation (minor GCs) and full mark-sweeps (major GCs).
+type GCStats struct {
+	MajorCount int64
+	MajorPause time.Duration
+	MaxPause   time.Duration
+	MinorCount int64
+	MinorPause time.Duration
+}
+
+// HeapSpaceStats represents the memory usage of one of V8's heap spaces.
+type HeapSpaceStats struct {
+	Available uint64
+	Name      string
+	Physical  uint64
+	Size      uint64
+	Used      uint64
+}
+
+// Internal struct which is stored in the registry using the weakref pattern.
 type instance struct {
-	getModuleSource func(string) (string, error)
-	handleSend      func(string) error
-	handleSendSync  func(string) (string, error)
-	id              int32
-	worker          *C.worker
+	getModuleBytes   func(string) ([]byte, error)
+	getModuleSource  func(string) (string, error)
+	handleSend       func(string) error
+	handleSendAsync  func(string) (string, error)
+	handleSendBytes  func([]byte) error
+	handleSendSync   func(string) (string, error)
+	handleSendValue  func([]byte) error
+	disposing        bool // set under mutex once disposal has begun
+	id               int32
+	resolveModuleURL func(string, string) (string, error)
+	mutex            sync.RWMutex // guards worker against disposal
+	result           []byte       // reused for SendSync responses
+	snapshot         *Snapshot
+	trace            *[C.TRACE_OPS]traceHistogram // only with v8worker_trace
+	worker           *C.worker
+}
+
+// ArrayBufferAllocator selects how the memory backing a Worker's ArrayBuffers
+// and typed arrays is allocated.
+type ArrayBufferAllocator int
+
+const (
+	// MallocAllocator allocates each buffer with malloc, like V8's default
+	// allocator.
+	MallocAllocator ArrayBufferAllocator = iota
+	// PoolAllocator recycles the memory of buffers of up to 64KiB through
+	// per-size-class free lists, which avoids most of the malloc traffic for
+	// workloads that create many short-lived typed arrays. The cached memory
+	// is kept across Resets, and released by Idle, LowMemory and any
+	// MemoryPressure above MemoryPressureNone.
+	PoolAllocator
+)
+
+// ArrayBufferStats reports on the memory backing a Worker's ArrayBuffers.
+type ArrayBufferStats struct {
+	// Allocations is the total number of buffers allocated.
+	Allocations int64
+	// CachedBytes is the memory held by the allocator for reuse.
+	CachedBytes int64
+	// OutstandingBytes is the memory currently backing live buffers.
+	OutstandingBytes int64
+	// PeakOutstandingBytes is the high-water mark of OutstandingBytes.
+	PeakOutstandingBytes int64
+	// PooledAllocations is the number of allocations which reused cached
+	// memory.
+	PooledAllocations int64
+}
+
+// Channel is a bounded queue of values from any number of Workers to a single
+// receiving Worker, which bypasses Go entirely. JavaScript in the Workers it is
+// attached to can access it with $channel(name), whose post method serializes
+// a value with the structured clone algorithm, and whose onmessage handler is
+// called with the deserialized value on the receiver's event loop thread.
+type Channel struct {
+	channel *C.channel
+}
+
+// CodeCacheStats reports on the effectiveness of the code cache.
+type CodeCacheStats struct {
+	// Hits is the number of compiles which used a cached entry.
+	Hits int64
+	// Misses is the number of compiles for which there was no cached entry.
+	Misses int64
+	// Rejections is the number of cached entries which were rejected by V8,
+	// e.g. because they were produced by a different V8 version or with
+	// different flags.
+	Rejections int64
+}
+
+// Compiler compiles scripts on a pool of background threads, ahead of them
+// being loaded by Workers, and adds the compiled code to the code cache. Each
+// unique script is compiled once, and eagerly, so that every Worker which then
+// loads it with LoadScript skips compilation altogether. Scripts can be
+// submitted from many goroutines, e.g. by each Worker being set up for a
+// deploy, while Wait and Close need to be called by a single owner.
+type Compiler struct {
+	service *C.compile_service
+}
+
+// Limits configures the resources available to a Worker's JavaScript VM. Zero
+// values use V8's defaults.
+type Limits struct {
+	// CodeRangeMB is the size of the code range for JIT-compiled code in
+	// megabytes.
+	CodeRangeMB int
+	// CPUBudget is the total CPU time that JavaScript can use across all
+	// calls, until the Worker is Reset. Calls that exceed it are terminated
+	// with ErrCPUBudget. Where per-thread CPU clocks aren't available, it's
+	// measured in wall time instead.
+	CPUBudget time.Duration
+	// MaxOldSpaceMB is the maximum size of the old generation of the heap in
+	// megabytes. When it's about to be exceeded, the Worker's execution is
+	// terminated with ErrHeapLimit, rather than the process being aborted.
+	MaxOldSpaceMB int
+	// MaxSemiSpaceKB is the maximum size of each of the semi-spaces which
+	// make up the young generation of the heap in kilobytes.
+	MaxSemiSpaceKB int
+	// StackKB is the stack size available to JavaScript in kilobytes. It is
+	// applied relative to the stack position at the time of each call.
+	StackKB int
+	// Timeout is the maximum duration of each call into JavaScript. Calls that
+	// exceed it are terminated with ErrTimeout.
+	Timeout time.Duration
+}
+
+// MappedFile is a read-only memory mapping of a file, e.g. a bundle of module
+// sources. Module sources returned by GetModuleBytes from within it are used
+// in place by every Worker, rather than being copied into their heaps.
+type MappedFile struct {
+	data []byte
+	file *C.mapped_file
+}
+
+// MemoryPressureLevel is the level of memory pressure on the process, as
+// passed to Worker.MemoryPressure.
+type MemoryPressureLevel int
+
+const (
+	// MemoryPressureNone lets V8 return to its normal GC heuristics.
+	MemoryPressureNone MemoryPressureLevel = iota
+	// MemoryPressureModerate makes V8 favour reducing memory over speed, e.g.
+	// by starting incremental marking sooner.
+	MemoryPressureModerate
+	// MemoryPressureCritical makes V8 release as much memory as it can, with
+	// full GCs, as soon as possible.
+	MemoryPressureCritical
+)
+
+// PlatformOptions configures the threads that V8 uses in the background, e.g.
+// for concurrent marking and compilation, which are shared by all Workers.
+type PlatformOptions struct {
+	// IdleTasks enables V8's idle tasks, e.g. incremental marking, which are
+	// only run by RunIdleTasks.
+	IdleTasks bool
+	// ThreadPoolSize is the number of background threads. If it isn't
+	// positive, V8 uses one less than the number of CPUs, up to a maximum of
+	// eight. On dense hosts, it can be lowered so as not to oversubscribe the
+	// CPUs.
+	ThreadPoolSize int
+}
+
+// Result is the outcome of an asynchronous call made with SendAsync or
+// SendSyncAsync.
+type Result struct {
+	// Err is set if the call failed.
+	Err error
+	// Response is the return value of the $recvSync callback for calls made
+	// with SendSyncAsync.
+	Response string
+}
+
+// Stats represents the memory usage and GC activity of a Worker.
+type Stats struct {
+	ArrayBuffers            ArrayBufferStats
+	DetachedContexts        uint64
+	GC                      GCStats
+	HeapSizeLimit           uint64
+	HeapSpaces              []HeapSpaceStats
+	MallocedMemory          uint64
+	NativeContexts          uint64
+	PeakMallocedMemory      uint64
+	TotalAvailableSize      uint64
+	TotalHeapSize           uint64
+	TotalHeapSizeExecutable uint64
+	TotalPhysicalSize       uint64
+	UsedHeapSize            uint64
+}
+
+// Snapshot represents a startup snapshot of a JavaScript VM instance, i.e. a
+// serialized heap in which a set of warm-up scripts and modules has already
+// been run. Workers created from a Snapshot deserialize that ready-to-go
+// context instead of building a fresh one.
+type Snapshot struct {
+	snapshot *C.snapshot
 }
 
 // Worker represents a single JavaScript VM instance.
@@ -42,87 +353,725 @@ type instance struct {
 // no longer pay any attention to changes in its config.
 type Worker struct {
 	instance *instance
+	live     unsafe.Pointer // the *instance, for SendAsync, which skips mutex
 	mutex    sync.Mutex
 
+	// ArrayBufferAllocator selects the allocator for the memory backing
+	// ArrayBuffers. It is ignored for Workers used to create a Snapshot.
+	ArrayBufferAllocator ArrayBufferAllocator
+
 	// EnablePrint creates the debug $print function in the JavaScript global
 	// scope.
 	EnablePrint bool
 
+	// GetModuleBytes is an alternative to GetModuleSource, which takes
+	// precedence over it, and returns the source code as a byte slice. If the
+	// slice is part of a MappedFile, and the source is ASCII, it's used in
+	// place by V8 rather than being copied into the heap, so that the memory
+	// is shared by all Workers in the process. Other slices are copied.
+	GetModuleBytes func(url string) (source []byte, err error)
+
 	// GetModuleSource returns the source code when given the fully qualified
 	// url of a module, or returns an error if it couldn't retrieve the source
-	// code for some reason.
+	// code for some reason. It may be called concurrently when sibling modules
+	// are being fetched.
 	GetModuleSource func(url string) (source string, err error)
 
 	// HandleSend handles messages received from js.send calls. If it is nil,
 	// then an exception will be raised to the caller.
 	HandleSend func(msg string) error
 
+	// HandleSendAsync handles messages received from $sendAsync calls. It is
+	// called on a new goroutine, and the Promise which $sendAsync returned is
+	// resolved with its response, or rejected with its error. If it is nil,
+	// the Promise is rejected.
+	HandleSendAsync func(msg string) (response string, err error)
+
+	// HandleSendBytes handles binary data received from $sendBuffer calls. The
+	// data is backed directly by the ArrayBuffer's memory, so it is only valid
+	// for the duration of the call, and must be copied if it needs to be
+	// retained. If it is nil, the data is discarded.
+	HandleSendBytes func(data []byte) error
+
 	// HandleSendSync handles messages received from js.sendSync calls. Its
 	// return value will be passed back to the caller in JavaScript. If
 	// HandleSendSync is nil, then an exception will be raised to the caller.
+	//
+	// Note that a $recvSync callback may itself return a Promise, e.g. one
+	// from a $sendAsync call, in which case SendSync waits for it to settle.
 	HandleSendSync func(msg string) (response string, err error)
 
+	// HandleSendValue handles values received from $sendValue calls, in V8's
+	// structured clone serialization format. The data is only valid for the
+	// duration of the call, and must be copied if it needs to be retained. It
+	// can be passed straight to another Worker's SendValue, so that values
+	// are transferred between Workers without going through JSON. If it is
+	// nil, the data is discarded.
+	HandleSendValue func(data []byte) error
+
+	// Limits configures the resources available to the JavaScript VM.
+	Limits Limits
+
+	// Outbox, if positive, makes $send fire-and-forget: messages are queued
+	// in an outbox of up to that many messages, which a separate goroutine
+	// passes to HandleSend in batches, so that JavaScript doesn't wait for Go
+	// and one cgo call covers many messages. $send only blocks, with the VM
+	// released, while the outbox is full. The VM is also released while
+	// HandleSendSync runs, so that other Workers sharing it (see Parent) can
+	// run meanwhile. Messages queued before Dispose are still delivered.
+	Outbox int
+
+	// Parent, if set, makes the Worker a lightweight context within the
+	// Parent's JavaScript VM instance, with its own globals, modules and
+	// handlers, rather than a VM instance of its own. This allows for many
+	// more Workers per process, e.g. one per low-traffic tenant. The heap is
+	// shared with the Parent, so ArrayBufferAllocator, Snapshot and the heap
+	// sizes in Limits are ignored in favour of the Parent's, and if the Parent
+	// was created from a Snapshot, the context is deserialized from it too.
+	// Without a StackKB of its own, the Worker inherits the Parent's.
+	// Calls into Workers sharing a VM instance are serialized, and Terminate
+	// stops whichever of them is currently executing.
+	Parent *Worker
+
+	// Snapshot, if set, is used to initialise the JavaScript VM instance. In
+	// that case, EnablePrint is ignored in favour of the setting that the
+	// snapshot was created with.
+	Snapshot *Snapshot
+
 	// ResolveModuleURL resolves the url of a module relative to the module it
 	// was imported from and returns the fully qualified url of the module, or
-	// an error if no such module could be found.
+	// an error if no such module could be found. If it is nil, the urls in
+	// import statements are used as is.
 	ResolveModuleURL func(url string, importer string) (string, error)
 }
 
+// NewChannel creates a Channel which can hold up to capacity pending values,
+// rounded up to a power of two. Once it is full, posting to it returns false.
+func NewChannel(capacity int) *Channel {
+	c := &Channel{channel: C.channel_new(C.size_t(capacity))}
+	runtime.SetFinalizer(c, func(c *Channel) {
+		C.channel_dispose(c.channel)
+	})
+	return c
+}
+
+// MapFile maps the file at the given path into memory.
+func MapFile(path string) (*MappedFile, error) {
+	pathStr := C.CString(path)
+	defer C.free(unsafe.Pointer(pathStr))
+
+	var data *C.char
+	var size C.size_t
+	f, err := C.mapped_file_open(pathStr, &data, &size)
+	if f == nil {
+		return nil, &os.PathError{Op: "mmap", Path: path, Err: err}
+	}
+	if size > 1<<30 {
+		C.mapped_file_release(f)
+		return nil, &os.PathError{Op: "mmap", Path: path, Err: errors.New("file too large")}
+	}
+	m := &MappedFile{file: f}
+	if size > 0 {
+		n := int(size)
+		m.data = (*[1 << 30]byte)(unsafe.Pointer(data))[:n:n]
+	}
+	mappedMutex.Lock()
+	mappedFiles = append(mappedFiles, m)
+	mappedMutex.Unlock()
+	return m, nil
+}
+
+// Bytes returns the contents of the file. They must not be modified, and must
+// not be used after Close.
+func (m *MappedFile) Bytes() []byte {
+	return m.data
+}
+
+// Close releases the mapping. Workers which are still using sources from it
+// keep it mapped until they no longer need them.
+func (m *MappedFile) Close() error {
+	mappedMutex.Lock()
+	defer mappedMutex.Unlock()
+	for idx, f := range mappedFiles {
+		if f == m {
+			mappedFiles = append(mappedFiles[:idx], mappedFiles[idx+1:]...)
+			C.mapped_file_release(m.file)
+			return nil
+		}
+	}
+	return errors.New("v8: MappedFile has already been closed")
+}
+
+// mappedFile returns the mapping which data is part of, or nil if it isn't.
+// The mapping is referenced while mappedMutex is still held, so that a
+// concurrent Close can't unmap it, and the caller needs to release it.
+func mappedFile(data []byte) *C.mapped_file {
+	if len(data) == 0 {
+		return nil
+	}
+	start := uintptr(unsafe.Pointer(&data[0]))
+	end := start + uintptr(len(data))
+	mappedMutex.RLock()
+	defer mappedMutex.RUnlock()
+	for _, m := range mappedFiles {
+		if len(m.data) == 0 {
+			continue
+		}
+		base := uintptr(unsafe.Pointer(&m.data[0]))
+		if start >= base && end <= base+uintptr(len(m.data)) {
+			C.mapped_file_ref(m.file)
+			return m.file
+		}
+	}
+	return nil
+}
+
+// newModuleSource returns the module source for the given slice, which refers
+// to the slice directly if it's within a MappedFile, and to a copy otherwise.
+// The copy is also null terminated, like the ones made by C.CString. Either
+// way, C frees the source, or releases the reference to its MappedFile, once
+// it has created the string.
+func newModuleSource(source []byte) C.module_source {
+	if f := mappedFile(source); f != nil {
+		return C.module_source{
+			data:   (*C.char)(unsafe.Pointer(&source[0])),
+			length: C.size_t(len(source)),
+			file:   f,
+		}
+	}
+	data := (*C.char)(C.malloc(C.size_t(len(source) + 1)))
+	buf := (*[1 << 30]byte)(unsafe.Pointer(data))[: len(source)+1 : len(source)+1]
+	buf[copy(buf, source)] = 0
+	return C.module_source{data: data, length: C.size_t(len(source))}
+}
+
+// EnableCodeCache enables the process-wide cache of compiled code for scripts
+// loaded by LoadScript. Cache entries are keyed by the script's filename and
+// a hash of its source, so that Workers loading the same script don't need to
+// parse and compile it again. If dir is not empty, entries are also persisted
+// within that directory, so that they can be reused across processes.
+func EnableCodeCache(dir string) {
+	dirStr := C.CString(dir)
+	defer C.free(unsafe.Pointer(dirStr))
+	C.code_cache_enable(dirStr)
+}
+
+// resetCodeCache drops the entries of the code cache held in memory, and zeroes
+// its stats, so that tests start from an empty cache.
+func resetCodeCache() {
+	C.code_cache_reset()
+}
+
+// GetCodeCacheStats returns the current stats for the code cache.
+func GetCodeCacheStats() CodeCacheStats {
+	var stats C.code_cache_stats
+	C.code_cache_get_stats(&stats)
+	return CodeCacheStats{
+		Hits:       int64(stats.hits),
+		Misses:     int64(stats.misses),
+		Rejections: int64(stats.rejections),
+	}
+}
+
+// NewCompiler creates a Compiler with the given number of threads, or one per
+// CPU if it isn't positive. If the code cache hasn't been enabled yet, it's
+// enabled in memory only.
+func NewCompiler(threads int) *Compiler {
+	if threads <= 0 {
+		threads = runtime.NumCPU()
+	}
+	initV8()
+	return &Compiler{service: C.compile_service_new(C.int(threads))}
+}
+
+// Compile queues a script for compilation, unless it has been queued before.
+func (c *Compiler) Compile(filename string, source string) {
+	filenameStr := C.CString(filename)
+	sourceStr := C.CString(source)
+	defer C.free(unsafe.Pointer(filenameStr))
+	defer C.free(unsafe.Pointer(sourceStr))
+	C.compile_service_submit(c.service, filenameStr, sourceStr)
+}
+
+// Wait waits for all of the queued scripts to be compiled. It returns the error
+// of the first that failed to compile since the last call, if any did. Workers
+// can still load scripts that failed, so as to get the error in context.
+func (c *Compiler) Wait() error {
+	var errStr *C.char
+	if n := C.compile_service_wait(c.service, &errStr); n > 0 {
+		defer C.free(unsafe.Pointer(errStr))
+		return fmt.Errorf("v8: %d scripts failed to compile: %s", n, C.GoString(errStr))
+	}
+	return nil
+}
+
+// Close stops the Compiler's threads. Any scripts which haven't been compiled
+// yet are dropped.
+func (c *Compiler) Close() {
+	if c.service != nil {
+		C.compile_service_dispose(c.service)
+		c.service = nil
+	}
+}
+
+// NewSnapshot creates a Snapshot by calling warmup with the given Worker, which
+// can then load the scripts and modules that should be part of the snapshot.
+// Any callbacks registered with $recv and $recvSync are preserved.
+//
+// The Worker must not have been used before, and is consumed in the process,
+// i.e. it must not be used after NewSnapshot returns.
+func NewSnapshot(w *Worker, warmup func(w *Worker) error) (*Snapshot, error) {
+	// The isolate of a snapshot creator stays entered by the thread that
+	// created it, so all calls need to be made from that thread.
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+
+	w.mutex.Lock()
+	if w.instance != nil {
+		w.mutex.Unlock()
+		return nil, errors.New("v8: NewSnapshot needs to be given an unused Worker")
+	}
+	i := w.register()
+	initV8()
+	i.worker = C.worker_init_snapshot_creator(C.int(i.id), C.int(w.enablePrint()))
+	w.instance = i
+	w.mutex.Unlock()
+
+	err := warmup(w)
+
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+	if err != nil {
+		w.dispose()
+		return nil, err
+	}
+	i.mutex.Lock()
+	s := &Snapshot{C.worker_create_snapshot(i.worker)}
+	i.worker = nil
+	i.mutex.Unlock()
+	w.unregister()
+	runtime.SetFinalizer(s, func(s *Snapshot) {
+		C.snapshot_dispose(s.snapshot)
+	})
+	return s, nil
+}
+
+// ConfigurePlatform initialises V8 with the given options. It needs to be
+// called before any Workers are created, and returns an error otherwise.
+func ConfigurePlatform(opts PlatformOptions) error {
+	if !initPlatform(opts) {
+		return errors.New("v8: ConfigurePlatform needs to be called before V8 is initialised")
+	}
+	return nil
+}
+
 // Version returns the V8 version, e.g. "6.6.346.19".
 func Version() string {
 	return C.GoString(C.worker_version())
 }
 
+// Initialise V8 itself on first use.
+func initV8() {
+	initPlatform(PlatformOptions{})
+}
+
+// Initialise V8 with the given options, and report whether it was this call
+// that did so.
+func initPlatform(opts PlatformOptions) bool {
+	initialised := false
+	once.Do(func() {
+		options := C.platform_options{thread_pool_size: C.int(opts.ThreadPoolSize)}
+		if opts.IdleTasks {
+			options.idle_tasks = 1
+		}
+		C.v8_init(&options)
+		initialised = true
+	})
+	return initialised
+}
+
+// The size of the buffer into which SendSync responses are written directly.
+// Larger responses take an extra copy.
+const resultBufferSize = 4 << 10
+
+// The maximum number of messages taken from an outbox per cgo call.
+const outboxBatchSize = 256
+
+// drainOutbox passes the messages queued in the outbox to HandleSend in
+// batches, until the Worker has been disposed and the outbox is empty.
+func (i *instance) drainOutbox(o *C.outbox) {
+	var msgs [outboxBatchSize]C.outbox_message
+	for {
+		n := int(C.outbox_wait(o, &msgs[0], outboxBatchSize))
+		if n < 0 {
+			C.outbox_dispose(o)
+			return
+		}
+		for idx := 0; idx < n; idx++ {
+			msg := C.GoStringN(msgs[idx].data, C.int(msgs[idx].length))
+			if i.handleSend != nil {
+				i.handleSend(msg)
+			}
+		}
+	}
+}
+
+// stringData returns a pointer to the contents of s, which may be passed to C
+// along with its length for the duration of a call, saving the allocation and
+// copy that C.CString would make. The contents aren't null terminated.
+func stringData(s string) *C.char {
+	if len(s) == 0 {
+		return nil
+	}
+	return (*C.char)(unsafe.Pointer(unsafe.StringData(s)))
+}
+
+// goneInstance stands in for instances which have been unregistered. It has no
+// worker or handlers, so callbacks for it do nothing, or fail.
+var goneInstance = &instance{
+	getModuleSource: func(string) (string, error) {
+		return "", errors.New("v8: Worker has been disposed")
+	},
+	resolveModuleURL: func(string, string) (string, error) {
+		return "", errors.New("v8: Worker has been disposed")
+	},
+}
+
 // We use this indirection to get at active instances as we can't safely pass
 // pointers to Go objects to C.
 func getInstance(id int32) *instance {
-	mutex.Lock()
-	defer mutex.Unlock()
-	return registry[id]
+	slot := id & registrySlotMask
+	chunk := (*registryChunk)(atomic.LoadPointer(&registry[slot>>registryChunkBits]))
+	if chunk != nil {
+		i := (*instance)(atomic.LoadPointer(&chunk[slot&(registryChunkSize-1)]))
+		if i != nil && i.id == id {
+			return i
+		}
+	}
+	return goneInstance
 }
 
-//export getModuleSource
-func getModuleSource(id int32, url *C.char) *C.char {
-	source, err := getInstance(id).getModuleSource(C.GoString(url))
-	if err != nil {
-		panic(err)
+// The sources are returned in a malloc'd array. Where fetching a source fails,
+// it's left empty and the error message is set in errs instead.
+//
+//export getModuleSources
+func getModuleSources(id int32, urls **C.char, errs **C.char, n C.int) *C.module_source {
+	i := getInstance(id)
+	count := int(n)
+	urlSlice := (*[1 << 28]*C.char)(unsafe.Pointer(urls))[:count:count]
+	errSlice := (*[1 << 28]*C.char)(unsafe.Pointer(errs))[:count:count]
+	sources := make([]C.module_source, count)
+	fetchErrs := make([]error, count)
+	get := func(idx int, url string) {
+		if i.getModuleBytes != nil {
+			source, err := i.getModuleBytes(url)
+			if err != nil {
+				fetchErrs[idx] = err
+				return
+			}
+			sources[idx] = newModuleSource(source)
+		} else {
+			source, err := i.getModuleSource(url)
+			if err != nil {
+				fetchErrs[idx] = err
+				return
+			}
+			sources[idx] = C.module_source{
+				data:   C.CString(source),
+				length: C.size_t(len(source)),
+			}
+		}
+	}
+	if count == 1 {
+		get(0, C.GoString(urlSlice[0]))
+	} else {
+		// Fetch sibling modules in parallel, as GetModuleSource is likely to
+		// be I/O bound.
+		var wg sync.WaitGroup
+		wg.Add(count)
+		for idx := range urlSlice {
+			go func(idx int, url string) {
+				get(idx, url)
+				wg.Done()
+			}(idx, C.GoString(urlSlice[idx]))
+		}
+		wg.Wait()
+	}
+	for idx, err := range fetchErrs {
+		if err != nil {
+			errSlice[idx] = C.CString(err.Error())
+		} else {
+			errSlice[idx] = nil
+		}
 	}
-	return C.CString(source)
+	size := C.size_t(count) * C.size_t(unsafe.Sizeof(C.module_source{}))
+	ptr := (*C.module_source)(C.malloc(size))
+	copy((*[1 << 26]C.module_source)(unsafe.Pointer(ptr))[:count:count], sources)
+	return ptr
+}
+
+// The urls are returned in a malloc'd array. Where ResolveModuleURL fails, the
+// url is left NULL and the error message is set in errs instead.
+//
+//export resolveModuleURLs
+func resolveModuleURLs(id int32, specifiers **C.char, referrers **C.char, errs **C.char, n C.int) **C.char {
+	resolve := getInstance(id).resolveModuleURL
+	count := int(n)
+	specifierSlice := (*[1 << 28]*C.char)(unsafe.Pointer(specifiers))[:count:count]
+	referrerSlice := (*[1 << 28]*C.char)(unsafe.Pointer(referrers))[:count:count]
+	errSlice := (*[1 << 28]*C.char)(unsafe.Pointer(errs))[:count:count]
+	ptr := (**C.char)(C.malloc(C.size_t(count) * C.size_t(unsafe.Sizeof(uintptr(0)))))
+	out := (*[1 << 28]*C.char)(unsafe.Pointer(ptr))[:count:count]
+	for idx := range out {
+		url, err := resolve(C.GoString(specifierSlice[idx]), C.GoString(referrerSlice[idx]))
+		if err != nil {
+			out[idx] = nil
+			errSlice[idx] = C.CString(err.Error())
+			continue
+		}
+		out[idx] = C.CString(url)
+		errSlice[idx] = nil
+	}
+	return ptr
+}
+
+//export asyncResultCb
+func asyncResultCb(token int64, status C.int, result *C.char, length C.size_t) {
+	ch, ok := asyncResults.LoadAndDelete(token)
+	if !ok {
+		return
+	}
+	var res Result
+	if status != 0 {
+		res.Err = errors.New(C.GoStringN(result, C.int(length)))
+	} else {
+		res.Response = C.GoStringN(result, C.int(length))
+	}
+	ch.(chan Result) <- res
+}
+
+// The size of the chunks in which streamed sources are read.
+const sourceChunkSize = 64 << 10
+
+type sourceChunk struct {
+	data []byte
+	err  error
+}
+
+// sourceReader reads ahead of a streamed compile on a separate goroutine, so
+// that I/O overlaps with parsing.
+type sourceReader struct {
+	chunks  chan sourceChunk
+	done    chan struct{}
+	err     error
+	final   error      // the error returned by r after the pending data
+	mutex   sync.Mutex // guards err
+	pending []byte
+}
+
+func newSourceReader(r io.Reader) *sourceReader {
+	s := &sourceReader{
+		chunks: make(chan sourceChunk, 4),
+		done:   make(chan struct{}),
+	}
+	go func() {
+		for {
+			buf := make([]byte, sourceChunkSize)
+			n, err := io.ReadFull(r, buf)
+			if err == io.ErrUnexpectedEOF {
+				err = io.EOF
+			}
+			select {
+			case s.chunks <- sourceChunk{buf[:n], err}:
+			case <-s.done:
+				return
+			}
+			if err != nil {
+				return
+			}
+		}
+	}()
+	return s
+}
+
+// read copies the next part of the source into buf, and returns its length, or
+// 0 at the end of the source, or -1 if r returned an error.
+func (s *sourceReader) read(buf []byte) int {
+	for len(s.pending) == 0 {
+		if s.final == io.EOF {
+			return 0
+		} else if s.final != nil {
+			s.mutex.Lock()
+			s.err = s.final
+			s.mutex.Unlock()
+			return -1
+		}
+		chunk := <-s.chunks
+		s.pending, s.final = chunk.data, chunk.err
+	}
+	n := copy(buf, s.pending)
+	s.pending = s.pending[n:]
+	return n
+}
+
+//export readSourceCb
+func readSourceCb(token int64, buf *C.char, size C.size_t) C.int {
+	s, ok := sourceReaders.Load(token)
+	if !ok {
+		return -1
+	}
+	n := int(size)
+	return C.int(s.(*sourceReader).read((*[1 << 30]byte)(unsafe.Pointer(buf))[:n:n]))
 }
 
 //export recvCb
-func recvCb(id int32, msg *C.char) {
+func recvCb(id int32, msg *C.char, length C.size_t) {
 	cb := getInstance(id).handleSend
 	if cb != nil {
-		cb(C.GoString(msg))
+		cb(C.GoStringN(msg, C.int(length)))
+	}
+}
+
+//export recvAsyncCb
+func recvAsyncCb(id int32, promiseID int64, msg *C.char, length C.size_t) {
+	i := getInstance(id)
+	m := C.GoStringN(msg, C.int(length))
+	go func() {
+		var resp string
+		var err error
+		if i.handleSendAsync == nil {
+			err = errors.New("v8: Worker.HandleSendAsync is nil")
+		} else {
+			resp, err = i.handleSendAsync(m)
+		}
+		var status C.int
+		if err != nil {
+			status = 1
+			resp = err.Error()
+		}
+		respStr := C.CString(resp)
+		defer C.free(unsafe.Pointer(respStr))
+		i.mutex.RLock()
+		defer i.mutex.RUnlock()
+		if i.worker != nil {
+			C.worker_settle(i.worker, C.int64_t(promiseID), status, respStr)
+		}
+	}()
+}
+
+//export recvBytesCb
+func recvBytesCb(id int32, data unsafe.Pointer, length C.size_t) {
+	cb := getInstance(id).handleSendBytes
+	if cb != nil {
+		n := int(length)
+		if n == 0 {
+			cb([]byte{})
+			return
+		}
+		cb((*[1 << 30]byte)(data)[:n:n])
+	}
+}
+
+//export recvValueCb
+func recvValueCb(id int32, data unsafe.Pointer, length C.size_t) {
+	cb := getInstance(id).handleSendValue
+	if cb != nil {
+		n := int(length)
+		cb((*[1 << 30]byte)(data)[:n:n])
 	}
 }
 
 //export recvSyncCb
-func recvSyncCb(id int32, msg *C.char) *C.char {
+func recvSyncCb(id int32, msg *C.char, length C.size_t, respLength *C.size_t) *C.char {
 	cb := getInstance(id).handleSendSync
 	var resp string
 	if cb == nil {
 		resp = "v8: Worker.HandleSendSync is nil"
 	} else {
-		resp, _ = cb(C.GoString(msg))
+		resp, _ = cb(C.GoStringN(msg, C.int(length)))
+	}
+	// The response is returned with its length, so it isn't null terminated.
+	n := len(resp)
+	*respLength = C.size_t(n)
+	if n == 0 {
+		return nil
 	}
-	return C.CString(resp)
+	buf := C.malloc(C.size_t(n))
+	copy((*[1 << 30]byte)(buf)[:n:n], resp)
+	return (*C.char)(buf)
 }
 
-// Free resources associated with the underlying instance and V8 Isolate.
+// Free resources associated with the underlying instance and V8 Isolate. The
+// instance is only unregistered afterwards, as the event loop thread may still
+// call back into Go while it is being stopped.
 func (w *Worker) dispose() {
-	mutex.Lock()
-	delete(registry, w.instance.id)
-	mutex.Unlock()
-	C.worker_dispose(w.instance.worker)
+	i := w.instance
+	// The event loop thread is stopped before the mutex is taken, as its
+	// current call may be waiting for a settlement from recvAsyncCb, which
+	// needs the mutex to deliver it.
+	// Setting disposing beforehand keeps sendAsync from queueing calls for
+	// it meanwhile.
+	i.mutex.Lock()
+	i.disposing = true
+	i.mutex.Unlock()
+	C.worker_stop_loop(i.worker)
+	i.mutex.Lock()
+	C.worker_dispose(i.worker)
+	i.worker = nil
+	i.mutex.Unlock()
+	w.unregister()
+}
+
+func (w *Worker) enablePrint() int32 {
+	if w.EnablePrint {
+		return 1
+	}
+	return 0
 }
 
 // Convert the last exception into a Go value.
 func (w *Worker) getError() error {
-	err := C.worker_last_exception(w.instance.worker)
-	defer C.free(unsafe.Pointer(err))
-	return errors.New(C.GoString(err))
+	if err := w.limitError(); err != nil {
+		return err
+	}
+	var e C.worker_error
+	C.worker_last_error(w.instance.worker, &e)
+	defer C.free(unsafe.Pointer(e.message))
+	defer C.free(unsafe.Pointer(e.file))
+	return &Error{
+		Column:   int(e.column),
+		File:     C.GoString(e.file),
+		Line:     int(e.line),
+		Message:  C.GoString(e.message),
+		id:       int64(e.id),
+		instance: w.instance,
+	}
+}
+
+// Return the error for a call that was terminated for exceeding one of the
+// Worker's Limits, if it was.
+func (w *Worker) limitError() error {
+	if C.worker_heap_limit_reached(w.instance.worker) != 0 {
+		return ErrHeapLimit
+	}
+	switch C.worker_interrupt_reason(w.instance.worker) {
+	case C.INTERRUPT_TIMEOUT:
+		return ErrTimeout
+	case C.INTERRUPT_CPU_BUDGET:
+		return ErrCPUBudget
+	}
+	return nil
+}
+
+// Initialise the Worker if need be, and return its instance, for calls which
+// don't hold the Worker's mutex for their duration. These need to hold the
+// instance's read lock instead while using its worker, which is nil once the
+// Worker has been disposed.
+func (w *Worker) current() *instance {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+	w.init()
+	return w.instance
 }
 
 // Initialise the underlying JavaScript VM instance.
@@ -131,40 +1080,155 @@ func (w *Worker) init() {
 		return
 	}
 
-	mutex.Lock()
-	nextID++
-	i := &instance{
-		getModuleSource: w.GetModuleSource,
-		handleSend:      w.HandleSend,
-		handleSendSync:  w.HandleSendSync,
-		id:              nextID,
-	}
-	registry[nextID] = i
-	mutex.Unlock()
-
-	once.Do(func() {
-		C.v8_init()
-	})
+	i := w.register()
+	initV8()
 
-	var enablePrint int32
-	if w.EnablePrint {
-		enablePrint = 1
+	limits := C.worker_limits{
+		max_old_space_mb:  C.size_t(w.Limits.MaxOldSpaceMB),
+		max_semi_space_kb: C.size_t(w.Limits.MaxSemiSpaceKB),
+		code_range_mb:     C.size_t(w.Limits.CodeRangeMB),
+		stack_kb:          C.size_t(w.Limits.StackKB),
+		timeout_ns:        C.int64_t(w.Limits.Timeout),
+		cpu_budget_ns:     C.int64_t(w.Limits.CPUBudget),
+	}
+	allocator := C.int(w.ArrayBufferAllocator)
+	if w.Parent != nil {
+		parent := w.Parent
+		parent.mutex.Lock()
+		parent.init()
+		i.snapshot = parent.instance.snapshot
+		i.worker = C.worker_new_context(parent.instance.worker, C.int(i.id), C.int(w.enablePrint()), &limits)
+		parent.mutex.Unlock()
+		if i.worker == nil {
+			panic("v8worker: can't create a context within a snapshot creator")
+		}
+	} else if w.Snapshot != nil {
+		i.snapshot = w.Snapshot
+		i.worker = C.worker_init_from_snapshot(C.int(i.id), w.Snapshot.snapshot, &limits, allocator)
+	} else {
+		i.worker = C.worker_init(C.int(i.id), C.int(w.enablePrint()), &limits, allocator)
+	}
+	if w.Outbox > 0 {
+		go i.drainOutbox(C.worker_outbox_new(i.worker, C.size_t(w.Outbox)))
 	}
-
-	i.worker = C.worker_init(C.int(i.id), C.int(enablePrint))
 	w.instance = i
+	atomic.StorePointer(&w.live, unsafe.Pointer(i))
 
 	runtime.SetFinalizer(w, func(w *Worker) {
 		w.dispose()
 	})
 }
 
+func toArrayBufferStats(stats *C.array_buffer_stats) ArrayBufferStats {
+	return ArrayBufferStats{
+		Allocations:          int64(stats.allocations),
+		CachedBytes:          int64(stats.cached_bytes),
+		OutstandingBytes:     int64(stats.outstanding_bytes),
+		PeakOutstandingBytes: int64(stats.peak_outstanding_bytes),
+		PooledAllocations:    int64(stats.pooled_allocations),
+	}
+}
+
+func toGCStats(stats *C.gc_stats) GCStats {
+	return GCStats{
+		MajorCount: int64(stats.major_count),
+		MajorPause: time.Duration(stats.major_pause_ns),
+		MaxPause:   time.Duration(stats.max_pause_ns),
+		MinorCount: int64(stats.minor_count),
+		MinorPause: time.Duration(stats.minor_pause_ns),
+	}
+}
+
+// Create a new instance for the Worker's config and add it to the registry.
+func (w *Worker) register() *instance {
+	mutex.Lock()
+	defer mutex.Unlock()
+	var id int32
+	if n := len(freeIDs); n > 0 {
+		freed := freeIDs[n-1]
+		freeIDs = freeIDs[:n-1]
+		gen := (freed>>registrySlotBits + 1) & (1<<registryGenBits - 1)
+		id = gen<<registrySlotBits | freed&registrySlotMask
+	} else {
+		nextID++
+		id = nextID
+	}
+	slot := id & registrySlotMask
+	if slot>>registryChunkBits >= registryChunks {
+		panic("v8: too many active Workers")
+	}
+	chunkSlot := &registry[slot>>registryChunkBits]
+	chunk := (*registryChunk)(atomic.LoadPointer(chunkSlot))
+	if chunk == nil {
+		chunk = new(registryChunk)
+		atomic.StorePointer(chunkSlot, unsafe.Pointer(chunk))
+	}
+	i := &instance{
+		getModuleBytes:   w.GetModuleBytes,
+		getModuleSource:  w.GetModuleSource,
+		handleSend:       w.HandleSend,
+		handleSendAsync:  w.HandleSendAsync,
+		handleSendBytes:  w.HandleSendBytes,
+		handleSendSync:   w.HandleSendSync,
+		handleSendValue:  w.HandleSendValue,
+		id:               id,
+		resolveModuleURL: w.ResolveModuleURL,
+	}
+	if traceEnabled {
+		i.trace = new([C.TRACE_OPS]traceHistogram)
+	}
+	atomic.StorePointer(&chunk[slot&(registryChunkSize-1)], unsafe.Pointer(i))
+	return i
+}
+
+// Remove the Worker's instance from the registry.
+func (w *Worker) unregister() {
+	id := w.instance.id
+	slot := id & registrySlotMask
+	mutex.Lock()
+	chunk := (*registryChunk)(atomic.LoadPointer(&registry[slot>>registryChunkBits]))
+	atomic.StorePointer(&chunk[slot&(registryChunkSize-1)], nil)
+	freeIDs = append(freeIDs, id)
+	mutex.Unlock()
+	atomic.StorePointer(&w.live, nil)
+	w.instance = nil
+}
+
+// AttachChannel makes the Channel available to the Worker's JavaScript as
+// $channel(name). If receive is true, the Worker becomes the Channel's
+// receiver. A Channel can only have one receiver, and values posted to it
+// before then are held until one is attached and sets an onmessage handler.
+// Channels stay attached across calls to Reset.
+func (w *Worker) AttachChannel(name string, ch *Channel, receive bool) error {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	w.init()
+	nameStr := C.CString(name)
+	defer C.free(unsafe.Pointer(nameStr))
+
+	var recv C.int
+	if receive {
+		recv = 1
+	}
+	r := C.worker_attach_channel(w.instance.worker, nameStr, ch.channel, recv)
+	if r != 0 {
+		return w.getError()
+	}
+	return nil
+}
+
 // LoadModule loads and executes ES Module code with the given url. LoadModule
 // is not threadsafe.
 func (w *Worker) LoadModule(url string) error {
+	start := traceStart()
 	w.mutex.Lock()
 	w.init()
-	if w.instance.getModuleSource == nil {
+	if traceEnabled {
+		defer traceCall(w.instance, C.TRACE_LOAD_MODULE, start)
+	}
+	if w.instance.getModuleSource == nil && w.instance.getModuleBytes == nil {
+		w.mutex.Unlock()
 		return errors.New("v8: GetModuleSource needs to be set before any methods are called")
 	}
 	w.mutex.Unlock()
@@ -172,13 +1236,71 @@ func (w *Worker) LoadModule(url string) error {
 	urlStr := C.CString(url)
 	defer C.free(unsafe.Pointer(urlStr))
 
-	r := C.worker_load_module(w.instance.worker, urlStr)
+	r := C.worker_load_module(w.instance.worker, urlStr, w.resolveModules())
 	if r != 0 {
 		return w.getError()
 	}
 	return nil
 }
 
+// CreateBundle loads the module with the given url and its entire import
+// graph, using GetModuleSource and ResolveModuleURL, and returns it as a
+// bundle which can be loaded with LoadBundle, in a single call and without
+// any further resolution or fetching. The modules aren't evaluated, and are
+// loaded in a separate context, so the Worker is unaffected.
+func (w *Worker) CreateBundle(url string) ([]byte, error) {
+	w.mutex.Lock()
+	w.init()
+	if w.instance.getModuleSource == nil && w.instance.getModuleBytes == nil {
+		w.mutex.Unlock()
+		return nil, errors.New("v8: GetModuleSource needs to be set before any methods are called")
+	}
+	w.mutex.Unlock()
+
+	urlStr := C.CString(url)
+	defer C.free(unsafe.Pointer(urlStr))
+
+	var out *C.char
+	var length C.size_t
+	if C.worker_create_bundle(w.instance.worker, urlStr, w.resolveModules(), &out, &length) != 0 {
+		return nil, w.getError()
+	}
+	defer C.free(unsafe.Pointer(out))
+	return C.GoBytes(unsafe.Pointer(out), C.int(length)), nil
+}
+
+// LoadBundle loads all the modules within a bundle created by CreateBundle,
+// and executes its entry module. If the bundle is part of a MappedFile, the
+// modules' sources are used in place, like those returned by GetModuleBytes.
+func (w *Worker) LoadBundle(bundle []byte) error {
+	w.mutex.Lock()
+	w.init()
+	w.mutex.Unlock()
+
+	if len(bundle) == 0 {
+		return errors.New("v8: invalid bundle")
+	}
+	// Unless the bundle is mapped, it only needs to be valid for the duration
+	// of the call, so it's passed as is.
+	data := (*C.char)(unsafe.Pointer(&bundle[0]))
+	file := mappedFile(bundle)
+	if file != nil {
+		defer C.mapped_file_release(file)
+	}
+	r := C.worker_load_bundle(w.instance.worker, data, C.size_t(len(bundle)), file)
+	if r != 0 {
+		return w.getError()
+	}
+	return nil
+}
+
+func (w *Worker) resolveModules() C.int {
+	if w.instance.resolveModuleURL != nil {
+		return 1
+	}
+	return 0
+}
+
 // LoadScript loads and executes JavaScript code with the given filename and
 // source code. LoadScript is not threadsafe.
 func (w *Worker) LoadScript(filename string, source string) error {
@@ -198,16 +1320,197 @@ func (w *Worker) LoadScript(filename string, source string) error {
 	return nil
 }
 
+// LoadScriptFrom loads and executes a script whose source is read from r, e.g.
+// a file or an HTTP response body. The source is streamed to V8, which parses
+// it chunk by chunk, instead of it being buffered in full first. The chunks are
+// read ahead on a separate goroutine, so that I/O overlaps with parsing. The
+// binding still keeps a copy of the whole source, from which the script's
+// source string is created, so memory use isn't any lower than LoadScript's.
+// It must be encoded in UTF-8.
+func (w *Worker) LoadScriptFrom(filename string, r io.Reader) error {
+	w.mutex.Lock()
+	w.init()
+	w.mutex.Unlock()
+
+	token := atomic.AddInt64(&nextToken, 1)
+	s := newSourceReader(r)
+	sourceReaders.Store(token, s)
+	defer func() {
+		sourceReaders.Delete(token)
+		close(s.done)
+	}()
+
+	name := C.CString(filename)
+	defer C.free(unsafe.Pointer(name))
+	if C.worker_load_script_stream(w.instance.worker, name, C.int64_t(token)) != 0 {
+		s.mutex.Lock()
+		err := s.err
+		s.mutex.Unlock()
+		if err != nil {
+			return err
+		}
+		return w.getError()
+	}
+	return nil
+}
+
 // Send a message, calling the $recv callback in JavaScript.
 func (w *Worker) Send(msg string) error {
+	start := traceStart()
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	w.init()
+	if traceEnabled {
+		defer traceCall(w.instance, C.TRACE_SEND, start)
+	}
+	r := C.worker_send(w.instance.worker, stringData(msg), C.size_t(len(msg)))
+	if r != 0 {
+		return w.getError()
+	}
+	return nil
+}
+
+// SendAsync queues a message for the Worker's dedicated event loop thread,
+// which will call the $recv callback in JavaScript. It never blocks on
+// JavaScript execution, and the returned channel receives the outcome once the
+// call has completed. Calls made with SendAsync and SendSyncAsync are run in
+// order on the same native thread, which is started on first use.
+func (w *Worker) SendAsync(msg string) <-chan Result {
+	return w.sendAsync(msg, 0)
+}
+
+// SendSyncAsync is like SendAsync, but calls the $recvSync callback instead,
+// and passes its return value back as the Result's Response.
+func (w *Worker) SendSyncAsync(msg string) <-chan Result {
+	return w.sendAsync(msg, 1)
+}
+
+func (w *Worker) sendAsync(msg string, sync int) <-chan Result {
+	ch := make(chan Result, 1)
+	token := atomic.AddInt64(&nextToken, 1)
+	asyncResults.Store(token, ch)
+
+	// The message is copied by worker_send_async before it returns.
+	data, length := stringData(msg), C.size_t(len(msg))
+
+	// The Worker's mutex is held for the whole of any sync call, so it's only
+	// taken to initialise the Worker, or to wait for it to be disposed.
+	if i := (*instance)(atomic.LoadPointer(&w.live)); i != nil {
+		i.mutex.RLock()
+		if !i.disposing {
+			C.worker_send_async(i.worker, data, length, C.int64_t(token), C.int(sync))
+			i.mutex.RUnlock()
+			return ch
+		}
+		i.mutex.RUnlock()
+	}
+
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	w.init()
+	C.worker_send_async(w.instance.worker, data, length, C.int64_t(token), C.int(sync))
+	return ch
+}
+
+// SendBatch sends a batch of messages to JavaScript, only paying the cost of
+// entering the VM once. If a callback has been registered with $recvBatch, it
+// is called once with an array of all the messages. Otherwise, the $recv
+// callback is called once per message. If any messages fail, a *BatchError is
+// returned.
+func (w *Worker) SendBatch(msgs []string) error {
+	n := len(msgs)
+	if n == 0 {
+		return nil
+	}
+
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	w.init()
+
+	// Pack all of the messages into a single buffer, so that the batch only
+	// needs a few allocations irrespective of its size. They are passed with
+	// their lengths, so they may contain null bytes.
+	size := 0
+	for _, msg := range msgs {
+		size += len(msg)
+	}
+	ptrSize := C.size_t(unsafe.Sizeof(uintptr(0)))
+	lengthSize := C.size_t(unsafe.Sizeof(C.size_t(0)))
+	buf := C.malloc(C.size_t(size))
+	defer C.free(buf)
+	lengths := (*C.size_t)(C.malloc(C.size_t(n) * lengthSize))
+	defer C.free(unsafe.Pointer(lengths))
+	errs := (**C.char)(C.calloc(C.size_t(n), ptrSize))
+	defer C.free(unsafe.Pointer(errs))
+
+	data := (*[1 << 30]byte)(buf)[:size:size]
+	lengthSlice := (*[1 << 28]C.size_t)(unsafe.Pointer(lengths))[:n:n]
+	offset := 0
+	for idx, msg := range msgs {
+		offset += copy(data[offset:], msg)
+		lengthSlice[idx] = C.size_t(len(msg))
+	}
+
+	failed := C.worker_send_batch(w.instance.worker, (*C.char)(buf), lengths, C.int(n), errs)
+	if failed == 0 {
+		return nil
+	}
+	errSlice := (*[1 << 28]*C.char)(unsafe.Pointer(errs))[:n:n]
+	defer func() {
+		for _, err := range errSlice {
+			C.free(unsafe.Pointer(err))
+		}
+	}()
+	if err := w.limitError(); err != nil {
+		return err
+	}
+	batchErr := &BatchError{Errors: make([]error, n)}
+	for idx, err := range errSlice {
+		if err != nil {
+			batchErr.Errors[idx] = errors.New(C.GoString(err))
+		}
+	}
+	return batchErr
+}
+
+// SendBytes sends binary data, calling the $recvBuffer callback in JavaScript
+// with an ArrayBuffer that is backed directly by data, i.e. without copying it.
+// The ArrayBuffer is neutered once the callback returns, so JavaScript code
+// needs to copy anything it wants to retain beyond the call.
+func (w *Worker) SendBytes(data []byte) error {
 	w.mutex.Lock()
 	defer w.mutex.Unlock()
 
 	w.init()
-	msgStr := C.CString(msg)
-	defer C.free(unsafe.Pointer(msgStr))
+	var ptr unsafe.Pointer
+	if len(data) > 0 {
+		ptr = unsafe.Pointer(&data[0])
+	}
 
-	r := C.worker_send(w.instance.worker, msgStr)
+	r := C.worker_send_bytes(w.instance.worker, ptr, C.size_t(len(data)))
+	if r != 0 {
+		return w.getError()
+	}
+	return nil
+}
+
+// SendValue sends a value serialized by $sendValue, calling the $recvValue
+// callback in JavaScript with the deserialized value. The data is only read
+// during the call.
+func (w *Worker) SendValue(data []byte) error {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	w.init()
+	var ptr unsafe.Pointer
+	if len(data) > 0 {
+		ptr = unsafe.Pointer(&data[0])
+	}
+
+	r := C.worker_send_value(w.instance.worker, ptr, C.size_t(len(data)))
 	if r != 0 {
 		return w.getError()
 	}
@@ -215,19 +1518,139 @@ func (w *Worker) Send(msg string) error {
 }
 
 // SendSync sends a message, calling the $recvSync callback in JavaScript. The
-// return value of that callback will be passed back to the caller in Go.
+// return value of that callback will be passed back to the caller in Go. If
+// the callback returns a Promise, SendSync runs microtasks and applies the
+// settlements of $sendAsync calls until it has settled.
 func (w *Worker) SendSync(msg string) (string, error) {
+	start := traceStart()
 	w.mutex.Lock()
 	defer w.mutex.Unlock()
 
 	w.init()
-	msgStr := C.CString(msg)
-	defer C.free(unsafe.Pointer(msgStr))
+	i := w.instance
+	if traceEnabled {
+		defer traceCall(i, C.TRACE_SEND_SYNC, start)
+	}
+	if i.result == nil {
+		i.result = make([]byte, resultBufferSize)
+	}
+	// The response is written directly into the reusable buffer if it fits,
+	// and copied out of it into the string, as the buffer is reused. Larger
+	// responses are held by C until they've been read into a buffer of their
+	// exact size, which then becomes the string without another copy.
+	n := int(C.worker_send_sync(i.worker, stringData(msg), C.size_t(len(msg)),
+		(*C.char)(unsafe.Pointer(&i.result[0])), C.size_t(len(i.result))))
+	if n > len(i.result) {
+		buf := make([]byte, n)
+		C.worker_read_result(i.worker, (*C.char)(unsafe.Pointer(&buf[0])))
+		if err := w.limitError(); err != nil {
+			return "", err
+		}
+		return unsafe.String(&buf[0], n), nil
+	}
+	if err := w.limitError(); err != nil {
+		return "", err
+	}
+	return string(i.result[:n]), nil
+}
+
+// Dispose frees the underlying JavaScript VM instance immediately, instead of
+// waiting for the Worker to be garbage collected. The Worker must not be used
+// afterwards.
+func (w *Worker) Dispose() {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	if w.instance != nil {
+		runtime.SetFinalizer(w, nil)
+		w.dispose()
+	}
+}
+
+// Reset discards the Worker's JavaScript context, including any loaded modules
+// and registered callbacks, and replaces it with a fresh one. The underlying
+// VM instance is kept, so this is much cheaper than creating a new Worker. If
+// the Worker was created from a Snapshot, the fresh context is deserialized
+// from it again.
+func (w *Worker) Reset() error {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	// There's nothing to reset if we haven't yet been initialised.
+	if w.instance == nil {
+		return nil
+	}
+	if C.worker_reset_context(w.instance.worker) != 0 {
+		return w.getError()
+	}
+	return nil
+}
 
-	resp := C.worker_send_sync(w.instance.worker, msgStr)
-	defer C.free(unsafe.Pointer(resp))
+// GCStats returns the Worker's GC stats. Unlike Stats, it doesn't need to wait
+// for any JavaScript that is currently executing, so it is cheap enough to be
+// polled for metrics.
+func (w *Worker) GCStats() GCStats {
+	i := w.current()
+	i.mutex.RLock()
+	defer i.mutex.RUnlock()
+	if i.worker == nil {
+		return GCStats{}
+	}
 
-	return C.GoString(resp), nil
+	var stats C.gc_stats
+	C.worker_gc_stats(i.worker, &stats)
+	return toGCStats(&stats)
+}
+
+// Stats returns the Worker's memory usage and GC stats. It waits for any
+// JavaScript that is currently executing on the Worker to finish.
+func (w *Worker) Stats() Stats {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	w.init()
+	var stats C.heap_stats
+	var spaces [16]C.heap_space_stats
+	n := int(C.worker_heap_stats(w.instance.worker, &stats, &spaces[0], C.int(len(spaces))))
+	if n > len(spaces) {
+		n = len(spaces)
+	}
+	s := Stats{
+		ArrayBuffers:            toArrayBufferStats(&stats.array_buffers),
+		DetachedContexts:        uint64(stats.number_of_detached_contexts),
+		GC:                      toGCStats(&stats.gc),
+		HeapSizeLimit:           uint64(stats.heap_size_limit),
+		HeapSpaces:              make([]HeapSpaceStats, n),
+		MallocedMemory:          uint64(stats.malloced_memory),
+		NativeContexts:          uint64(stats.number_of_native_contexts),
+		PeakMallocedMemory:      uint64(stats.peak_malloced_memory),
+		TotalAvailableSize:      uint64(stats.total_available_size),
+		TotalHeapSize:           uint64(stats.total_heap_size),
+		TotalHeapSizeExecutable: uint64(stats.total_heap_size_executable),
+		TotalPhysicalSize:       uint64(stats.total_physical_size),
+		UsedHeapSize:            uint64(stats.used_heap_size),
+	}
+	for idx := 0; idx < n; idx++ {
+		space := &spaces[idx]
+		s.HeapSpaces[idx] = HeapSpaceStats{
+			Available: uint64(space.space_available_size),
+			Name:      C.GoString(space.space_name),
+			Physical:  uint64(space.physical_space_size),
+			Size:      uint64(space.space_size),
+			Used:      uint64(space.space_used_size),
+		}
+	}
+	return s
+}
+
+// StatsVar returns an expvar.Var which exports the Worker's Stats, e.g. for
+// use with expvar.Publish. The stats are only gathered when the var is read.
+// Note that the Worker will not be garbage collected while the var is still
+// referenced, so Dispose should be called explicitly.
+func (w *Worker) StatsVar() expvar.Var {
+	return expvar.Func(func() interface{} {
+		return w.Stats()
+	})
 }
 
 // Terminate instructs the underlying JavaScript VM to stop its current thread
@@ -243,12 +1666,134 @@ func (w *Worker) Terminate() {
 	}
 }
 
+// Idle tells V8 that the Worker is idle until the given deadline, so that it
+// can do GC work in the meantime, rather than during the next call. It returns
+// true once V8 has no more GC work left to do, in which case further calls
+// can be skipped until the Worker has been used again.
+func (w *Worker) Idle(deadline time.Time) bool {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	if w.instance == nil {
+		return true
+	}
+	d := time.Until(deadline)
+	if d <= 0 {
+		return false
+	}
+	return C.worker_idle_notification(w.instance.worker, C.double(d.Seconds())) != 0
+}
+
+// LowMemory makes V8 release as much of the Worker's memory as it can, with
+// full GCs. It is much more expensive than Idle, and is meant for when the
+// process is running out of memory.
+func (w *Worker) LowMemory() {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	if w.instance != nil {
+		C.worker_low_memory_notification(w.instance.worker)
+	}
+}
+
+// MemoryPressure tells V8 about the memory pressure on the process, so that it
+// adjusts its GC heuristics for the Worker. Unlike Idle and LowMemory, it
+// doesn't wait for any JavaScript that is currently executing on the Worker,
+// and V8 does the GC work on the Worker's thread at the next opportunity.
+func (w *Worker) MemoryPressure(level MemoryPressureLevel) {
+	i := w.current()
+	i.mutex.RLock()
+	defer i.mutex.RUnlock()
+	if i.worker != nil {
+		C.worker_memory_pressure(i.worker, C.int(level))
+	}
+}
+
+// PumpMessageLoop runs the tasks that V8 has posted for the Worker's VM to
+// run on the Worker's own thread, e.g. to finalize background compiles, and
+// returns the number of tasks that were run. Workers only run these by
+// themselves after calls made with SendAsync and SendSyncAsync, so others need
+// to call this periodically, e.g. whenever they become idle.
+func (w *Worker) PumpMessageLoop() int {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	if w.instance == nil {
+		return 0
+	}
+	return int(C.worker_pump_message_loop(w.instance.worker))
+}
+
+// RunIdleTasks runs V8's idle tasks for the Worker's VM, for up to the given
+// duration. It does nothing unless IdleTasks was set in the PlatformOptions.
+func (w *Worker) RunIdleTasks(d time.Duration) {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	if w.instance != nil {
+		C.worker_run_idle_tasks(w.instance.worker, C.double(d.Seconds()))
+	}
+}
+
+// StartCPUProfile starts recording a CPU profile of the JavaScript running on
+// the Worker, sampling its stack every interval, or every millisecond if the
+// interval is zero. V8 only samples the OS thread which started the profile,
+// so the caller should use runtime.LockOSThread and make all calls to the
+// Worker from the same goroutine until StopCPUProfile.
+func (w *Worker) StartCPUProfile(interval time.Duration) error {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+
+	w.init()
+	us := C.int(interval / time.Microsecond)
+	if C.worker_profile_start(w.instance.worker, us) != 0 {
+		return w.getError()
+	}
+	return nil
+}
+
+// StopCPUProfile stops the CPU profile started by StartCPUProfile and writes
+// it to out in the gzipped protocol buffer format read by pprof.
+func (w *Worker) StopCPUProfile(out io.Writer) error {
+	w.mutex.Lock()
+	if w.instance == nil {
+		w.mutex.Unlock()
+		return errors.New("v8worker: CPU profile not started")
+	}
+	p := C.worker_profile_stop(w.instance.worker)
+	if p == nil {
+		err := w.getError()
+		w.mutex.Unlock()
+		return err
+	}
+	w.mutex.Unlock()
+
+	count := int(p.count)
+	cnodes := (*[1 << 28]C.profile_node)(unsafe.Pointer(p.nodes))[:count:count]
+	nodes := make([]profileNode, count)
+	for idx := range cnodes {
+		node := &cnodes[idx]
+		nodes[idx] = profileNode{
+			function: C.GoString(node.function_name),
+			hits:     int64(node.hit_count),
+			id:       uint64(node.id),
+			line:     int64(node.line),
+			parent:   uint64(node.parent_id),
+			url:      C.GoString(node.url),
+		}
+	}
+	duration := time.Duration(p.end_us-p.start_us) * time.Microsecond
+	interval := time.Duration(p.interval_us) * time.Microsecond
+	C.cpu_profile_dispose(p)
+	// V8's timestamps are from a monotonic clock, so the start of the profile
+	// is derived from its duration instead.
+	start := time.Now().Add(-duration)
+	return writeProfile(out, nodes, start, duration, interval)
+}
+
 // TODO:
 //
 // Configure module resolution
-// Fully fledged error values
 // Raise exceptions in JS
-// Return errors in Go
 // Protect $functions -- perhaps in module -- perhaps make it configurable
-// Handle async
 // Set request/response IDs
@@ -0,0 +1,246 @@
+package v8
+
+import (
+	"fmt"
+	"sort"
+	"strings"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+// The payload sizes used by the messaging benchmarks, in bytes.
+var benchPayloadSizes = []int{16, 1024, 64 * 1024}
+
+const benchRecvScript = `
+$recv(function(msg) {});
+$recvSync(function(msg) { return msg; });
+`
+
+func newBenchWorker() (*Worker, error) {
+	w := &Worker{
+		HandleSend: func(msg string) error {
+			return nil
+		},
+		HandleSendSync: func(msg string) (string, error) {
+			return msg, nil
+		},
+	}
+	if err := w.LoadScript("bench.js", benchRecvScript); err != nil {
+		return nil, err
+	}
+	return w, nil
+}
+
+// reportLatencies reports the throughput and latency percentiles for the
+// given per-op durations.
+func reportLatencies(b *testing.B, latencies []time.Duration) {
+	if len(latencies) == 0 {
+		return
+	}
+	sort.Slice(latencies, func(i, j int) bool {
+		return latencies[i] < latencies[j]
+	})
+	pct := func(p float64) float64 {
+		return float64(latencies[int(float64(len(latencies)-1)*p)].Nanoseconds())
+	}
+	b.ReportMetric(pct(0.50), "p50-ns")
+	b.ReportMetric(pct(0.99), "p99-ns")
+	b.ReportMetric(pct(1.00), "max-ns")
+	b.ReportMetric(float64(b.N)/b.Elapsed().Seconds(), "msgs/s")
+}
+
+func BenchmarkInit(b *testing.B) {
+	for n := 0; n < b.N; n++ {
+		w := &Worker{}
+		w.GCStats()
+		w.Dispose()
+	}
+}
+
+func BenchmarkInitFromSnapshot(b *testing.B) {
+	snapshot, err := NewSnapshot(&Worker{}, func(w *Worker) error {
+		return w.LoadScript("bench.js", benchRecvScript)
+	})
+	if err != nil {
+		b.Fatal(err)
+	}
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		w := &Worker{Snapshot: snapshot}
+		w.GCStats()
+		w.Dispose()
+	}
+}
+
+func BenchmarkReset(b *testing.B) {
+	w, err := newBenchWorker()
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer w.Dispose()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		if err := w.Reset(); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkLoadScript(b *testing.B) {
+	source := strings.Repeat("function f() { return [1, 2, 3].map(x => x * 2); }\n", 100)
+	w := &Worker{}
+	defer w.Dispose()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		if err := w.LoadScript(fmt.Sprintf("bench%d.js", n), source); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkLoadModuleGraph(b *testing.B) {
+	// A module graph of depth 3 in which each module imports 4 others.
+	const fanout, depth = 4, 3
+	sources := map[string]string{}
+	var build func(name string, level int)
+	build = func(name string, level int) {
+		var src strings.Builder
+		if level < depth {
+			for idx := 0; idx < fanout; idx++ {
+				child := fmt.Sprintf("%s_%d", name, idx)
+				fmt.Fprintf(&src, "import './%s.js';\n", child)
+				build(child, level+1)
+			}
+		}
+		src.WriteString("export const value = 1;\n")
+		sources[name+".js"] = src.String()
+	}
+	build("root", 0)
+	b.ReportMetric(float64(len(sources)), "modules")
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		b.StopTimer()
+		w := &Worker{
+			GetModuleSource: func(url string) (string, error) {
+				return sources[strings.TrimPrefix(url, "./")], nil
+			},
+		}
+		b.StartTimer()
+		if err := w.LoadModule("root.js"); err != nil {
+			b.Fatal(err)
+		}
+		b.StopTimer()
+		w.Dispose()
+		b.StartTimer()
+	}
+}
+
+func BenchmarkSend(b *testing.B) {
+	for _, size := range benchPayloadSizes {
+		b.Run(fmt.Sprintf("%dB", size), func(b *testing.B) {
+			w, err := newBenchWorker()
+			if err != nil {
+				b.Fatal(err)
+			}
+			defer w.Dispose()
+			msg := strings.Repeat("x", size)
+			latencies := make([]time.Duration, b.N)
+			b.SetBytes(int64(size))
+			b.ResetTimer()
+			for n := 0; n < b.N; n++ {
+				start := time.Now()
+				if err := w.Send(msg); err != nil {
+					b.Fatal(err)
+				}
+				latencies[n] = time.Since(start)
+			}
+			b.StopTimer()
+			reportLatencies(b, latencies)
+		})
+	}
+}
+
+func BenchmarkSendSync(b *testing.B) {
+	for _, size := range benchPayloadSizes {
+		b.Run(fmt.Sprintf("%dB", size), func(b *testing.B) {
+			w, err := newBenchWorker()
+			if err != nil {
+				b.Fatal(err)
+			}
+			defer w.Dispose()
+			msg := strings.Repeat("x", size)
+			latencies := make([]time.Duration, b.N)
+			b.SetBytes(int64(size))
+			b.ResetTimer()
+			for n := 0; n < b.N; n++ {
+				start := time.Now()
+				if _, err := w.SendSync(msg); err != nil {
+					b.Fatal(err)
+				}
+				latencies[n] = time.Since(start)
+			}
+			b.StopTimer()
+			reportLatencies(b, latencies)
+		})
+	}
+}
+
+// BenchmarkJSSend measures the $send callback path from JavaScript into Go.
+func BenchmarkJSSend(b *testing.B) {
+	for _, size := range benchPayloadSizes {
+		b.Run(fmt.Sprintf("%dB", size), func(b *testing.B) {
+			var received int64
+			w := &Worker{
+				HandleSend: func(msg string) error {
+					received++
+					return nil
+				},
+			}
+			defer w.Dispose()
+			err := w.LoadScript("bench.js", fmt.Sprintf(`
+var msg = 'x'.repeat(%d);
+$recv(function(n) {
+	for (var i = 0; i < +n; i++) {
+		$send(msg);
+	}
+});
+`, size))
+			if err != nil {
+				b.Fatal(err)
+			}
+			b.SetBytes(int64(size))
+			b.ResetTimer()
+			if err := w.Send(fmt.Sprint(b.N)); err != nil {
+				b.Fatal(err)
+			}
+			b.StopTimer()
+			if received != int64(b.N) {
+				b.Fatalf("got %d messages, want %d", received, b.N)
+			}
+			b.ReportMetric(float64(b.N)/b.Elapsed().Seconds(), "msgs/s")
+		})
+	}
+}
+
+// BenchmarkSendParallel measures how SendSync throughput scales across cores,
+// with one Worker per goroutine. Run it with e.g. -cpu 1,2,4,8.
+func BenchmarkSendParallel(b *testing.B) {
+	var total int64
+	b.RunParallel(func(pb *testing.PB) {
+		w, err := newBenchWorker()
+		if err != nil {
+			b.Error(err)
+			return
+		}
+		defer w.Dispose()
+		for pb.Next() {
+			if _, err := w.SendSync("ping"); err != nil {
+				b.Error(err)
+				return
+			}
+			atomic.AddInt64(&total, 1)
+		}
+	})
+	b.ReportMetric(float64(total)/b.Elapsed().Seconds(), "msgs/s")
+}
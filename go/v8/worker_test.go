@@ -1,7 +1,17 @@
 package v8
 
 import (
+	"bytes"
+	"compress/gzip"
+	"errors"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path"
+	"path/filepath"
 	"runtime"
+	"strings"
+	"sync"
 	"testing"
 	"time"
 )
@@ -214,3 +224,1367 @@ func runSimpleWorker(t *testing.T) {
 		t.Fatal(err)
 	}
 }
+
+func TestSnapshot(t *testing.T) {
+	snapshot, err := NewSnapshot(&Worker{}, func(w *Worker) error {
+		return w.LoadScript("warmup.js", `
+	var greeting = "hello";
+	$recvSync(function(msg) {
+		return greeting + " " + msg;
+	});
+`)
+	})
+	if err != nil {
+		t.Fatal(err)
+	}
+	for i := 0; i < 3; i++ {
+		worker := &Worker{Snapshot: snapshot}
+		response, err := worker.SendSync("snapshot")
+		if err != nil {
+			t.Fatal(err)
+		}
+		if got, want := response, "hello snapshot"; got != want {
+			t.Errorf("got %q want %q", got, want)
+		}
+	}
+	_, err = NewSnapshot(&Worker{}, func(w *Worker) error {
+		return w.LoadScript("broken.js", ` $print(hello world"); `)
+	})
+	if err == nil {
+		t.Fatal("Expected error")
+	}
+}
+
+func TestCodeCache(t *testing.T) {
+	EnableCodeCache(t.TempDir())
+	resetCodeCache()
+	before := GetCodeCacheStats()
+	for i := 0; i < 3; i++ {
+		worker := &Worker{}
+		err := worker.LoadScript("cached.js", `
+	function add(a, b) { return a + b; }
+	var sum = add(1, 2);
+`)
+		if err != nil {
+			t.Fatal(err)
+		}
+		worker.Dispose()
+	}
+	stats := GetCodeCacheStats()
+	if got, want := stats.Misses-before.Misses, int64(1); got != want {
+		t.Errorf("got %d misses want %d", got, want)
+	}
+	if got, want := stats.Hits-before.Hits, int64(2); got != want {
+		t.Errorf("got %d hits want %d", got, want)
+	}
+}
+
+func TestCompiler(t *testing.T) {
+	EnableCodeCache(t.TempDir())
+	resetCodeCache()
+	compiler := NewCompiler(2)
+	defer compiler.Close()
+	source := `
+	function mul(a, b) { return a * b; }
+	var product = mul(2, 3);
+`
+	for i := 0; i < 4; i++ {
+		compiler.Compile("precompiled.js", source)
+	}
+	compiler.Compile("broken.js", "function {")
+	if err := compiler.Wait(); err == nil {
+		t.Error("expected an error for broken.js")
+	}
+	if err := compiler.Wait(); err != nil {
+		t.Errorf("expected the error to be cleared: %s", err)
+	}
+	before := GetCodeCacheStats()
+	for i := 0; i < 3; i++ {
+		worker := &Worker{}
+		if err := worker.LoadScript("precompiled.js", source); err != nil {
+			t.Fatal(err)
+		}
+		worker.Dispose()
+	}
+	stats := GetCodeCacheStats()
+	if got, want := stats.Hits-before.Hits, int64(3); got != want {
+		t.Errorf("got %d hits want %d", got, want)
+	}
+	if got, want := stats.Misses-before.Misses, int64(0); got != want {
+		t.Errorf("got %d misses want %d", got, want)
+	}
+}
+
+func TestModuleGraph(t *testing.T) {
+	modules := map[string]string{
+		"main.js":   `import {b} from "b.js"; import {c} from "c.js"; $send(b + c);`,
+		"b.js":      `import {d} from "d.js"; export const b = "b" + d;`,
+		"c.js":      `import {d} from "d.js"; export const c = "c" + d;`,
+		"d.js":      `import {cycle} from "cycle.js"; export const d = "d";`,
+		"cycle.js":  `import {d} from "d.js"; export const cycle = 1;`,
+		"unused.js": ``,
+	}
+	var mutex sync.Mutex
+	fetches := map[string]int{}
+	var caught string
+	worker := &Worker{
+		GetModuleSource: func(url string) (string, error) {
+			mutex.Lock()
+			fetches[url]++
+			mutex.Unlock()
+			return modules[url], nil
+		},
+		HandleSend: func(msg string) error {
+			caught = msg
+			return nil
+		},
+	}
+	if err := worker.LoadModule("main.js"); err != nil {
+		t.Fatal(err)
+	}
+	if got, want := caught, "bdcd"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+	for url, count := range fetches {
+		if count != 1 {
+			t.Errorf("fetched %s %d times", url, count)
+		}
+	}
+	if got, want := len(fetches), 5; got != want {
+		t.Errorf("fetched %d modules want %d", got, want)
+	}
+}
+
+func TestModuleLoadFailure(t *testing.T) {
+	modules := map[string]string{
+		"main.js": `import {b} from "b.js"; $send(b);`,
+		"b.js":    `import {c} from "c.js"; export const b = "b" + c;`,
+	}
+	var mutex sync.Mutex
+	var caught string
+	worker := &Worker{
+		GetModuleSource: func(url string) (string, error) {
+			mutex.Lock()
+			defer mutex.Unlock()
+			source, ok := modules[url]
+			if !ok {
+				return "", errors.New("not found")
+			}
+			return source, nil
+		},
+		HandleSend: func(msg string) error {
+			caught = msg
+			return nil
+		},
+	}
+	defer worker.Dispose()
+	err := worker.LoadModule("main.js")
+	if err == nil || !strings.Contains(err.Error(), "not found") {
+		t.Fatalf("got %v want the fetch error", err)
+	}
+	mutex.Lock()
+	modules["c.js"] = `export const c = "c";`
+	mutex.Unlock()
+	if err := worker.LoadModule("main.js"); err != nil {
+		t.Fatal(err)
+	}
+	if got, want := caught, "bc"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+}
+
+func TestSendBytes(t *testing.T) {
+	var caught []byte
+	worker := &Worker{
+		HandleSendBytes: func(data []byte) error {
+			caught = append([]byte(nil), data...)
+			return nil
+		},
+	}
+	err := worker.LoadScript("bytes.js", `
+	var retained;
+	$recvBuffer(function(buf) {
+		retained = buf;
+		var view = new Uint8Array(buf);
+		var out = new Uint8Array(view.length);
+		for (var i = 0; i < view.length; i++) {
+			out[i] = view[i] + 1;
+		}
+		$sendBuffer(out);
+	});
+	$recvSync(function() { return String(retained.byteLength); });
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := worker.SendBytes([]byte{0, 1, 254}); err != nil {
+		t.Fatal(err)
+	}
+	if got, want := string(caught), string([]byte{1, 2, 255}); got != want {
+		t.Errorf("got %v want %v", []byte(got), []byte(want))
+	}
+	// The buffer must have been neutered once the callback returned.
+	if got, _ := worker.SendSync(""); got != "0" {
+		t.Errorf("got byteLength %s after the call, want 0", got)
+	}
+}
+
+func TestSendBatch(t *testing.T) {
+	var caught []string
+	worker := &Worker{
+		HandleSend: func(msg string) error {
+			caught = append(caught, msg)
+			return nil
+		},
+	}
+	err := worker.LoadScript("batch.js", `
+	$recv(function(msg) {
+		if (msg === "bad") {
+			throw new Error("bad message");
+		}
+		$send("got " + msg);
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	err = worker.SendBatch([]string{"a", "bad", "c"})
+	batchErr, ok := err.(*BatchError)
+	if !ok {
+		t.Fatalf("got %v want a *BatchError", err)
+	}
+	if batchErr.Errors[0] != nil || batchErr.Errors[1] == nil || batchErr.Errors[2] != nil {
+		t.Errorf("unexpected errors: %v", batchErr.Errors)
+	}
+	if got, want := strings.Join(caught, ","), "got a,got c"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+
+	caught = nil
+	err = worker.LoadScript("batcharray.js", `
+	$recvBatch(function(msgs) {
+		$send(msgs.join("+"));
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := worker.SendBatch([]string{"x", "y", "z"}); err != nil {
+		t.Fatal(err)
+	}
+	if got, want := strings.Join(caught, ","), "x+y+z"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+
+	// Messages are passed with their lengths, so null bytes survive.
+	caught = nil
+	err = worker.LoadScript("batchlengths.js", `
+	$recvBatch(function(msgs) {
+		$send(msgs.map(function(msg) { return msg.length; }).join(","));
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := worker.SendBatch([]string{"a\x00b", "", "c"}); err != nil {
+		t.Fatal(err)
+	}
+	if got, want := strings.Join(caught, ","), "3,0,1"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+}
+
+func TestSendAsync(t *testing.T) {
+	worker := &Worker{}
+	err := worker.LoadScript("async.js", `
+	var count = 0;
+	$recv(function(msg) {
+		if (msg === "bad") {
+			throw new Error("bad message");
+		}
+		count++;
+	});
+	$recvSync(function(msg) { return msg + ":" + count; });
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	var results []<-chan Result
+	for i := 0; i < 100; i++ {
+		results = append(results, worker.SendAsync("hello"))
+	}
+	bad := worker.SendAsync("bad")
+	final := worker.SendSyncAsync("count")
+	for _, ch := range results {
+		if res := <-ch; res.Err != nil {
+			t.Fatal(res.Err)
+		}
+	}
+	if res := <-bad; res.Err == nil {
+		t.Error("Expected error")
+	}
+	res := <-final
+	if got, want := res.Response, "count:100"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+	// Messages and responses are passed with their lengths.
+	res = <-worker.SendSyncAsync("a\x00b")
+	if got, want := res.Response, "a\x00b:100"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+	worker.Dispose()
+}
+
+func TestSendSyncPromise(t *testing.T) {
+	worker := &Worker{
+		HandleSendAsync: func(msg string) (string, error) {
+			time.Sleep(10 * time.Millisecond)
+			if msg == "bad" {
+				return "", errors.New("bad message")
+			}
+			return "async " + msg, nil
+		},
+	}
+	err := worker.LoadScript("promise.js", `
+	$recvSync(function(msg) {
+		return Promise.all([$sendAsync(msg), $sendAsync(msg + "2")])
+			.then(function(r) { return r.join(","); });
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	response, err := worker.SendSync("x")
+	if err != nil {
+		t.Fatal(err)
+	}
+	if got, want := response, "async x,async x2"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+	response, _ = worker.SendSync("bad")
+	if got, want := response, "v8worker: promise rejected: Error: bad message"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+	err = worker.LoadScript("pending.js", `
+	$recvSync(function(msg) { return new Promise(function() {}); });
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	response, _ = worker.SendSync("never")
+	if got, want := response, "v8worker: promise was never settled"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+}
+
+func TestDisposeWhileAwaiting(t *testing.T) {
+	release := make(chan struct{})
+	started := make(chan struct{})
+	worker := &Worker{
+		HandleSendAsync: func(msg string) (string, error) {
+			close(started)
+			<-release
+			return "late", nil
+		},
+	}
+	err := worker.LoadScript("await.js", `
+	$recvSync(function(msg) { return $sendAsync(msg); });
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	result := worker.SendSyncAsync("wait")
+	<-started
+	done := make(chan struct{})
+	go func() {
+		worker.Dispose()
+		close(done)
+	}()
+	select {
+	case <-done:
+	case <-time.After(5 * time.Second):
+		t.Fatal("Dispose blocked on a pending settlement")
+	}
+	close(release)
+	res := <-result
+	if got, want := res.Response, "v8worker: worker has been disposed"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+}
+
+func TestInstanceIDReuse(t *testing.T) {
+	first := &Worker{}
+	if err := first.LoadScript("first.js", ""); err != nil {
+		t.Fatal(err)
+	}
+	id := first.instance.id
+	first.Dispose()
+	second := &Worker{}
+	defer second.Dispose()
+	if err := second.LoadScript("second.js", ""); err != nil {
+		t.Fatal(err)
+	}
+	if second.instance.id == id {
+		t.Errorf("id %d was reused as is", id)
+	}
+	if getInstance(id) != goneInstance {
+		t.Error("the disposed Worker's id still resolves to an instance")
+	}
+}
+
+func TestSendAsyncDuringSyncCall(t *testing.T) {
+	release := make(chan struct{})
+	started := make(chan struct{})
+	worker := &Worker{
+		HandleSendSync: func(msg string) (string, error) {
+			close(started)
+			<-release
+			return msg, nil
+		},
+	}
+	err := worker.LoadScript("block.js", `
+	var count = 0;
+	$recv(function(msg) {
+		if (msg === "block") {
+			$sendSync(msg);
+		} else {
+			count++;
+		}
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	blocked := make(chan error, 1)
+	go func() {
+		blocked <- worker.Send("block")
+	}()
+	<-started
+	queued := make(chan (<-chan Result))
+	go func() {
+		queued <- worker.SendAsync("async")
+	}()
+	var result <-chan Result
+	select {
+	case result = <-queued:
+	case <-time.After(5 * time.Second):
+		t.Fatal("SendAsync blocked behind a sync call")
+	}
+	close(release)
+	if err := <-blocked; err != nil {
+		t.Fatal(err)
+	}
+	if res := <-result; res.Err != nil {
+		t.Fatal(res.Err)
+	}
+	worker.Dispose()
+}
+
+func TestHeapLimit(t *testing.T) {
+	worker := &Worker{Limits: Limits{MaxOldSpaceMB: 16}}
+	limit := worker.Stats().HeapSizeLimit
+	for i := 0; i < 5; i++ {
+		err := worker.LoadScript("grow.js", `
+	var hoard = [];
+	while (true) {
+		hoard.push(new Array(100000).fill("x"));
+	}
+`)
+		if err != ErrHeapLimit {
+			t.Fatalf("got %v want ErrHeapLimit", err)
+		}
+		if err := worker.Reset(); err != nil {
+			t.Fatal(err)
+		}
+	}
+	if got := worker.Stats().HeapSizeLimit; got > limit*3/2 {
+		t.Errorf("heap limit grew from %d to %d", limit, got)
+	}
+	if err := worker.LoadScript("ok.js", `var ok = true;`); err != nil {
+		t.Fatal(err)
+	}
+	// A limit reached by a call whose error isn't read through the Worker
+	// mustn't be blamed on the next one.
+	err := worker.LoadScript("handler.js", `
+	$recv(function(msg) {
+		var hoard = [];
+		while (true) {
+			hoard.push(new Array(100000).fill("x"));
+		}
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if result := <-worker.SendAsync("grow"); result.Err == nil {
+		t.Fatal("expected the async call to fail")
+	}
+	if err := worker.LoadScript("bad.js", `}`); err == nil || err == ErrHeapLimit {
+		t.Errorf("got %v want a SyntaxError", err)
+	}
+}
+
+func TestBuiltinModule(t *testing.T) {
+	modules := map[string]string{
+		"main.js": `
+		import { send } from 'builtin:worker';
+		import './dep.js';
+		send(typeof $sendSync);
+`,
+		"dep.js":     `import { recv } from 'builtin:worker';`,
+		"missing.js": `import 'builtin:missing';`,
+		"print.js":   `import { print } from 'builtin:worker';`,
+	}
+	var fetched []string
+	var caught string
+	worker := &Worker{
+		GetModuleSource: func(url string) (string, error) {
+			fetched = append(fetched, url)
+			return modules[url], nil
+		},
+		HandleSend: func(msg string) error {
+			caught = msg
+			return nil
+		},
+	}
+	if err := worker.LoadModule("main.js"); err != nil {
+		t.Fatal(err)
+	}
+	if got, want := caught, "function"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+	for _, url := range fetched {
+		if strings.HasPrefix(url, "builtin:") {
+			t.Errorf("fetched %s from Go", url)
+		}
+	}
+	err := worker.LoadModule("missing.js")
+	if err == nil || !strings.Contains(err.Error(), "builtin:missing") {
+		t.Errorf("got %v want an unknown builtin module error", err)
+	}
+	// print isn't exported unless it's enabled.
+	if err := worker.LoadModule("print.js"); err == nil {
+		t.Error("expected importing print to fail without EnablePrint")
+	}
+}
+
+func TestContexts(t *testing.T) {
+	snapshot, err := NewSnapshot(&Worker{}, func(w *Worker) error {
+		return w.LoadScript("warm.js", `var tenant = 'none';`)
+	})
+	if err != nil {
+		t.Fatal(err)
+	}
+	var got []string
+	handler := func(name string) func(string) error {
+		return func(msg string) error {
+			got = append(got, name+":"+msg)
+			return nil
+		}
+	}
+	parent := &Worker{HandleSend: handler("parent"), Snapshot: snapshot}
+	a := &Worker{HandleSend: handler("a"), Parent: parent}
+	b := &Worker{HandleSend: handler("b"), Parent: parent}
+	defer a.Dispose()
+	defer b.Dispose()
+	if err := a.LoadScript("a.js", `tenant = 'a';`); err != nil {
+		t.Fatal(err)
+	}
+	if err := b.LoadScript("b.js", `$send(tenant);`); err != nil {
+		t.Fatal(err)
+	}
+	if err := parent.LoadScript("p.js", `$send(tenant);`); err != nil {
+		t.Fatal(err)
+	}
+	// The contexts keep the shared VM instance alive.
+	parent.Dispose()
+	if err := a.LoadScript("a2.js", `$send(tenant);`); err != nil {
+		t.Fatal(err)
+	}
+	want := []string{"b:none", "parent:none", "a:a"}
+	if strings.Join(got, ",") != strings.Join(want, ",") {
+		t.Errorf("got %v want %v", got, want)
+	}
+}
+
+func TestOutbox(t *testing.T) {
+	received := make(chan string, 100)
+	worker := &Worker{
+		HandleSend: func(msg string) error {
+			received <- msg
+			return nil
+		},
+		HandleSendSync: func(msg string) (string, error) {
+			return msg + "!", nil
+		},
+		Outbox: 4,
+	}
+	err := worker.LoadScript("outbox.js", `
+	for (var i = 0; i < 100; i++) {
+		$send(String(i));
+	}
+	$send($sendSync('done'));
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for idx := 0; idx <= 100; idx++ {
+		want := fmt.Sprint(idx)
+		if idx == 100 {
+			want = "done!"
+		}
+		select {
+		case msg := <-received:
+			if msg != want {
+				t.Fatalf("got %q want %q", msg, want)
+			}
+		case <-time.After(5 * time.Second):
+			t.Fatalf("timed out waiting for message %d", idx)
+		}
+	}
+	worker.Dispose()
+}
+
+type errorReader struct{}
+
+func (errorReader) Read(p []byte) (int, error) {
+	return 0, errors.New("read failed")
+}
+
+func TestLoadScriptFrom(t *testing.T) {
+	var caught string
+	worker := &Worker{
+		HandleSend: func(msg string) error {
+			caught = msg
+			return nil
+		},
+	}
+	defer worker.Dispose()
+	// A source spanning several chunks, with multi-byte characters.
+	source := strings.Repeat("var s = 'héllo wörld';\n", 10000) + "$send(s);"
+	err := worker.LoadScriptFrom("big.js", strings.NewReader(source))
+	if err != nil {
+		t.Fatal(err)
+	}
+	if got, want := caught, "héllo wörld"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+	err = worker.LoadScriptFrom("bad.js", strings.NewReader("var = ;"))
+	if err == nil || !strings.Contains(err.Error(), "SyntaxError") {
+		t.Errorf("got %v want a SyntaxError", err)
+	}
+	err = worker.LoadScriptFrom("error.js", errorReader{})
+	if err == nil || err.Error() != "read failed" {
+		t.Errorf("got %v want the reader's error", err)
+	}
+}
+
+func TestMappedModules(t *testing.T) {
+	dir, err := ioutil.TempDir("", "v8worker")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	main := `import './dep.js'; $recv(function handler() { $send(handler.toString()); });`
+	dep := `$send('dép');`
+	path := filepath.Join(dir, "bundle.js")
+	if err := ioutil.WriteFile(path, []byte(main+dep), 0644); err != nil {
+		t.Fatal(err)
+	}
+	m, err := MapFile(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	data := m.Bytes()
+	var got []string
+	worker := &Worker{
+		GetModuleBytes: func(url string) ([]byte, error) {
+			if url == "./dep.js" {
+				return data[len(main):], nil
+			}
+			return data[:len(main)], nil
+		},
+		HandleSend: func(msg string) error {
+			got = append(got, msg)
+			return nil
+		},
+	}
+	defer worker.Dispose()
+	if err := worker.LoadModule("main.js"); err != nil {
+		t.Fatal(err)
+	}
+	// The source stays mapped for as long as the Worker uses it.
+	if err := m.Close(); err != nil {
+		t.Fatal(err)
+	}
+	if err := worker.Send("source"); err != nil {
+		t.Fatal(err)
+	}
+	want := []string{"dép", "function handler() { $send(handler.toString()); }"}
+	if strings.Join(got, "|") != strings.Join(want, "|") {
+		t.Errorf("got %q want %q", got, want)
+	}
+	if err := m.Close(); err == nil {
+		t.Error("expected an error for closing a MappedFile twice")
+	}
+}
+
+func TestBundle(t *testing.T) {
+	modules := map[string]string{
+		"app/main.js": `
+		import { b } from './lib/b.js';
+		import { send } from 'builtin:worker';
+		send(b);
+`,
+		"app/lib/b.js": `import { c } from '../c.js'; export const b = 'b' + c;`,
+		"app/c.js":     `export const c = 'c';`,
+	}
+	resolve := func(url string, importer string) (string, error) {
+		return path.Join(path.Dir(importer), url), nil
+	}
+	builder := &Worker{
+		GetModuleSource: func(url string) (string, error) {
+			return modules[url], nil
+		},
+		ResolveModuleURL: resolve,
+	}
+	defer builder.Dispose()
+	bundle, err := builder.CreateBundle("app/main.js")
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	var caught string
+	worker := &Worker{
+		HandleSend: func(msg string) error {
+			caught = msg
+			return nil
+		},
+	}
+	defer worker.Dispose()
+	if err := worker.LoadBundle(bundle); err != nil {
+		t.Fatal(err)
+	}
+	if got, want := caught, "bc"; got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+	if err := worker.LoadBundle(bundle[:len(bundle)/2]); err == nil {
+		t.Error("expected an error for a truncated bundle")
+	}
+}
+
+func TestResolveModuleURLError(t *testing.T) {
+	worker := &Worker{
+		GetModuleSource: func(url string) (string, error) {
+			return `import "missing.js";`, nil
+		},
+		ResolveModuleURL: func(url string, importer string) (string, error) {
+			return "", errors.New("no such module")
+		},
+	}
+	defer worker.Dispose()
+	for _, load := range []func(string) error{
+		worker.LoadModule,
+		func(url string) error {
+			_, err := worker.CreateBundle(url)
+			return err
+		},
+	} {
+		err := load("main.js")
+		if err == nil {
+			t.Fatal("expected an error")
+		}
+		if !strings.Contains(err.Error(), "no such module") {
+			t.Errorf("got %q want it to mention the resolve error", err)
+		}
+	}
+}
+
+func TestPlatform(t *testing.T) {
+	worker := &Worker{}
+	defer worker.Dispose()
+	// V8 resolves WebAssembly.compile from a foreground task, so the promise
+	// stays pending until the message loop is pumped.
+	err := worker.LoadScript("platform.js", `
+	var compiled = false;
+	WebAssembly.compile(new Uint8Array([0, 97, 115, 109, 1, 0, 0, 0]))
+		.then(function() { compiled = true; });
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := ConfigurePlatform(PlatformOptions{ThreadPoolSize: 1}); err == nil {
+		t.Error("expected an error once V8 has been initialised")
+	}
+	tasks := 0
+	deadline := time.Now().Add(5 * time.Second)
+	for {
+		tasks += worker.PumpMessageLoop()
+		// The then callback runs as a microtask once a script completes, so
+		// the check passes at most one iteration after the settlement.
+		if err := worker.LoadScript("check.js", `
+	if (!compiled) throw new Error("pending");
+`); err == nil {
+			break
+		}
+		if time.Now().After(deadline) {
+			t.Fatal("WebAssembly.compile didn't settle")
+		}
+		time.Sleep(time.Millisecond)
+	}
+	if tasks == 0 {
+		t.Error("expected PumpMessageLoop to run at least one task")
+	}
+}
+
+func TestIdleGC(t *testing.T) {
+	worker := &Worker{}
+	defer worker.Dispose()
+	err := worker.LoadScript("garbage.js", `
+	var garbage = [];
+	for (var i = 0; i < 100000; i++) garbage.push({i: i});
+	garbage = null;
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	// Critical pressure from a thread which doesn't hold the VM makes V8
+	// interrupt the next call for a full GC.
+	before := worker.GCStats()
+	worker.MemoryPressure(MemoryPressureCritical)
+	if err := worker.LoadScript("tick.js", `for (var i = 0; i < 1e6; i++) {}`); err != nil {
+		t.Fatal(err)
+	}
+	worker.MemoryPressure(MemoryPressureNone)
+	stats := worker.GCStats()
+	if stats.MajorCount <= before.MajorCount {
+		t.Errorf("got %d major GCs after critical pressure, want more than %d",
+			stats.MajorCount, before.MajorCount)
+	}
+
+	// Idle reports once V8 has run out of GC work.
+	err = worker.LoadScript("garbage2.js", `
+	var garbage = [];
+	for (var i = 0; i < 100000; i++) garbage.push({i: i});
+	garbage = null;
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if worker.Idle(time.Now().Add(-time.Second)) {
+		t.Error("expected a past deadline to leave GC work")
+	}
+	done := false
+	for i := 0; i < 100 && !done; i++ {
+		done = worker.Idle(time.Now().Add(10 * time.Millisecond))
+	}
+	if !done {
+		t.Error("expected Idle to run out of GC work")
+	}
+}
+
+func TestError(t *testing.T) {
+	worker := &Worker{}
+	defer worker.Dispose()
+	err := worker.LoadScript("throw.js", `
+	function fail() {
+		throw new TypeError("bad input");
+	}
+	fail();
+`)
+	e, ok := err.(*Error)
+	if !ok {
+		t.Fatalf("got %#v want an *Error", err)
+	}
+	if got, want := e.Message, "TypeError: bad input"; got != want {
+		t.Errorf("got message %q want %q", got, want)
+	}
+	if e.File != "throw.js" || e.Line != 3 || e.Column == 0 {
+		t.Errorf("got location %s:%d:%d want throw.js:3", e.File, e.Line, e.Column)
+	}
+	want := fmt.Sprintf("throw.js:3:%d: TypeError: bad input", e.Column)
+	if got := e.Error(); got != want {
+		t.Errorf("got %q want %q", got, want)
+	}
+	stack := e.Stack()
+	if !strings.Contains(stack, "^") || !strings.Contains(stack, "at fail (throw.js:3:") {
+		t.Errorf("got stack %q", stack)
+	}
+
+	err = worker.LoadScript("later.js", `throw new Error("later");`)
+	if err == nil {
+		t.Fatal("expected an error")
+	}
+	if err := worker.Reset(); err != nil {
+		t.Fatal(err)
+	}
+	later := err.(*Error)
+	if got, want := later.Stack(), later.Error(); got != want {
+		t.Errorf("got stack %q after reset want %q", got, want)
+	}
+	if got := e.Stack(); got != stack {
+		t.Errorf("got stack %q want the rendered one to be kept", got)
+	}
+}
+
+func TestResetReleasesContexts(t *testing.T) {
+	modules := map[string]string{
+		"main.js": `import { dep } from "dep.js"; $recvSync(function() { return dep; });`,
+		"dep.js":  `export const dep = "dep";`,
+	}
+	worker := &Worker{
+		GetModuleSource: func(url string) (string, error) {
+			return modules[url], nil
+		},
+	}
+	defer worker.Dispose()
+	for i := 0; i < 20; i++ {
+		if err := worker.LoadModule("main.js"); err != nil {
+			t.Fatal(err)
+		}
+		if err := worker.Reset(); err != nil {
+			t.Fatal(err)
+		}
+	}
+	worker.LowMemory()
+	stats := worker.Stats()
+	if stats.NativeContexts > 2 || stats.DetachedContexts > 0 {
+		t.Errorf("got %d native and %d detached contexts after resets",
+			stats.NativeContexts, stats.DetachedContexts)
+	}
+	if err := worker.LoadModule("main.js"); err != nil {
+		t.Fatal(err)
+	}
+	if got, _ := worker.SendSync(""); got != "dep" {
+		t.Errorf("got %q want %q", got, "dep")
+	}
+}
+
+func TestTraceStats(t *testing.T) {
+	worker := &Worker{
+		HandleSend: func(msg string) error { return nil },
+		HandleSendSync: func(msg string) (string, error) {
+			return msg, nil
+		},
+	}
+	defer worker.Dispose()
+	err := worker.LoadScript("trace.js", `
+	$recv(function(msg) { $send(msg); });
+	$recvSync(function(msg) { return $sendSync(msg); });
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for i := 0; i < 10; i++ {
+		if err := worker.Send("ping"); err != nil {
+			t.Fatal(err)
+		}
+		if _, err := worker.SendSync("ping"); err != nil {
+			t.Fatal(err)
+		}
+	}
+	stats, ok := worker.TraceStats()
+	if ok != traceEnabled {
+		t.Fatalf("got ok %v want %v", ok, traceEnabled)
+	}
+	if !ok {
+		return
+	}
+	for name, phases := range map[string]TracePhases{"Send": stats.Send, "SendSync": stats.SendSync} {
+		for phase, h := range map[string]TraceHistogram{
+			"Call": phases.Call, "Lock": phases.Lock, "Enter": phases.Enter, "Exec": phases.Exec,
+		} {
+			if h.Count != 10 {
+				t.Errorf("%s.%s: got %d calls want 10", name, phase, h.Count)
+			}
+		}
+		if phases.Call.Mean() < phases.Exec.Mean() {
+			t.Errorf("%s: got a call shorter than its execution", name)
+		}
+	}
+	if got := stats.SendSync.Return.Count; got != 10 {
+		t.Errorf("SendSync.Return: got %d calls want 10", got)
+	}
+	for name, h := range map[string]TraceHistogram{
+		"JSSend.Enter":      stats.JSSend.Enter,
+		"JSSend.Exec":       stats.JSSend.Exec,
+		"JSSendSync.Enter":  stats.JSSendSync.Enter,
+		"JSSendSync.Exec":   stats.JSSendSync.Exec,
+		"JSSendSync.Return": stats.JSSendSync.Return,
+	} {
+		if h.Count != 10 {
+			t.Errorf("%s: got %d calls want 10", name, h.Count)
+		}
+	}
+}
+
+func TestTimeout(t *testing.T) {
+	worker := &Worker{Limits: Limits{Timeout: 50 * time.Millisecond}}
+	start := time.Now()
+	err := worker.LoadScript("spin.js", `
+	$recvSync(function(msg) {
+		while (true) {}
+	});
+	while (true) {}
+`)
+	if err != ErrTimeout {
+		t.Fatalf("got %v want ErrTimeout", err)
+	}
+	if elapsed := time.Since(start); elapsed > 5*time.Second {
+		t.Errorf("took %s to time out", elapsed)
+	}
+	// The Worker can be reused straight away.
+	if err := worker.LoadScript("ok.js", `var ok = true;`); err != nil {
+		t.Fatal(err)
+	}
+	err = worker.LoadScript("handler.js", `
+	$recvSync(function(msg) {
+		while (true) {}
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if _, err := worker.SendSync("spin"); err != ErrTimeout {
+		t.Fatalf("got %v want ErrTimeout", err)
+	}
+	err = worker.LoadScript("batch.js", `
+	$recv(function(msg) {
+		while (true) {}
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := worker.SendBatch([]string{"a", "b"}); err != ErrTimeout {
+		t.Fatalf("got %v want ErrTimeout", err)
+	}
+}
+
+func TestCPUBudget(t *testing.T) {
+	worker := &Worker{Limits: Limits{CPUBudget: 100 * time.Millisecond}}
+	err := worker.LoadScript("spin.js", `while (true) {}`)
+	if err != ErrCPUBudget {
+		t.Fatalf("got %v want ErrCPUBudget", err)
+	}
+	if err := worker.LoadScript("ok.js", `var ok = true;`); err != ErrCPUBudget {
+		t.Fatalf("got %v want ErrCPUBudget once the budget is used up", err)
+	}
+	if err := worker.Reset(); err != nil {
+		t.Fatal(err)
+	}
+	if err := worker.LoadScript("ok.js", `var ok = true;`); err != nil {
+		t.Fatal(err)
+	}
+}
+
+func TestCPUProfile(t *testing.T) {
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+
+	worker := &Worker{}
+	defer worker.Dispose()
+	if err := worker.StartCPUProfile(100 * time.Microsecond); err != nil {
+		t.Fatal(err)
+	}
+	err := worker.LoadScript("hot.js", `
+	function hot() {
+		var sum = 0;
+		for (var i = 0; i < 1000; i++) {
+			sum += Math.sqrt(i);
+		}
+		return sum;
+	}
+	var end = Date.now() + 200;
+	while (Date.now() < end) {
+		hot();
+	}
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	var buf bytes.Buffer
+	if err := worker.StopCPUProfile(&buf); err != nil {
+		t.Fatal(err)
+	}
+	zr, err := gzip.NewReader(&buf)
+	if err != nil {
+		t.Fatal(err)
+	}
+	profile, err := ioutil.ReadAll(zr)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if !bytes.Contains(profile, []byte("hot")) {
+		t.Error("expected the profile to contain the hot function")
+	}
+	if err := worker.StopCPUProfile(&buf); err == nil {
+		t.Error("expected an error for a profile that wasn't started")
+	}
+}
+
+func TestStats(t *testing.T) {
+	worker := &Worker{}
+	err := worker.LoadScript("garbage.js", `
+	for (var i = 0; i < 100000; i++) {
+		var garbage = {index: i, payload: new Array(16)};
+	}
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	stats := worker.Stats()
+	if stats.UsedHeapSize == 0 || stats.HeapSizeLimit == 0 {
+		t.Errorf("missing heap stats: %+v", stats)
+	}
+	if len(stats.HeapSpaces) == 0 || stats.HeapSpaces[0].Name == "" {
+		t.Errorf("missing heap space stats: %+v", stats.HeapSpaces)
+	}
+	if stats.GC.MinorCount == 0 {
+		t.Errorf("expected at least one minor GC: %+v", stats.GC)
+	}
+	if got := worker.GCStats(); got.MinorCount < stats.GC.MinorCount {
+		t.Errorf("got %+v want at least %+v", got, stats.GC)
+	}
+}
+
+func TestPoolAllocator(t *testing.T) {
+	worker := &Worker{ArrayBufferAllocator: PoolAllocator}
+	err := worker.LoadScript("buffers.js", `
+	for (var i = 0; i < 100000; i++) {
+		var buffer = new Uint8Array(1024);
+		buffer[0] = i;
+	}
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	stats := worker.Stats().ArrayBuffers
+	if stats.Allocations < 100000 {
+		t.Errorf("expected at least 100000 allocations: %+v", stats)
+	}
+	if stats.PooledAllocations == 0 {
+		t.Errorf("expected freed buffers to be reused: %+v", stats)
+	}
+	if stats.PeakOutstandingBytes < stats.OutstandingBytes {
+		t.Errorf("peak below outstanding bytes: %+v", stats)
+	}
+	worker.LowMemory()
+	if got := worker.Stats().ArrayBuffers; got.CachedBytes != 0 {
+		t.Errorf("expected LowMemory to release cached memory: %+v", got)
+	}
+}
+
+func TestSendSyncStrings(t *testing.T) {
+	var sent, synced []string
+	worker := &Worker{
+		HandleSend: func(msg string) error {
+			sent = append(sent, msg)
+			return nil
+		},
+		HandleSendSync: func(msg string) (string, error) {
+			synced = append(synced, msg)
+			return msg, nil
+		},
+	}
+	// The response comes back through $sendSync, so it covers both ways.
+	err := worker.LoadScript("echo.js", `
+	$recvSync(function(msg) {
+		$send(msg);
+		return $sendSync(msg);
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	// Cover empty, null bytes, non-ASCII, external and larger than the result
+	// buffer.
+	msgs := []string{
+		"",
+		"ascii",
+		"null\x00byte",
+		"caf\u00e9 \u65e5\u672c \U0001f600",
+		strings.Repeat("x", resultBufferSize+1),
+		strings.Repeat("\u00e9", resultBufferSize),
+		strings.Repeat("{\"key\": 1}", 4096),
+	}
+	for _, msg := range msgs {
+		resp, err := worker.SendSync(msg)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if resp != msg {
+			t.Errorf("got response of length %d, want %d", len(resp), len(msg))
+		}
+	}
+	if len(sent) != len(msgs) {
+		t.Fatalf("got %d messages from $send, want %d", len(sent), len(msgs))
+	}
+	for idx, msg := range msgs {
+		if sent[idx] != msg {
+			t.Errorf("got $send of length %d, want %d", len(sent[idx]), len(msg))
+		}
+	}
+	if len(synced) != len(msgs) {
+		t.Fatalf("got %d messages from $sendSync, want %d", len(synced), len(msgs))
+	}
+	for idx, msg := range msgs {
+		if synced[idx] != msg {
+			t.Errorf("got $sendSync of length %d, want %d", len(synced[idx]), len(msg))
+		}
+	}
+}
+
+func TestSendValue(t *testing.T) {
+	var received []string
+	dst := &Worker{
+		HandleSend: func(msg string) error {
+			received = append(received, msg)
+			return nil
+		},
+	}
+	err := dst.LoadScript("dst.js", `
+	$recvValue(function(value) {
+		$send(value.name + ":" + value.items.length + ":" +
+			(value.when instanceof Date) + ":" + value.bytes[2]);
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	// Values produced by one Worker are passed straight to another.
+	src := &Worker{
+		HandleSendValue: func(data []byte) error {
+			return dst.SendValue(data)
+		},
+	}
+	err = src.LoadScript("src.js", `
+	$sendValue({
+		name: "test",
+		items: [1, 2, 3],
+		when: new Date(),
+		bytes: new Uint8Array([1, 2, 3]),
+	});
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(received) != 1 || received[0] != "test:3:true:3" {
+		t.Errorf("got %q", received)
+	}
+	err = src.LoadScript("uncloneable.js", `$sendValue(function() {});`)
+	if err == nil {
+		t.Error("expected an error when sending an uncloneable value")
+	}
+	if err := dst.SendValue([]byte("garbage")); err == nil {
+		t.Error("expected an error when sending invalid data")
+	}
+}
+
+func TestChannel(t *testing.T) {
+	received := make(chan string, 10)
+	dst := &Worker{
+		HandleSend: func(msg string) error {
+			received <- msg
+			return nil
+		},
+	}
+	src := &Worker{}
+	ch := NewChannel(4)
+	if err := src.AttachChannel("out", ch, false); err != nil {
+		t.Fatal(err)
+	}
+	// Values posted before the receiver is attached are held.
+	err := src.LoadScript("src.js", `
+	var out = $channel("out");
+	var posted = [];
+	for (var i = 0; i < 6; i++) {
+		posted.push(out.post({index: i}));
+	}
+	$recv(function() {
+		out.post({index: "last"});
+	});
+	if (posted.join() !== "true,true,true,true,false,false") {
+		throw new Error("unexpected results: " + posted.join());
+	}
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := dst.AttachChannel("in", ch, true); err != nil {
+		t.Fatal(err)
+	}
+	if err := src.AttachChannel("in", ch, true); err == nil {
+		t.Error("expected an error when attaching a second receiver")
+	}
+	err = dst.LoadScript("dst.js", `
+	$channel("in").onmessage = function(value) {
+		$send(String(value.index));
+	};
+`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := src.Send(""); err != nil {
+		t.Fatal(err)
+	}
+	var got []string
+	for len(got) < 5 {
+		select {
+		case msg := <-received:
+			got = append(got, msg)
+		case <-time.After(5 * time.Second):
+			t.Fatalf("timed out with %q", got)
+		}
+	}
+	if strings.Join(got, ",") != "0,1,2,3,last" {
+		t.Errorf("got %q", got)
+	}
+	if err := dst.LoadScript("missing.js", `$channel("missing")`); err == nil {
+		t.Error("expected an error for a missing channel")
+	}
+	src.Dispose()
+	dst.Dispose()
+}
+
+func TestRegistry(t *testing.T) {
+	// Span more than one chunk so that chunk allocation is exercised.
+	workers := make([]*Worker, registryChunkSize+10)
+	ids := map[int32]bool{}
+	slots := map[int32]bool{}
+	for n := range workers {
+		w := &Worker{}
+		w.instance = w.register()
+		if getInstance(w.instance.id) != w.instance {
+			t.Fatalf("lookup of id %d failed", w.instance.id)
+		}
+		ids[w.instance.id] = true
+		slots[w.instance.id&registrySlotMask] = true
+		workers[n] = w
+	}
+	if len(ids) != len(workers) {
+		t.Fatalf("got %d unique ids for %d workers", len(ids), len(workers))
+	}
+
+	freed := workers[len(workers)-1].instance.id
+	for _, w := range workers {
+		id := w.instance.id
+		w.unregister()
+		if getInstance(id) != goneInstance {
+			t.Fatalf("id %d still registered after removal", id)
+		}
+	}
+
+	w := &Worker{}
+	w.instance = w.register()
+	defer w.unregister()
+	id := w.instance.id
+	if !slots[id&registrySlotMask] {
+		t.Errorf("expected a freed slot to be reused, got id %d (last freed %d)",
+			id, freed)
+	}
+	if ids[id] {
+		t.Errorf("expected a reused slot to get a new generation, got id %d",
+			id)
+	}
+}